@@ -18,9 +18,11 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "mgos_event.h"
+#include "mgos_net.h"
 #include "mgos_sys_config.h"
 
 #ifdef __cplusplus
@@ -42,6 +44,8 @@ enum mgos_wifi_event {
   MGOS_WIFI_EV_STA_IP_ACQUIRED,     /* Arg: NULL */
   MGOS_WIFI_EV_AP_STA_CONNECTED,    /* Arg: mgos_wifi_ap_sta_connected_arg */
   MGOS_WIFI_EV_AP_STA_DISCONNECTED, /* Arg: mgos_wifi_ap_sta_disconnected_arg */
+  MGOS_WIFI_EV_STA_RSSI_LOW,        /* Arg: mgos_wifi_sta_rssi_low_arg */
+  MGOS_WIFI_EV_STA_ROAMED,          /* Arg: mgos_wifi_sta_roamed_arg */
 };
 
 struct mgos_wifi_sta_connected_arg {
@@ -50,10 +54,45 @@ struct mgos_wifi_sta_connected_arg {
   int rssi;
 };
 
+/*
+ * Why the station was disconnected or failed to connect, see
+ * `struct mgos_wifi_sta_disconnected_arg`.
+ */
+enum mgos_wifi_disconnect_reason {
+  MGOS_WIFI_DISCONNECT_REASON_UNSPECIFIED = 0,
+  MGOS_WIFI_DISCONNECT_REASON_LOCAL = 1,          /* We disconnected */
+  MGOS_WIFI_DISCONNECT_REASON_DEAUTH = 2,         /* AP disconnected us */
+  MGOS_WIFI_DISCONNECT_REASON_BEACON_TIMEOUT = 3, /* AP is no longer heard */
+  MGOS_WIFI_DISCONNECT_REASON_NO_AP_FOUND = 4,
+  /* Wrong password, failed 802.1X authentication. */
+  MGOS_WIFI_DISCONNECT_REASON_AUTH_FAIL = 5,
+  MGOS_WIFI_DISCONNECT_REASON_ASSOC_FAIL = 6, /* AP rejected association */
+  MGOS_WIFI_DISCONNECT_REASON_AP_FULL = 7,    /* AP has too many stations */
+  /* Left the AP to move to another one, see mgos_wifi_dev_sta_roam(). */
+  MGOS_WIFI_DISCONNECT_REASON_ROAM = 8,
+  /*
+   * Key handshake did not complete. May be a wrong password, may as well be
+   * lost frames on a weak link.
+   */
+  MGOS_WIFI_DISCONNECT_REASON_HANDSHAKE_TIMEOUT = 9,
+  MGOS_WIFI_DISCONNECT_REASON_MAX,
+};
+
 struct mgos_wifi_sta_disconnected_arg {
-  /* Note that at present this field is only supported on some platforms
-   * and the nomenclature of codes is not standardized. */
-  uint8_t reason;
+  enum mgos_wifi_disconnect_reason reason;
+  /* Reason code as reported by the platform, nomenclature varies. */
+  int raw_reason;
+};
+
+struct mgos_wifi_sta_rssi_low_arg {
+  int rssi;
+};
+
+/* Chip moved to another AP of the same network on its own, IP is kept. */
+struct mgos_wifi_sta_roamed_arg {
+  uint8_t bssid[6];
+  int channel;
+  int rssi;
 };
 
 struct mgos_wifi_ap_sta_connected_arg {
@@ -160,10 +199,31 @@ enum mgos_wifi_status {
 };
 
 /*
- * Get wifi status, see `enum mgos_wifi_status`.
+ * Get wifi status, see `enum mgos_wifi_status`. Does not take locks and can
+ * be called from any task.
  */
 enum mgos_wifi_status mgos_wifi_get_status(void);
 
+/* Station connection state, see `mgos_wifi_sta_get_snapshot()`. */
+struct mgos_wifi_sta_snapshot {
+  enum mgos_wifi_status status;
+  char ssid[33];          /* Empty if not connected */
+  uint8_t bssid[6];       /* Zero if not connected */
+  int channel;            /* 0 if not connected */
+  int rssi;               /* Last sample, dBm; 0 if none yet */
+  struct sockaddr_in ip;  /* Zero if IP address has not been acquired */
+  uint32_t link_uptime_s; /* Time since association */
+};
+
+/*
+ * Fills in a consistent copy of the station state without taking locks or
+ * allocating, so it can be polled from any task or core. The copy is updated
+ * by the station as things change, RSSI as it is sampled.
+ * Returns false if the state kept changing while it was being read, which
+ * can only happen if the caller interrupted an update.
+ */
+bool mgos_wifi_sta_get_snapshot(struct mgos_wifi_sta_snapshot *snap);
+
 /*
  * Return wifi status string; the caller should free it.
  */
@@ -181,12 +241,36 @@ char *mgos_wifi_get_connected_ssid(void);
  */
 char *mgos_wifi_get_sta_default_dns(void);
 
+/*
+ * Same as the above, but write into the caller's buffer of `len` bytes
+ * and return `buf`, or `NULL` if there is nothing to return or it does not
+ * fit. These do not allocate. A buffer of 33 bytes fits any SSID, 16 bytes
+ * fit an IP address or a status string.
+ */
+char *mgos_wifi_get_status_str_r(char *buf, size_t len);
+char *mgos_wifi_get_connected_ssid_r(char *buf, size_t len);
+char *mgos_wifi_get_sta_default_dns_r(char *buf, size_t len);
+
+/*
+ * Returns name of the disconnect reason, e.g. "auth_fail".
+ */
+const char *mgos_wifi_disconnect_reason_str(
+    enum mgos_wifi_disconnect_reason reason);
+
 /*
  * Returns RSSI of the station if connected to an AP, otherwise 0.
  * Note: RSSI is a negative number.
  */
 int mgos_wifi_sta_get_rssi(void);
 
+/*
+ * Same as `mgos_wifi_sta_get_rssi()`, but if a reading that is at most
+ * `max_age_ms` old is available, returns that instead of asking the driver.
+ * Readings also come from driver events. On some platforms reading RSSI is
+ * a slow transaction with the network processor.
+ */
+int mgos_wifi_sta_get_rssi_cached(int max_age_ms);
+
 /*
  * Auth mode for networks obtained with `mgos_wifi_scan()`.
  */
@@ -228,12 +312,141 @@ typedef void (*mgos_wifi_scan_cb_t)(int num_res,
  * Each particular scan result isn't guaranteed to be exhaustive; a few scans
  * might be necessary to get all networks around.
  *
- * Caller owns SSIDS, they are not freed by the callee.
+ * Results belong to the library, see `mgos_wifi_scan_results_ref()`.
  *
  * A note for implementations: invoking inline is ok.
  */
 void mgos_wifi_scan(mgos_wifi_scan_cb_t cb, void *arg);
 
+enum mgos_wifi_scan_type {
+  MGOS_WIFI_SCAN_TYPE_ACTIVE = 0,
+  MGOS_WIFI_SCAN_TYPE_PASSIVE = 1,
+};
+
+/*
+ * Callback for results that arrive before the scan is complete, see
+ * `struct mgos_wifi_scan_params`. `res` is only valid during the call.
+ * Return true if the rest of the scan is not needed.
+ */
+typedef bool (*mgos_wifi_scan_partial_cb_t)(
+    int num_res, const struct mgos_wifi_scan_result *res, void *arg);
+
+/*
+ * Parameters of a directed scan, see `mgos_wifi_scan_ex()`.
+ * All-zero parameters are equivalent to `mgos_wifi_scan()`.
+ */
+struct mgos_wifi_scan_params {
+  const uint8_t *channels; /* Channels to scan, NULL - all */
+  int num_channels;
+  const char *ssid; /* Only look for this network, NULL - any */
+  enum mgos_wifi_scan_type type;
+  int dwell_ms; /* Time to spend on each channel, 0 - port default */
+  /*
+   * If set, invoked with results as they come in (per channel or batch) on
+   * ports that can report them early. It is invoked with the wifi lock held,
+   * possibly from a different task, and should be quick. Returning true
+   * stops the scan, if all the requests served by the same scan agree;
+   * `cb` then gets the results found so far.
+   */
+  mgos_wifi_scan_partial_cb_t partial_cb;
+};
+
+/*
+ * Results are shared by all the callbacks interested in the same scan and
+ * must not be modified. They remain valid until the callback returns; to
+ * keep them longer, take a reference and release it when done. Returns
+ * false if `res` is not a result array being delivered.
+ */
+bool mgos_wifi_scan_results_ref(const struct mgos_wifi_scan_result *res);
+void mgos_wifi_scan_results_unref(const struct mgos_wifi_scan_result *res);
+
+/*
+ * Same as `mgos_wifi_scan()` but the scan can be limited to specific
+ * channels and/or network. Not all ports can limit the scan itself, but
+ * results that do not match the parameters are never delivered to `cb`.
+ * `params` may be NULL and need not outlive the call. A list of more than
+ * `MGOS_WIFI_SCAN_MAX_CHANNELS` (16) channels means all channels.
+ */
+void mgos_wifi_scan_ex(const struct mgos_wifi_scan_params *params,
+                       mgos_wifi_scan_cb_t cb, void *arg);
+
+/*
+ * Results of all scans, including those performed by the station when
+ * connecting and roaming, are merged into a table that remembers each BSSID
+ * for `wifi.scan_cache.ttl_ms` after it was last seen, with RSSI smoothed
+ * over the scans.
+ *
+ * Same as `mgos_wifi_scan()`, but if a scan of all channels completed within
+ * the last `max_age_ms`, answers from the table without scanning. Otherwise
+ * a scan is performed first. Either way, results come from the table, so
+ * networks missed by the most recent scan are included. `cb` is never
+ * invoked inline when answering from the table.
+ */
+void mgos_wifi_scan_cached(int max_age_ms, mgos_wifi_scan_cb_t cb, void *arg);
+
+/*
+ * Latency histogram with logarithmic buckets: bucket 0 counts values below
+ * `MGOS_WIFI_STATS_HIST_BASE_MS`, each next one covers twice the range of
+ * the previous one, the last one has no upper bound.
+ */
+#define MGOS_WIFI_STATS_HIST_BASE_MS 16
+#define MGOS_WIFI_STATS_HIST_BUCKETS 14
+
+struct mgos_wifi_stats_hist {
+  uint32_t count;
+  uint32_t max_ms;
+  uint64_t sum_ms;
+  uint32_t buckets[MGOS_WIFI_STATS_HIST_BUCKETS];
+};
+
+/*
+ * WiFi statistics since boot or `mgos_wifi_reset_stats()`.
+ */
+struct mgos_wifi_stats {
+  uint32_t scans_started;
+  uint32_t scans_failed;
+  struct mgos_wifi_stats_hist scan_ms; /* Successful scans */
+
+  uint32_t connect_attempts; /* Including roaming */
+  uint32_t connect_timeouts; /* Attempts that failed by timeout... */
+  /* ...or were rejected, by `enum mgos_wifi_disconnect_reason`. */
+  uint32_t connect_failures[MGOS_WIFI_DISCONNECT_REASON_MAX];
+  /* From the start of an attempt to association. */
+  struct mgos_wifi_stats_hist assoc_ms;
+  /* From the moment station started (re)connecting to getting an IP. */
+  struct mgos_wifi_stats_hist ip_ms;
+
+  uint32_t roams; /* Switches to a better AP initiated */
+  /* Lost connections that were established, by reason. */
+  uint32_t disconnects[MGOS_WIFI_DISCONNECT_REASON_MAX];
+
+  uint32_t events_lost;      /* Driver events dropped, queue was full */
+  uint32_t events_coalesced; /* Repeated failed attempts merged */
+};
+
+/*
+ * Get a copy of the statistics.
+ */
+void mgos_wifi_get_stats(struct mgos_wifi_stats *stats);
+
+/*
+ * Reset all the counters.
+ */
+void mgos_wifi_reset_stats(void);
+
+/*
+ * Returns an estimate of `pct` percentile of the histogram: upper bound of
+ * the bucket it falls into, or the maximum value for the last bucket.
+ * Returns -1 if the histogram is empty.
+ */
+int mgos_wifi_stats_hist_percentile(const struct mgos_wifi_stats_hist *h,
+                                    int pct);
+
+/*
+ * Returns statistics as a JSON object, the caller should free it.
+ */
+char *mgos_wifi_get_stats_json(void);
+
 /*
  * Deinitialize wifi.
  */
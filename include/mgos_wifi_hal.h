@@ -28,11 +28,77 @@
 extern "C" {
 #endif
 
+/* Scans can be limited to an SSID. */
+#define MGOS_WIFI_CAP_DIRECTED_SCAN (1 << 0)
+/* Scans can be limited to a list of up to `max_scan_channels` channels. */
+#define MGOS_WIFI_CAP_SCAN_CHANNELS (1 << 1)
+/* Results are reported with mgos_wifi_dev_scan_partial_cb() as they come. */
+#define MGOS_WIFI_CAP_SCAN_PARTIAL (1 << 2)
+/* Scanning while connected does not drop the association. */
+#define MGOS_WIFI_CAP_BG_SCAN (1 << 3)
+/* `pass` given to mgos_wifi_dev_sta_setup() can be a 64 hex digit PSK. */
+#define MGOS_WIFI_CAP_PMK (1 << 4)
+/* mgos_wifi_dev_sta_set_rssi_thr() is supported. */
+#define MGOS_WIFI_CAP_RSSI_EVENTS (1 << 5)
+/* mgos_wifi_dev_sta_roam() is supported. */
+#define MGOS_WIFI_CAP_ROAM (1 << 6)
+/* mgos_wifi_dev_sta_set_roam_offload() is supported. */
+#define MGOS_WIFI_CAP_ROAM_OFFLOAD (1 << 7)
+/* AP and station can be enabled at the same time. */
+#define MGOS_WIFI_CAP_AP_STA (1 << 8)
+
+struct mgos_wifi_dev_caps {
+  uint32_t flags;        /* MGOS_WIFI_CAP_* */
+  int max_scan_results;  /* Results of a scan are truncated to this, 0 - none */
+  int max_scan_channels; /* With MGOS_WIFI_CAP_SCAN_CHANNELS, 0 - no limit */
+};
+
+/*
+ * Report what the port and the chip can do. Called once, after
+ * mgos_wifi_dev_init(); operations that are not listed are not attempted.
+ */
+void mgos_wifi_dev_get_caps(struct mgos_wifi_dev_caps *caps);
+
 bool mgos_wifi_dev_ap_setup(const struct mgos_config_wifi_ap *cfg);
 
 bool mgos_wifi_dev_sta_setup(const struct mgos_config_wifi_sta *cfg);
 bool mgos_wifi_dev_sta_connect(void); /* To the previously _setup network. */
 bool mgos_wifi_dev_sta_disconnect(void);
+/*
+ * Switch to a different AP of the same network, quicker than a disconnect
+ * and a connect. Ideally the current association is kept until the new one
+ * is up and IP configuration is retained (make-before-break). A platform
+ * that has to leave the current AP first reports that with
+ * MGOS_WIFI_EV_STA_DISCONNECTED, reason MGOS_WIFI_DISCONNECT_REASON_ROAM, and
+ * may run DHCP again. Success is reported with MGOS_WIFI_EV_STA_CONNECTED
+ * followed by MGOS_WIFI_EV_STA_IP_ACQUIRED, failure with
+ * MGOS_WIFI_EV_STA_DISCONNECTED.
+ * Returns false if not supported or not possible right now, in which case
+ * the caller disconnects and connects as usual.
+ */
+bool mgos_wifi_dev_sta_roam(const struct mgos_config_wifi_sta *cfg);
+
+struct mgos_wifi_roam_offload_params {
+  bool enable;
+  int rssi_thr;        /* Look for a better AP below this signal, dBm */
+  int hyst_db;         /* Move if the new AP is stronger by this much, dB */
+  int scan_interval_s; /* Background scan period while below rssi_thr */
+};
+/*
+ * Hand roaming over to the chip, called before each connection. Returns true
+ * if the chip will roam with these parameters, reporting each move with
+ * MGOS_WIFI_EV_STA_ROAMED; the station then does not scan for better APs
+ * itself. Returns false if not supported. With `enable` false, the port
+ * goes back to its defaults.
+ */
+bool mgos_wifi_dev_sta_set_roam_offload(
+    const struct mgos_wifi_roam_offload_params *params);
+/*
+ * Arm a one-shot MGOS_WIFI_EV_STA_RSSI_LOW notification for when signal of
+ * the current AP drops below `rssi_thr`, 0 disarms. Returns false if not
+ * supported, in which case the caller has to poll mgos_wifi_sta_get_rssi().
+ */
+bool mgos_wifi_dev_sta_set_rssi_thr(int rssi_thr);
 enum mgos_wifi_status mgos_wifi_dev_sta_get_status(void);
 
 bool mgos_wifi_dev_get_ip_info(int if_instance,
@@ -43,15 +109,37 @@ struct mgos_wifi_dev_event_info {
   union {
     struct mgos_wifi_sta_connected_arg sta_connected;
     struct mgos_wifi_sta_disconnected_arg sta_disconnected;
+    struct mgos_wifi_sta_rssi_low_arg sta_rssi_low;
+    struct mgos_wifi_sta_roamed_arg sta_roamed;
     struct mgos_wifi_ap_sta_connected_arg ap_sta_connected;
     struct mgos_wifi_ap_sta_disconnected_arg ap_sta_disconnected;
   };
 };
 
-/* Invoke this when Wifi connection state changes. */
+/*
+ * Invoke this when Wifi connection state changes. Does not allocate or
+ * block and may be called from any task; events are queued in a ring of
+ * `MGOS_WIFI_EVENT_RING_SIZE` (16) and delivered on the main task.
+ */
 void mgos_wifi_dev_event_cb(const struct mgos_wifi_dev_event_info *dei);
+/* Same as above, for use in interrupt handlers. */
+void mgos_wifi_dev_event_cb_from_isr(
+    const struct mgos_wifi_dev_event_info *dei);
+
+/*
+ * Maps IEEE 802.11 reason code from a deauthentication or disassociation
+ * frame to a disconnect reason, for ports that report those.
+ */
+enum mgos_wifi_disconnect_reason mgos_wifi_ieee80211_disconnect_reason(
+    int code);
 
-bool mgos_wifi_dev_start_scan(void);
+/*
+ * Start a scan. `params` only carry the restrictions the port reported
+ * it can apply (MGOS_WIFI_CAP_DIRECTED_SCAN, MGOS_WIFI_CAP_SCAN_CHANNELS),
+ * results are filtered by the caller. `params` remain valid until
+ * mgos_wifi_dev_scan_cb is invoked.
+ */
+bool mgos_wifi_dev_start_scan(const struct mgos_wifi_scan_params *params);
 /*
  * Invoke this when the scan is done. In case of error, pass num_res < 0.
  * If res is non-NULL, it must be heap-allocated and mgos_wifi takes it over.
@@ -60,6 +148,17 @@ bool mgos_wifi_dev_start_scan(void);
  */
 void mgos_wifi_dev_scan_cb(int num_res, struct mgos_wifi_scan_result *res);
 
+/*
+ * Ports that sweep channel by channel or fetch results in batches may
+ * invoke this as results come in, before mgos_wifi_dev_scan_cb. The same
+ * results must still be delivered to mgos_wifi_dev_scan_cb, `res` is not
+ * retained. Sweeping is only worth it if `params->partial_cb` is set.
+ * Returns true if the rest of the scan is not needed, in which case the
+ * port should stop and invoke mgos_wifi_dev_scan_cb with what it has.
+ */
+bool mgos_wifi_dev_scan_partial_cb(int num_res,
+                                   const struct mgos_wifi_scan_result *res);
+
 void mgos_wifi_dev_init(void);
 void mgos_wifi_dev_deinit(void);
 
@@ -17,7 +17,11 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "mgos_sys_config.h"
+#include "mgos_wifi.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -27,6 +31,126 @@ bool mgos_wifi_sta_add_cfg(const struct mgos_config_wifi_sta *cfg);
 void mgos_wifi_sta_clear_cfgs(void);
 void mgos_wifi_sta_init(void);
 
+/* True if the port reported all of `cap`, see mgos_wifi_dev_get_caps(). */
+bool mgos_wifi_has_cap(uint32_t cap);
+/* Longest channel list a scan can be limited to, 0 - no limit. */
+int mgos_wifi_get_max_scan_channels(void);
+
+/*
+ * FNV-1a hash of the SSID, used for lookups. If `len` is not NULL, length
+ * of the SSID is stored there.
+ */
+uint32_t mgos_wifi_sta_ssid_hash(const char *ssid, uint8_t *len);
+
+/*
+ * Known network database (`wifi.sta_db`). Looks up station config by SSID,
+ * on success the config is parsed into `cfg` which should be freed with
+ * mgos_config_wifi_sta_free().
+ */
+bool mgos_wifi_sta_db_get(const char *ssid, struct mgos_config_wifi_sta *cfg);
+/* Drop the index, it will be re-read from the file on next lookup. */
+void mgos_wifi_sta_db_reset(void);
+
+/*
+ * PBKDF2 with HMAC-SHA1 as the PRF (RFC 8018), `out_len` bytes of key
+ * material are stored in `out`.
+ */
+void mgos_wifi_pbkdf2_sha1(const uint8_t *pass, size_t pass_len,
+                           const uint8_t *salt, size_t salt_len,
+                           int iterations, uint8_t *out, size_t out_len);
+
+/* Derives WPA pairwise master key from the passphrase and SSID. */
+void mgos_wifi_sta_derive_pmk(const char *ssid, const char *pass,
+                              uint8_t pmk[32]);
+
+/* Signal strength of the current AP, see `wifi.sta_rssi`. */
+struct mgos_wifi_sta_rssi_stats {
+  int num_samples;  /* Accepted since the connection was established */
+  int num_outliers; /* Rejected as fades */
+  int last;         /* Last sample, dBm */
+  float mean;       /* Exponentially weighted moving average, dBm */
+  float variance;   /* Exponentially weighted variance, dB^2 */
+  float trend;      /* Slope over the recent samples, dB per second */
+};
+
+/* Returns false if not connected or no samples have been taken yet. */
+bool mgos_wifi_sta_get_rssi_stats(struct mgos_wifi_sta_rssi_stats *stats);
+
+/* Start over, e.g. after connecting to a different AP. */
+void mgos_wifi_sta_rssi_reset(void);
+/*
+ * Updates the value returned by mgos_wifi_sta_get_rssi_cached(), e.g. from
+ * an event. rssi >= 0 empties the cache.
+ */
+void mgos_wifi_sta_rssi_cache_set(int rssi);
+/* Feed a sample to the estimator, rssi >= 0 is ignored. */
+void mgos_wifi_sta_rssi_add_sample(int rssi);
+
+/*
+ * Statistics collection, see `mgos_wifi_get_stats()`. Station functions are
+ * called by the state machine with wifi lock held.
+ */
+void mgos_wifi_stats_scan_start(void);
+void mgos_wifi_stats_scan_done(int num_res);
+/* Station started connecting, or reconnecting after losing the link. */
+void mgos_wifi_stats_sta_start(void);
+/* Station was told to disconnect. */
+void mgos_wifi_stats_sta_stop(void);
+void mgos_wifi_stats_sta_attempt(void);
+void mgos_wifi_stats_sta_roam(void);
+void mgos_wifi_stats_sta_associated(void);
+void mgos_wifi_stats_sta_attempt_failed(
+    bool timeout, enum mgos_wifi_disconnect_reason reason);
+void mgos_wifi_stats_sta_ip_acquired(void);
+/* Established connection was lost. */
+void mgos_wifi_stats_sta_disconnected(
+    enum mgos_wifi_disconnect_reason reason);
+void mgos_wifi_stats_events(uint32_t num_lost, uint32_t num_coalesced);
+
+/*
+ * Delivers results to a single callback the same way as scan results are,
+ * i.e. references can be taken. Takes ownership of `res`.
+ */
+void mgos_wifi_scan_results_deliver(int num_res,
+                                    struct mgos_wifi_scan_result *res,
+                                    mgos_wifi_scan_cb_t cb, void *arg);
+
+/*
+ * Merge results of a completed scan into the scan table. `full` - all
+ * channels and networks were scanned.
+ */
+void mgos_wifi_scan_table_update(bool full, int num_res,
+                                 const struct mgos_wifi_scan_result *res);
+
+/* AP candidate, as seen by the scoring function. */
+struct mgos_wifi_sta_ap_info {
+  const uint8_t *bssid;
+  const struct mgos_config_wifi_sta *cfg; /* Matching station config */
+  int rssi;
+  int channel;
+  int num_bss_on_channel; /* In the same scan, including this AP */
+  int num_successes;      /* Connections that got to IP */
+  int num_failures;       /* Connection attempts that did not */
+  int avg_time_to_ip_ms;  /* 0 if not known */
+};
+
+/*
+ * AP scoring function. Higher scores are better; the scale is that of RSSI,
+ * i.e. dB, so that `wifi.sta_score.roam_hyst` applies.
+ */
+typedef int (*mgos_wifi_sta_score_fn_t)(const struct mgos_wifi_sta_ap_info *ap,
+                                        void *arg);
+
+/*
+ * Default scoring: weighted RSSI plus per-config preference (`pref`),
+ * minus penalties for failure ratio, time to IP and channel congestion.
+ * Weights are in `wifi.sta_score`.
+ */
+int mgos_wifi_sta_default_score(const struct mgos_wifi_sta_ap_info *ap);
+
+/* Replace the scoring function, NULL restores the default. */
+void mgos_wifi_sta_set_score_fn(mgos_wifi_sta_score_fn_t fn, void *arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Simulated WiFi HAL for host (ubuntu) builds.
+ *
+ * Instead of a radio, the port runs a scripted RF model (see `wifi.sim.*`
+ * config) so that the portable STA manager can be exercised and benchmarked
+ * on a workstation.
+ *
+ * The model runs on a virtual clock of its own. In firmware builds it follows
+ * uptime (`wifi.sim.realtime`); a benchmark runner that provides the system
+ * timers itself instead routes them through `ubuntu_wifi_sim_set_timer()` and
+ * drives the clock with `ubuntu_wifi_sim_run()`, so a scenario takes as long
+ * as it takes to compute. See test/wifi_sim_main.c.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mgos_timers.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Connection benchmark counters collected by the simulator. */
+struct ubuntu_wifi_sim_stats {
+  int num_scans;             /* Scans started */
+  int num_attempts;          /* Association attempts */
+  int num_links_lost;        /* Disconnects caused by the RF model */
+  int64_t first_ip_ms;       /* Time to first IP since scenario start, -1 if
+                                not connected yet. */
+  int64_t last_failover_ms;  /* Link loss to IP acquired, -1 if n/a. */
+  int64_t max_failover_ms;   /* Worst failover seen so far. */
+  int num_roams;             /* Successful mgos_wifi_dev_sta_roam() calls */
+  int64_t dead_air_ms;       /* Time without IP or off channel since first
+                                IP was acquired. */
+  int num_rssi_reads;        /* mgos_wifi_sta_get_rssi() calls, each one is
+                                a round trip to the NWP on some platforms. */
+};
+
+/* Returns the virtual clock reading, microseconds. */
+int64_t ubuntu_wifi_sim_uptime_micros(void);
+
+/* Returns the number of milliseconds since the scenario started. */
+int64_t ubuntu_wifi_sim_now_ms(void);
+
+/*
+ * Arms a timer on the virtual clock, same semantics as `mgos_set_timer()`.
+ * Callbacks run from `ubuntu_wifi_sim_run()`.
+ */
+mgos_timer_id ubuntu_wifi_sim_set_timer(int msecs, int flags,
+                                        timer_callback cb, void *arg);
+void ubuntu_wifi_sim_clear_timer(mgos_timer_id id);
+
+/*
+ * Advances the virtual clock to `until_us`, running the timers that fall due
+ * in order. Time jumps from one timer to the next.
+ */
+void ubuntu_wifi_sim_run(int64_t until_us);
+
+/*
+ * Accounts for a PMK the library derived on the main task: the clock moves on
+ * by the scenario's `pbkdf2_ms`, the time it takes on a microcontroller, and
+ * timers that fall due meanwhile run late. The chip is charged the same when
+ * it is given a passphrase instead of a key.
+ */
+void ubuntu_wifi_sim_pmk_derived(void);
+
+void ubuntu_wifi_sim_get_stats(struct ubuntu_wifi_sim_stats *stats);
+
+/*
+ * (Re)load scenario, which is either a name of a built-in one
+ * ("basic", "ap_reboot", "wrong_pass", "dense", "overloaded") or a path to
+ * a JSON file.
+ * Resets the benchmark counters and the scenario clock.
+ */
+bool ubuntu_wifi_sim_load(const char *scenario);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,7 +1,11 @@
 // Wifi global object is created during C initialization.
 
-// ## **`Wifi.scan(cb)`**
+// ## **`Wifi.scan(cb, maxAgeMs)`**
 // Scan WiFi networks, call `cb` when done.
+// If all channels were scanned within the last `maxAgeMs` milliseconds
+// (`wifi.scan_cache.js_max_age_ms` if not given), the results come from the
+// scan table without scanning again, see `mgos_wifi_scan_cached()`.
+// Pass 0 to always scan.
 // `cb` accepts a single argument `results`, which is
 // either `undefined` in case of error, or an array of object containing:
 // ```javascript
@@ -34,3 +38,29 @@ Wifi.AUTH_MODE_WPA_PSK = 2;
 Wifi.AUTH_MODE_WPA2_PSK = 3;
 Wifi.AUTH_MODE_WPA_WPA2_PSK = 4;
 Wifi.AUTH_MODE_WPA2_ENTERPRISE = 5;
+
+// ## **`Wifi.getStats()`**
+// Return connection statistics as an object, see `mgos_wifi_get_stats()`.
+// Latency histograms (`scan_ms`, `assoc_ms`, `ip_ms`) have `count`,
+// `sum_ms`, `max_ms`, `p50`, `p99` and `buckets`. Bucket 0 counts values
+// below 16 ms, each next one covers twice the range.
+// Example:
+// ```javascript
+// let st = Wifi.getStats();
+// print('Time to IP p99:', st.ip_ms.p99, 'ms');
+// ```
+Wifi.getStats = function() {
+  let p = Wifi._gsj();
+  if (p === null) return undefined;
+  let res = JSON.parse(mkstr(p, Wifi._sl(p), true));
+  Wifi._free(p);
+  return res;
+};
+
+// ## **`Wifi.resetStats()`**
+// Reset connection statistics.
+Wifi.resetStats = ffi('void mgos_wifi_reset_stats(void)');
+
+Wifi._gsj = ffi('void *mgos_wifi_get_stats_json(void)');
+Wifi._sl = ffi('int strlen(void *)');
+Wifi._free = ffi('void free(void *)');
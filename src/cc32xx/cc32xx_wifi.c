@@ -166,11 +166,18 @@ void SimpleLinkWlanEventHandler(SlWlanEvent_t *e) {
     case SL_WLAN_EVENT_DISCONNECT: {
       dei.ev = MGOS_WIFI_EV_STA_DISCONNECTED;
 #if SL_MAJOR_VERSION_NUM >= 2
-      dei.sta_disconnected.reason = e->Data.Disconnect.ReasonCode;
+      dei.sta_disconnected.raw_reason = e->Data.Disconnect.ReasonCode;
 #else
-      dei.sta_disconnected.reason =
+      dei.sta_disconnected.raw_reason =
           e->EventData.STAandP2PModeDisconnected.reason_code;
 #endif
+      /* 200 is user-initiated disconnect, the rest are 802.11 codes. */
+      if (dei.sta_disconnected.raw_reason == 200) {
+        dei.sta_disconnected.reason = MGOS_WIFI_DISCONNECT_REASON_LOCAL;
+      } else {
+        dei.sta_disconnected.reason = mgos_wifi_ieee80211_disconnect_reason(
+            dei.sta_disconnected.raw_reason);
+      }
       break;
     }
 #if SL_MAJOR_VERSION_NUM >= 2
@@ -532,6 +539,20 @@ bool mgos_wifi_dev_ap_setup(const struct mgos_config_wifi_ap *cfg) {
   return true;
 }
 
+void mgos_wifi_dev_get_caps(struct mgos_wifi_dev_caps *caps) {
+  /*
+   * Results come from the NWP's network list in batches, scan parameters
+   * are not honored. The chip is either an AP or a station.
+   */
+  caps->flags = MGOS_WIFI_CAP_SCAN_PARTIAL | MGOS_WIFI_CAP_BG_SCAN;
+#if SL_MAJOR_VERSION_NUM >= 2
+  caps->max_scan_results = SL_WLAN_MAX_SCAN_COUNT;
+#else
+  caps->max_scan_results = 20;
+#endif
+  caps->max_scan_channels = 0;
+}
+
 bool mgos_wifi_dev_sta_connect(void) {
   int ret;
   ret = sl_WlanConnect(
@@ -552,6 +573,23 @@ bool mgos_wifi_dev_sta_disconnect(void) {
   return (sl_WlanDisconnect() == 0);
 }
 
+bool mgos_wifi_dev_sta_set_rssi_thr(int rssi_thr) {
+  (void) rssi_thr;
+  return false;
+}
+
+bool mgos_wifi_dev_sta_roam(const struct mgos_config_wifi_sta *cfg) {
+  /* sl_WlanConnect() always tears down the current association. */
+  (void) cfg;
+  return false;
+}
+
+bool mgos_wifi_dev_sta_set_roam_offload(
+    const struct mgos_wifi_roam_offload_params *params) {
+  (void) params;
+  return false;
+}
+
 bool mgos_wifi_dev_get_ip_info(int if_instance,
                                struct mgos_net_ip_info *ip_info) {
   int r = -1;
@@ -590,14 +628,14 @@ bool mgos_wifi_dev_get_ip_info(int if_instance,
   return true;
 }
 
-static char *ip2str(uint32_t ip) {
-  char *ipstr = NULL;
-  mg_asprintf(&ipstr, 0, "%lu.%lu.%lu.%lu", SL_IPV4_BYTE(ip, 3),
-              SL_IPV4_BYTE(ip, 2), SL_IPV4_BYTE(ip, 1), SL_IPV4_BYTE(ip, 0));
-  return ipstr;
+static char *ip2str(uint32_t ip, char *buf, size_t len) {
+  int n = snprintf(buf, len, "%lu.%lu.%lu.%lu", SL_IPV4_BYTE(ip, 3),
+                   SL_IPV4_BYTE(ip, 2), SL_IPV4_BYTE(ip, 1),
+                   SL_IPV4_BYTE(ip, 0));
+  return (n > 0 && (size_t) n < len ? buf : NULL);
 }
 
-char *mgos_wifi_get_sta_default_dns(void) {
+char *mgos_wifi_get_sta_default_dns_r(char *buf, size_t len) {
   SlNetCfgIpV4Args_t info = {0};
   SL_LEN_TYPE len = sizeof(info);
   SL_OPT_TYPE dhcp_is_on = 0;
@@ -607,13 +645,14 @@ char *mgos_wifi_get_sta_default_dns(void) {
     return NULL;
   }
 #if SL_MAJOR_VERSION_NUM >= 2
-  return (info.IpDnsServer != 0 ? ip2str(info.IpDnsServer) : NULL);
+  uint32_t dns_ip = info.IpDnsServer;
 #else
-  return (info.ipV4DnsServer != 0 ? ip2str(info.ipV4DnsServer) : NULL);
+  uint32_t dns_ip = info.ipV4DnsServer;
 #endif
+  return (dns_ip != 0 ? ip2str(dns_ip, buf, len) : NULL);
 }
 
-bool mgos_wifi_dev_start_scan(void) {
+bool mgos_wifi_dev_start_scan(const struct mgos_wifi_scan_params *params) {
   bool ret = false;
   int n = -1, num_res = 0, i, j;
   struct mgos_wifi_scan_result *res = NULL;
@@ -623,8 +662,11 @@ bool mgos_wifi_dev_start_scan(void) {
 
   /* TODO: Set scan policy to initate scan, right now we are getting
    * results from a previous scan. */
+  /* Results are not filtered here, caller takes care of that. */
+  (void) params;
 
   for (i = 0; (n = sl_WlanGetNetworkList(i, 2, info)) > 0; i += 2) {
+    int batch_start = num_res;
     res = (struct mgos_wifi_scan_result *) realloc(
         res, (num_res + n) * sizeof(*res));
     if (res == NULL) {
@@ -670,6 +712,11 @@ bool mgos_wifi_dev_start_scan(void) {
       }
       num_res++;
     }
+    if (mgos_wifi_dev_scan_partial_cb(num_res - batch_start,
+                                      res + batch_start)) {
+      n = 0; /* Enough, pretend we reached the end. */
+      break;
+    }
   }
   ret = (n == 0); /* Reached the end of the list */
 
@@ -18,6 +18,7 @@
 #include "esp32_wifi.h"
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "dhcpserver/dhcpserver.h"
@@ -40,11 +41,120 @@
 static bool s_inited = false;
 static bool s_started = false;
 static bool s_connecting = false;
+static bool s_roaming = false;
+static bool s_rssi_thr_armed = false;
 static bool s_user_sta_enabled = false;
 
+// Channel by channel scan, for channel lists or when partial results are
+// wanted.
+static struct {
+  bool active;
+  wifi_scan_config_t cfg;
+  uint8_t channels[16];
+  int num_channels, idx;
+  int num_res;
+  struct mgos_wifi_scan_result *res;  // Channels done so far
+} s_sweep;
+
 static esp_err_t esp32_wifi_add_mode(wifi_mode_t mode);
 static esp_err_t esp32_wifi_remove_mode(wifi_mode_t mode);
 
+static void esp32_wifi_sweep_reset(void) {
+  free(s_sweep.res);
+  memset(&s_sweep, 0, sizeof(s_sweep));
+}
+
+// Results are converted in place, which only works if they are smaller.
+typedef char esp32_wifi_scan_result_fits
+    [sizeof(struct mgos_wifi_scan_result) <= sizeof(wifi_ap_record_t) ? 1 : -1];
+
+static int esp32_wifi_get_scan_results(const wifi_event_sta_scan_done_t *p,
+                                       struct mgos_wifi_scan_result **res) {
+  *res = NULL;
+  if (p->status != 0) return -1;
+  uint16_t number = p->number;
+  if (number == 0) return 0;
+  wifi_ap_record_t *aps = (wifi_ap_record_t *) calloc(number, sizeof(*aps));
+  if (aps == NULL) return -1;
+  if (esp_wifi_scan_get_ap_records(&number, aps) != ESP_OK) {
+    free(aps);
+    return -2;
+  }
+  // Record i is copied out before result i is written, and result i ends
+  // before record i + 1 starts.
+  struct mgos_wifi_scan_result *r = (struct mgos_wifi_scan_result *) aps;
+  for (int i = 0; i < number; i++, r++) {
+    wifi_ap_record_t ap = aps[i];
+    memset(r, 0, sizeof(*r));
+    strncpy(r->ssid, (const char *) ap.ssid, sizeof(r->ssid) - 1);
+    memcpy(r->bssid, ap.bssid, sizeof(r->bssid));
+    r->auth_mode = (enum mgos_wifi_auth_mode) ap.authmode;
+    r->channel = ap.primary;
+    r->rssi = ap.rssi;
+  }
+  // Give back the difference.
+  *res = (struct mgos_wifi_scan_result *) realloc(aps, number * sizeof(*r));
+  if (*res == NULL) *res = (struct mgos_wifi_scan_result *) aps;
+  return number;
+}
+
+// Takes results of the channel just scanned and moves on to the next one.
+// Returns false when the sweep is over, `num_res` and `res` are then
+// replaced with results for all the channels.
+static bool esp32_wifi_sweep_next(int *num_res,
+                                  struct mgos_wifi_scan_result **res) {
+  bool stop = false;
+  if (*num_res < 0) {
+    free(*res);
+    *res = NULL;
+    esp32_wifi_sweep_reset();
+    return false;
+  }
+  if (*num_res > 0) {
+    struct mgos_wifi_scan_result *all = (struct mgos_wifi_scan_result *)
+        realloc(s_sweep.res, (s_sweep.num_res + *num_res) * sizeof(*all));
+    if (all != NULL) {
+      memcpy(all + s_sweep.num_res, *res, *num_res * sizeof(*all));
+      s_sweep.res = all;
+      stop = mgos_wifi_dev_scan_partial_cb(*num_res, all + s_sweep.num_res);
+      s_sweep.num_res += *num_res;
+    } else {
+      stop = true;
+    }
+  }
+  free(*res);
+  if (!stop && ++s_sweep.idx < s_sweep.num_channels) {
+    s_sweep.cfg.channel = s_sweep.channels[s_sweep.idx];
+    if (esp_wifi_scan_start(&s_sweep.cfg, false /* block */) == ESP_OK) {
+      return true;
+    }
+  }
+  *num_res = s_sweep.num_res;
+  *res = s_sweep.res;
+  s_sweep.res = NULL;
+  esp32_wifi_sweep_reset();
+  return false;
+}
+
+static enum mgos_wifi_disconnect_reason esp32_wifi_disconnect_reason(
+    uint8_t reason) {
+  switch (reason) {
+    case WIFI_REASON_BEACON_TIMEOUT:
+      return MGOS_WIFI_DISCONNECT_REASON_BEACON_TIMEOUT;
+    case WIFI_REASON_NO_AP_FOUND:
+      return MGOS_WIFI_DISCONNECT_REASON_NO_AP_FOUND;
+    case WIFI_REASON_AUTH_FAIL:
+      return MGOS_WIFI_DISCONNECT_REASON_AUTH_FAIL;
+    case WIFI_REASON_HANDSHAKE_TIMEOUT:
+      return MGOS_WIFI_DISCONNECT_REASON_HANDSHAKE_TIMEOUT;
+    case WIFI_REASON_ASSOC_FAIL:
+    case WIFI_REASON_CONNECTION_FAIL:
+      return MGOS_WIFI_DISCONNECT_REASON_ASSOC_FAIL;
+  }
+  // Below 200 these are 802.11 reason codes.
+  return mgos_wifi_ieee80211_disconnect_reason(reason);
+}
+
 static void esp32_wifi_event_handler(void *ctx, esp_event_base_t ev_base,
                                      int32_t ev_id, void *ev_data) {
   struct mgos_wifi_dev_event_info dei = {0};
@@ -55,13 +165,22 @@ static void esp32_wifi_event_handler(void *ctx, esp_event_base_t ev_base,
     }
     case WIFI_EVENT_STA_STOP: {
       s_started = false;
+      esp32_wifi_sweep_reset();
       mgos_wifi_dev_scan_cb(-2, NULL);
       break;
     }
     case WIFI_EVENT_STA_DISCONNECTED: {
       const wifi_event_sta_disconnected_t *info = ev_data;
       dei.ev = MGOS_WIFI_EV_STA_DISCONNECTED;
-      dei.sta_disconnected.reason = info->reason;
+      dei.sta_disconnected.raw_reason = info->reason;
+      if (s_roaming && info->reason == WIFI_REASON_ASSOC_LEAVE) {
+        // Leaving the old AP, see mgos_wifi_dev_sta_roam(). The link is down
+        // until the new association is up and DHCP has run again.
+        dei.sta_disconnected.reason = MGOS_WIFI_DISCONNECT_REASON_ROAM;
+        break;
+      }
+      s_roaming = false;
+      dei.sta_disconnected.reason = esp32_wifi_disconnect_reason(info->reason);
       // Getting a DISCONNECTED event does not change the internal mode,
       // wifi lib still thinks we are connecting until disconnect() is called.
       // s_connecting = false;
@@ -73,6 +192,15 @@ static void esp32_wifi_event_handler(void *ctx, esp_event_base_t ev_base,
       memcpy(dei.sta_connected.bssid, info->bssid, 6);
       dei.sta_connected.channel = info->channel;
       s_connecting = false;
+      s_roaming = false;
+      break;
+    }
+    case WIFI_EVENT_STA_BSS_RSSI_LOW: {
+      const wifi_event_bss_rssi_low_t *info = ev_data;
+      if (!s_rssi_thr_armed) break;
+      s_rssi_thr_armed = false;
+      dei.ev = MGOS_WIFI_EV_STA_RSSI_LOW;
+      dei.sta_rssi_low.rssi = info->rssi;
       break;
     }
     case WIFI_EVENT_AP_STACONNECTED: {
@@ -90,31 +218,9 @@ static void esp32_wifi_event_handler(void *ctx, esp_event_base_t ev_base,
       break;
     }
     case WIFI_EVENT_SCAN_DONE: {
-      int num_res = -1;
       struct mgos_wifi_scan_result *res = NULL;
-      wifi_event_sta_scan_done_t *p = ev_data;
-      if (p->status == 0) {
-        uint16_t number = p->number;
-        wifi_ap_record_t *aps =
-            (wifi_ap_record_t *) calloc(number, sizeof(*aps));
-        if (esp_wifi_scan_get_ap_records(&number, aps) == ESP_OK) {
-          res = (struct mgos_wifi_scan_result *) calloc(number, sizeof(*res));
-          struct mgos_wifi_scan_result *r;
-          wifi_ap_record_t *ap;
-          for (ap = aps, r = res, num_res = 0; num_res < number;
-               ap++, r++, num_res++) {
-            strncpy(r->ssid, (const char *) ap->ssid, sizeof(r->ssid));
-            memcpy(r->bssid, ap->bssid, sizeof(r->bssid));
-            r->ssid[sizeof(r->ssid) - 1] = '\0';
-            r->auth_mode = (enum mgos_wifi_auth_mode) ap->authmode;
-            r->channel = ap->primary;
-            r->rssi = ap->rssi;
-          }
-        } else {
-          num_res = -2;
-        }
-        free(aps);
-      }
+      int num_res = esp32_wifi_get_scan_results(ev_data, &res);
+      if (s_sweep.active && esp32_wifi_sweep_next(&num_res, &res)) break;
       mgos_wifi_dev_scan_cb(num_res, res);
       if (!s_user_sta_enabled) esp32_wifi_remove_mode(WIFI_MODE_STA);
       break;
@@ -334,6 +440,10 @@ bool mgos_wifi_dev_sta_setup(const struct mgos_config_wifi_sta *cfg) {
     }
     stacfg->bssid_set = true;
   }
+  if (cfg->channel > 0) {
+    /* Skips the all-channel sweep before association. */
+    stacfg->channel = cfg->channel;
+  }
 
   if (mgos_conf_str_empty(cfg->user) /* Not using EAP */ &&
       !mgos_conf_str_empty(cfg->pass)) {
@@ -544,6 +654,16 @@ out:
   return result;
 }
 
+void mgos_wifi_dev_get_caps(struct mgos_wifi_dev_caps *caps) {
+  /* Supplicant treats 64 hex digit password as PSK. */
+  caps->flags = MGOS_WIFI_CAP_DIRECTED_SCAN | MGOS_WIFI_CAP_SCAN_CHANNELS |
+                MGOS_WIFI_CAP_SCAN_PARTIAL | MGOS_WIFI_CAP_BG_SCAN |
+                MGOS_WIFI_CAP_PMK | MGOS_WIFI_CAP_RSSI_EVENTS |
+                MGOS_WIFI_CAP_ROAM | MGOS_WIFI_CAP_AP_STA;
+  caps->max_scan_results = 0;
+  caps->max_scan_channels = sizeof(s_sweep.channels);
+}
+
 bool mgos_wifi_dev_sta_connect(void) {
   if ((esp32_wifi_ensure_init() != ESP_OK) ||
       (esp32_wifi_ensure_start() != ESP_OK))
@@ -576,6 +696,66 @@ bool mgos_wifi_dev_sta_disconnect(void) {
   return true;
 }
 
+bool mgos_wifi_dev_sta_set_rssi_thr(int rssi_thr) {
+  if (rssi_thr == 0) {
+    s_rssi_thr_armed = false;
+    return true;
+  }
+  /* Event is only delivered once, until re-armed. */
+  s_rssi_thr_armed = (esp_wifi_set_rssi_threshold(rssi_thr) == ESP_OK);
+  return s_rssi_thr_armed;
+}
+
+bool mgos_wifi_dev_sta_roam(const struct mgos_config_wifi_sta *cfg) {
+  wifi_config_t wcfg = {0};
+  wifi_sta_config_t *stacfg = &wcfg.sta;
+  unsigned int bssid[6] = {0};
+  /* EAP would have to start from scratch anyway. */
+  if (!s_started || s_connecting || !mgos_conf_str_empty(cfg->user) ||
+      !mgos_conf_str_empty(cfg->cert)) {
+    return false;
+  }
+  if (esp_wifi_get_config(WIFI_IF_STA, &wcfg) != ESP_OK ||
+      strncmp((const char *) stacfg->ssid, cfg->ssid, sizeof(stacfg->ssid)) !=
+          0 ||
+      sscanf(cfg->bssid, "%02x:%02x:%02x:%02x:%02x:%02x", &bssid[0],
+             &bssid[1], &bssid[2], &bssid[3], &bssid[4], &bssid[5]) != 6) {
+    return false;
+  }
+  for (int i = 0; i < 6; i++) {
+    stacfg->bssid[i] = bssid[i];
+  }
+  stacfg->bssid_set = true;
+  stacfg->channel = cfg->channel;
+  if (!mgos_conf_str_empty(cfg->pass)) {
+    strncpy((char *) stacfg->password, cfg->pass, sizeof(stacfg->password));
+  }
+  /*
+   * Not make-before-break: the driver has to leave the current AP first and
+   * the netif sees the disconnect, so DHCP runs again. What this saves over
+   * a regular reconnect is the WiFi task restart and the channel sweep, the
+   * target channel is known.
+   */
+  s_roaming = true;
+  esp_wifi_disconnect();
+  esp_err_t r = esp_wifi_set_config(WIFI_IF_STA, &wcfg);
+  if (r == ESP_OK) r = esp_wifi_connect();
+  if (r != ESP_OK) {
+    LOG(LL_ERROR, ("WiFi STA: Roam failed: %d", r));
+    s_roaming = false;
+    return false;
+  }
+  s_connecting = true;
+  return true;
+}
+
+bool mgos_wifi_dev_sta_set_roam_offload(
+    const struct mgos_wifi_roam_offload_params *params) {
+  /* Driver does not move between APs by itself. */
+  (void) params;
+  return false;
+}
+
 bool mgos_wifi_dev_get_ip_info(int if_instance,
                                struct mgos_net_ip_info *ip_info) {
   esp_netif_ip_info_t info;
@@ -608,17 +788,14 @@ void mgos_wifi_dev_deinit(void) {
   }
 }
 
-char *mgos_wifi_get_sta_default_dns() {
-  char *dns = NULL;
+char *mgos_wifi_get_sta_default_dns_r(char *buf, size_t len) {
   const ip_addr_t *dns_addr = dns_getserver(0);
   if (dns_addr == NULL || dns_addr->u_addr.ip4.addr == 0 ||
       dns_addr->type != IPADDR_TYPE_V4) {
     return NULL;
   }
-  if (asprintf(&dns, IPSTR, IP2STR(&dns_addr->u_addr.ip4)) < 0) {
-    return NULL;
-  }
-  return dns;
+  int n = snprintf(buf, len, IPSTR, IP2STR(&dns_addr->u_addr.ip4));
+  return (n > 0 && (size_t) n < len ? buf : NULL);
 }
 
 int mgos_wifi_sta_get_rssi(void) {
@@ -627,20 +804,52 @@ int mgos_wifi_sta_get_rssi(void) {
   return info.rssi;
 }
 
-bool mgos_wifi_dev_start_scan(void) {
+bool mgos_wifi_dev_start_scan(const struct mgos_wifi_scan_params *params) {
   esp_err_t r = esp32_wifi_add_mode(WIFI_MODE_STA);
   if (r == ESP_OK) r = esp32_wifi_ensure_start();
   if (r == ESP_OK) {
     wifi_scan_config_t scan_cfg = {
+        .ssid = (uint8_t *) params->ssid,
+        /* Only one channel or all of them can be scanned. */
+        .channel = (params->num_channels == 1 ? params->channels[0] : 0),
         .scan_type = WIFI_SCAN_TYPE_ACTIVE,
         .scan_time.active.min = 100,
         .scan_time.active.max = 150,
     };
+    if (params->type == MGOS_WIFI_SCAN_TYPE_PASSIVE) {
+      scan_cfg.scan_type = WIFI_SCAN_TYPE_PASSIVE;
+      if (params->dwell_ms > 0) scan_cfg.scan_time.passive = params->dwell_ms;
+    } else if (params->dwell_ms > 0) {
+      scan_cfg.scan_time.active.min = params->dwell_ms;
+      scan_cfg.scan_time.active.max = params->dwell_ms;
+    }
+    esp32_wifi_sweep_reset();
+    if (params->num_channels > 1 ||
+        (params->partial_cb != NULL && params->num_channels == 0)) {
+      // Go one channel at a time, the driver only takes one or all of them.
+      // Also lets us report results early.
+      int n = params->num_channels;
+      if (n > (int) sizeof(s_sweep.channels)) n = sizeof(s_sweep.channels);
+      for (int i = 0; i < n; i++) s_sweep.channels[i] = params->channels[i];
+      wifi_country_t c;
+      if (n == 0 && esp_wifi_get_country(&c) == ESP_OK) {
+        for (; n < c.nchan && n < (int) sizeof(s_sweep.channels); n++) {
+          s_sweep.channels[n] = c.schan + n;
+        }
+      }
+      if (n > 0) {
+        s_sweep.active = true;
+        s_sweep.num_channels = n;
+        scan_cfg.channel = s_sweep.channels[0];
+        s_sweep.cfg = scan_cfg;
+      }
+    }
     if (s_connecting) {
       esp_wifi_disconnect();
       s_connecting = false;
     }
     r = esp_wifi_scan_start(&scan_cfg, false /* block */);
+    if (r != ESP_OK) esp32_wifi_sweep_reset();
   }
   return (r == ESP_OK);
 }
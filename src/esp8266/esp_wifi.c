@@ -17,6 +17,7 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 
 #ifdef RTOS_SDK
@@ -44,6 +45,23 @@
 
 static uint8_t s_cur_mode = NULL_MODE;
 
+static enum mgos_wifi_disconnect_reason esp_wifi_disconnect_reason(
+    uint8_t reason) {
+  switch (reason) {
+    case REASON_BEACON_TIMEOUT:
+      return MGOS_WIFI_DISCONNECT_REASON_BEACON_TIMEOUT;
+    case REASON_NO_AP_FOUND:
+      return MGOS_WIFI_DISCONNECT_REASON_NO_AP_FOUND;
+    case REASON_AUTH_FAIL:
+    case REASON_HANDSHAKE_TIMEOUT:
+      return MGOS_WIFI_DISCONNECT_REASON_AUTH_FAIL;
+    case REASON_ASSOC_FAIL:
+      return MGOS_WIFI_DISCONNECT_REASON_ASSOC_FAIL;
+  }
+  /* Below 200 these are 802.11 reason codes. */
+  return mgos_wifi_ieee80211_disconnect_reason(reason);
+}
+
 void wifi_changed_cb(System_Event_t *evt) {
   struct mgos_wifi_dev_event_info dei = {0};
 #ifdef RTOS_SDK
@@ -53,7 +71,9 @@ void wifi_changed_cb(System_Event_t *evt) {
 #endif
     case EVENT_STAMODE_DISCONNECTED:
       dei.ev = MGOS_WIFI_EV_STA_DISCONNECTED;
-      dei.sta_disconnected.reason = evt->event_info.disconnected.reason;
+      dei.sta_disconnected.reason =
+          esp_wifi_disconnect_reason(evt->event_info.disconnected.reason);
+      dei.sta_disconnected.raw_reason = evt->event_info.disconnected.reason;
       break;
     case EVENT_STAMODE_CONNECTED:
       dei.ev = MGOS_WIFI_EV_STA_CONNECTED;
@@ -444,6 +464,16 @@ bool mgos_wifi_dev_ap_setup(const struct mgos_config_wifi_ap *cfg) {
   return true;
 }
 
+void mgos_wifi_dev_get_caps(struct mgos_wifi_dev_caps *caps) {
+  /* SDK treats 64 hex digit password as PSK. */
+  caps->flags = MGOS_WIFI_CAP_DIRECTED_SCAN | MGOS_WIFI_CAP_SCAN_CHANNELS |
+                MGOS_WIFI_CAP_BG_SCAN | MGOS_WIFI_CAP_PMK |
+                MGOS_WIFI_CAP_AP_STA;
+  caps->max_scan_results = 0;
+  /* Only one channel or all of them can be scanned. */
+  caps->max_scan_channels = 1;
+}
+
 bool mgos_wifi_dev_sta_connect(void) {
   return wifi_station_connect();
 }
@@ -452,6 +482,23 @@ bool mgos_wifi_dev_sta_disconnect(void) {
   return wifi_station_disconnect();
 }
 
+bool mgos_wifi_dev_sta_set_rssi_thr(int rssi_thr) {
+  (void) rssi_thr;
+  return false;
+}
+
+bool mgos_wifi_dev_sta_roam(const struct mgos_config_wifi_sta *cfg) {
+  /* SDK disconnects when station config changes. */
+  (void) cfg;
+  return false;
+}
+
+bool mgos_wifi_dev_sta_set_roam_offload(
+    const struct mgos_wifi_roam_offload_params *params) {
+  (void) params;
+  return false;
+}
+
 bool mgos_wifi_dev_get_ip_info(int if_instance,
                                struct mgos_net_ip_info *ip_info) {
   struct ip_info info;
@@ -521,14 +568,24 @@ void wifi_scan_done(void *arg, STATUS status) {
   mgos_wifi_dev_scan_cb(n, res);
 }
 
-bool mgos_wifi_dev_start_scan(void) {
+bool mgos_wifi_dev_start_scan(const struct mgos_wifi_scan_params *params) {
   /* Scanning requires station. If in AP-only mode, switch to AP+STA. */
   if (!mgos_wifi_add_mode(STATION_MODE)) return false;
   struct scan_config cfg = {
+      .ssid = (uint8 *) params->ssid,
+      /* Only one channel or all of them can be scanned. */
+      .channel = (params->num_channels == 1 ? params->channels[0] : 0),
       .scan_type = WIFI_SCAN_TYPE_ACTIVE,
       .scan_time.active.min = 100,
       .scan_time.active.max = 150,
   };
+  if (params->type == MGOS_WIFI_SCAN_TYPE_PASSIVE) {
+    cfg.scan_type = WIFI_SCAN_TYPE_PASSIVE;
+    if (params->dwell_ms > 0) cfg.scan_time.passive = params->dwell_ms;
+  } else if (params->dwell_ms > 0) {
+    cfg.scan_time.active.min = params->dwell_ms;
+    cfg.scan_time.active.max = params->dwell_ms;
+  }
   return wifi_station_scan(&cfg, wifi_scan_done);
 }
 
@@ -541,8 +598,7 @@ void mgos_wifi_dev_deinit(void) {
   wifi_set_opmode_current(NULL_MODE);
 }
 
-char *mgos_wifi_get_sta_default_dns(void) {
-  char *dns;
+char *mgos_wifi_get_sta_default_dns_r(char *buf, size_t len) {
   const ip_addr_t *dns_addr;
 #if LWIP_VERSION_MAJOR == 1
   ip_addr_t dns_addr2 = dns_getserver(0);
@@ -553,8 +609,6 @@ char *mgos_wifi_get_sta_default_dns(void) {
   if (dns_addr == NULL || dns_addr->addr == 0) {
     return NULL;
   }
-  if (asprintf(&dns, IPSTR, IP2STR(dns_addr)) < 0) {
-    return NULL;
-  }
-  return dns;
+  int n = snprintf(buf, len, IPSTR, IP2STR(dns_addr));
+  return (n > 0 && (size_t) n < len ? buf : NULL);
 }
@@ -36,13 +36,65 @@
 
 #include "mgos_wifi_sta.h"
 
-struct cb_info {
-  void *cb;
+#ifndef MGOS_WIFI_SCAN_MAX_REQS
+#define MGOS_WIFI_SCAN_MAX_REQS 4
+#endif
+
+#ifndef MGOS_WIFI_SCAN_MAX_RESULT_BUFS
+#define MGOS_WIFI_SCAN_MAX_RESULT_BUFS 4
+#endif
+
+/* Longer channel lists are treated as "all channels". */
+#ifndef MGOS_WIFI_SCAN_MAX_CHANNELS
+#define MGOS_WIFI_SCAN_MAX_CHANNELS 16
+#endif
+
+struct scan_req {
+  mgos_wifi_scan_cb_t cb;
   void *arg;
-  SLIST_ENTRY(cb_info) next;
+  struct mgos_wifi_scan_params params;
+  char ssid[33];
+  bool in_use; /* Pool slot is taken */
+  bool done;   /* partial_cb said it has seen enough */
+  STAILQ_ENTRY(scan_req) next;
+  uint8_t channels[MGOS_WIFI_SCAN_MAX_CHANNELS];
+};
+STAILQ_HEAD(scan_reqs, scan_req);
+
+/*
+ * Scan results, shared read-only by all the consumers. The array is freed
+ * when the last reference is released.
+ */
+struct scan_res_buf {
+  int refs; /* 0 - pool slot is free */
+  int num_res;
+  struct mgos_wifi_scan_result *res;
+  struct scan_reqs reqs; /* Requests to deliver to */
+  SLIST_ENTRY(scan_res_buf) next;
 };
-static SLIST_HEAD(s_scan_cbs, cb_info) s_scan_cbs;
+SLIST_HEAD(scan_res_bufs, scan_res_buf);
+
+/* Request and result slots, the heap is only used when these run out. */
+static struct scan_req s_scan_req_pool[MGOS_WIFI_SCAN_MAX_REQS];
+static struct scan_res_buf s_scan_res_buf_pool[MGOS_WIFI_SCAN_MAX_RESULT_BUFS];
+/* Buffers in use. */
+static struct scan_res_bufs s_scan_res_bufs =
+    SLIST_HEAD_INITIALIZER(s_scan_res_bufs);
+/* Requests that will be served by the scan in progress. */
+static struct scan_reqs s_scan_reqs = STAILQ_HEAD_INITIALIZER(s_scan_reqs);
+/* Requests that need another scan. */
+static struct scan_reqs s_pending_scan_reqs =
+    STAILQ_HEAD_INITIALIZER(s_pending_scan_reqs);
+/* Request of the scan in progress. */
+static struct scan_req *s_cur_scan_req = NULL;
+/* Its parameters as given to the port, see scan_params_effective(). */
+static struct mgos_wifi_scan_params s_cur_scan_params;
 static bool s_scan_in_progress = false;
+/* Scan in progress is being cut short, no new requests can join it. */
+static bool s_scan_stopping = false;
+
+/* What the port can do, fetched once at init. */
+static struct mgos_wifi_dev_caps s_caps;
 
 struct mgos_rlock_type *s_wifi_lock = NULL;
 
@@ -54,18 +106,19 @@ void wifi_unlock(void) {
   mgos_runlock(s_wifi_lock);
 }
 
-static void mgos_wifi_event_cb(void *arg) {
+static void mgos_wifi_event_dispatch(struct mgos_wifi_dev_event_info *dei) {
   bool net_event = true;
-  struct mgos_wifi_dev_event_info *dei =
-      (struct mgos_wifi_dev_event_info *) arg;
   void *ev_arg = NULL;
   enum mgos_net_event nev = MGOS_NET_EV_DISCONNECTED;
   switch (dei->ev) {
     case MGOS_WIFI_EV_STA_DISCONNECTED: {
       ev_arg = &dei->sta_disconnected;
       nev = MGOS_NET_EV_DISCONNECTED;
-      LOG(LL_INFO,
-          ("WiFi STA: Disconnected, reason: %d", dei->sta_disconnected.reason));
+      mgos_wifi_sta_rssi_cache_set(0);
+      LOG(LL_INFO, ("WiFi STA: Disconnected, reason: %s (%d)",
+                    mgos_wifi_disconnect_reason_str(
+                        dei->sta_disconnected.reason),
+                    dei->sta_disconnected.raw_reason));
       break;
     }
     case MGOS_WIFI_EV_STA_CONNECTING: {
@@ -76,7 +129,10 @@ static void mgos_wifi_event_cb(void *arg) {
       ev_arg = &dei->sta_connected;
       nev = MGOS_NET_EV_CONNECTED;
       struct mgos_wifi_sta_connected_arg *ea = &dei->sta_connected;
-      ea->rssi = mgos_wifi_sta_get_rssi();
+      /* Station reads it again right after this, from the cache. */
+      mgos_wifi_sta_rssi_cache_set(0);
+      ea->rssi = mgos_wifi_sta_get_rssi_cached(
+          mgos_sys_config_get_wifi_sta_rssi_max_age_ms());
       LOG(LL_INFO, ("WiFi STA: Connected, BSSID %02x:%02x:%02x:%02x:%02x:%02x "
                     "ch %d RSSI %d",
                     ea->bssid[0], ea->bssid[1], ea->bssid[2], ea->bssid[3],
@@ -87,6 +143,24 @@ static void mgos_wifi_event_cb(void *arg) {
       nev = MGOS_NET_EV_IP_ACQUIRED;
       break;
     }
+    case MGOS_WIFI_EV_STA_RSSI_LOW: {
+      ev_arg = &dei->sta_rssi_low;
+      net_event = false;
+      mgos_wifi_sta_rssi_cache_set(dei->sta_rssi_low.rssi);
+      LOG(LL_DEBUG, ("WiFi STA: RSSI %d", dei->sta_rssi_low.rssi));
+      break;
+    }
+    case MGOS_WIFI_EV_STA_ROAMED: {
+      struct mgos_wifi_sta_roamed_arg *ea = &dei->sta_roamed;
+      ev_arg = ea;
+      net_event = false;
+      mgos_wifi_sta_rssi_cache_set(ea->rssi);
+      LOG(LL_INFO, ("WiFi STA: Roamed to BSSID %02x:%02x:%02x:%02x:%02x:%02x "
+                    "ch %d RSSI %d",
+                    ea->bssid[0], ea->bssid[1], ea->bssid[2], ea->bssid[3],
+                    ea->bssid[4], ea->bssid[5], ea->channel, ea->rssi));
+      break;
+    }
     case MGOS_WIFI_EV_AP_STA_CONNECTED:
     case MGOS_WIFI_EV_AP_STA_DISCONNECTED: {
       struct mgos_wifi_ap_sta_connected_arg *ea = &dei->ap_sta_connected;
@@ -107,16 +181,235 @@ static void mgos_wifi_event_cb(void *arg) {
   if (net_event) {
     mgos_net_dev_event_cb(MGOS_NET_IF_TYPE_WIFI, MGOS_NET_IF_WIFI_STA, nev);
   }
+}
+
+/*
+ * Events from the ports go through a bounded multi-producer ring (Vyukov's
+ * algorithm) and are drained on the main task. Producers never allocate or
+ * take locks, so events can be posted from any task or an ISR.
+ *
+ * Atomics are used where the target has them lock-free, otherwise the few
+ * read-modify-write operations are done with interrupts disabled.
+ */
+#if defined(__GCC_ATOMIC_INT_LOCK_FREE) && __GCC_ATOMIC_INT_LOCK_FREE == 2
+static bool ring_cas(uint32_t *p, uint32_t *expected, uint32_t desired) {
+  return __atomic_compare_exchange_n(p, expected, desired, false /* weak */,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+static uint32_t ring_xchg(uint32_t *p, uint32_t v) {
+  return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+static void ring_inc(uint32_t *p) {
+  __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+#else
+static bool ring_cas(uint32_t *p, uint32_t *expected, uint32_t desired) {
+  bool ret;
+  mgos_ints_disable();
+  ret = (*p == *expected);
+  if (ret) {
+    *p = desired;
+  } else {
+    *expected = *p;
+  }
+  mgos_ints_enable();
+  return ret;
+}
+static uint32_t ring_xchg(uint32_t *p, uint32_t v) {
+  mgos_ints_disable();
+  uint32_t old = *p;
+  *p = v;
+  mgos_ints_enable();
+  return old;
+}
+static void ring_inc(uint32_t *p) {
+  mgos_ints_disable();
+  (*p)++;
+  mgos_ints_enable();
+}
+#endif
+
+#ifndef MGOS_WIFI_EVENT_RING_SIZE
+#define MGOS_WIFI_EVENT_RING_SIZE 16 /* Must be a power of 2 */
+#endif
+
+struct wifi_ev_slot {
+  /*
+   * Sequence number minus the slot index, so that zero-initialized slots
+   * are ready for the first lap.
+   */
+  uint32_t seq;
+  struct mgos_wifi_dev_event_info dei;
+};
+
+static struct wifi_ev_slot s_ev_ring[MGOS_WIFI_EVENT_RING_SIZE];
+static uint32_t s_ev_head;          /* Next position to write */
+static uint32_t s_ev_tail;          /* Next position to read, main task */
+static uint32_t s_ev_drain_pending; /* Drain callback has been scheduled */
+static uint32_t s_ev_lost;          /* Ring was full */
+
+static uint32_t ev_slot_seq(const struct wifi_ev_slot *slot, uint32_t pos) {
+  return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) +
+         (pos & (MGOS_WIFI_EVENT_RING_SIZE - 1));
+}
+
+static void ev_slot_set_seq(struct wifi_ev_slot *slot, uint32_t pos,
+                            uint32_t seq) {
+  __atomic_store_n(&slot->seq, seq - (pos & (MGOS_WIFI_EVENT_RING_SIZE - 1)),
+                   __ATOMIC_RELEASE);
+}
+
+static bool ev_ring_put(const struct mgos_wifi_dev_event_info *dei) {
+  struct wifi_ev_slot *slot;
+  uint32_t pos = __atomic_load_n(&s_ev_head, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &s_ev_ring[pos & (MGOS_WIFI_EVENT_RING_SIZE - 1)];
+    int32_t diff = (int32_t) (ev_slot_seq(slot, pos) - pos);
+    if (diff == 0) {
+      if (ring_cas(&s_ev_head, &pos, pos + 1)) break;
+    } else if (diff < 0) {
+      return false; /* Full */
+    } else {
+      pos = __atomic_load_n(&s_ev_head, __ATOMIC_RELAXED);
+    }
+  }
+  slot->dei = *dei;
+  ev_slot_set_seq(slot, pos, pos + 1);
+  return true;
+}
+
+static bool ev_ring_get(struct mgos_wifi_dev_event_info *dei) {
+  uint32_t pos = s_ev_tail;
+  struct wifi_ev_slot *slot =
+      &s_ev_ring[pos & (MGOS_WIFI_EVENT_RING_SIZE - 1)];
+  if ((int32_t) (ev_slot_seq(slot, pos) - (pos + 1)) < 0) return false;
+  *dei = slot->dei;
+  ev_slot_set_seq(slot, pos, pos + MGOS_WIFI_EVENT_RING_SIZE);
+  s_ev_tail = pos + 1;
+  return true;
+}
+
+static bool ev_is_failed_attempt(const struct mgos_wifi_dev_event_info *e) {
+  return (e[0].ev == MGOS_WIFI_EV_STA_CONNECTING &&
+          e[1].ev == MGOS_WIFI_EV_STA_DISCONNECTED);
+}
+
+static void mgos_wifi_ev_ring_drain(void *arg) {
+  struct mgos_wifi_dev_event_info evs[MGOS_WIFI_EVENT_RING_SIZE];
+  ring_xchg(&s_ev_drain_pending, 0);
+  for (;;) {
+    int n = 0, num_coalesced = 0;
+    while (n < MGOS_WIFI_EVENT_RING_SIZE && ev_ring_get(&evs[n])) n++;
+    if (n == 0) break;
+    for (int i = 0; i < n; i++) {
+      /*
+       * A port retrying on its own may have produced a series of failed
+       * attempts, only the last one of a run with the same reason matters.
+       */
+      if (i + 3 < n && ev_is_failed_attempt(&evs[i]) &&
+          ev_is_failed_attempt(&evs[i + 2]) &&
+          evs[i + 1].sta_disconnected.reason ==
+              evs[i + 3].sta_disconnected.reason) {
+        i++;
+        num_coalesced += 2;
+        continue;
+      }
+      if (i + 1 < n && evs[i].ev == MGOS_WIFI_EV_STA_CONNECTING &&
+          evs[i + 1].ev == MGOS_WIFI_EV_STA_CONNECTING) {
+        num_coalesced++;
+        continue;
+      }
+      mgos_wifi_event_dispatch(&evs[i]);
+    }
+    uint32_t num_lost = ring_xchg(&s_ev_lost, 0);
+    if (num_lost > 0) {
+      LOG(LL_ERROR, ("WiFi event ring overflow, %u lost", (unsigned) num_lost));
+    }
+    mgos_wifi_stats_events(num_lost, num_coalesced);
+  }
+  (void) arg;
+}
 
-  free(dei);
+static void mgos_wifi_dev_event_post(const struct mgos_wifi_dev_event_info *dei,
+                                     bool from_isr) {
+  if (!ev_ring_put(dei)) ring_inc(&s_ev_lost);
+  if (ring_xchg(&s_ev_drain_pending, 1) == 0 &&
+      !mgos_invoke_cb(mgos_wifi_ev_ring_drain, NULL, from_isr)) {
+    /* Let the next event try again. */
+    ring_xchg(&s_ev_drain_pending, 0);
+  }
 }
 
 void mgos_wifi_dev_event_cb(const struct mgos_wifi_dev_event_info *dei) {
-  struct mgos_wifi_dev_event_info *deic =
-      (struct mgos_wifi_dev_event_info *) calloc(1, sizeof(*deic));
-  if (deic == NULL) return;
-  memcpy(deic, dei, sizeof(*deic));
-  mgos_invoke_cb(mgos_wifi_event_cb, deic, false /* from_isr */);
+  mgos_wifi_dev_event_post(dei, false /* from_isr */);
+}
+
+void mgos_wifi_dev_event_cb_from_isr(
+    const struct mgos_wifi_dev_event_info *dei) {
+  mgos_wifi_dev_event_post(dei, true /* from_isr */);
+}
+
+enum mgos_wifi_disconnect_reason mgos_wifi_ieee80211_disconnect_reason(
+    int code) {
+  switch (code) {
+    case 2:  /* Previous authentication no longer valid */
+    case 3:  /* Deauthenticated because sending STA is leaving */
+    case 4:  /* Disassociated due to inactivity */
+    case 6:  /* Class 2 frame received from nonauthenticated STA */
+    case 7:  /* Class 3 frame received from nonassociated STA */
+      return MGOS_WIFI_DISCONNECT_REASON_DEAUTH;
+    case 5: /* AP is unable to handle all currently associated STAs */
+      return MGOS_WIFI_DISCONNECT_REASON_AP_FULL;
+    case 8: /* Disassociated because sending STA is leaving */
+      return MGOS_WIFI_DISCONNECT_REASON_LOCAL;
+    case 9:  /* STA requesting association is not authenticated */
+    case 10: /* Power capability element is unacceptable */
+    case 11: /* Supported channels element is unacceptable */
+    case 13: /* Invalid element */
+    case 18: /* Invalid group cipher */
+    case 19: /* Invalid pairwise cipher */
+    case 20: /* Invalid AKMP */
+    case 21: /* Unsupported RSNE version */
+    case 22: /* Invalid RSNE capabilities */
+    case 24: /* Cipher suite rejected because of security policy */
+      return MGOS_WIFI_DISCONNECT_REASON_ASSOC_FAIL;
+    case 15: /* 4-way handshake timeout */
+    case 16: /* Group key handshake timeout */
+      return MGOS_WIFI_DISCONNECT_REASON_HANDSHAKE_TIMEOUT;
+    case 14: /* Message integrity code failure */
+    case 17: /* Element in 4-way handshake differs from (Re)Assoc Request */
+    case 23: /* IEEE 802.1X authentication failed */
+      return MGOS_WIFI_DISCONNECT_REASON_AUTH_FAIL;
+  }
+  return MGOS_WIFI_DISCONNECT_REASON_UNSPECIFIED;
+}
+
+const char *mgos_wifi_disconnect_reason_str(
+    enum mgos_wifi_disconnect_reason reason) {
+  switch (reason) {
+    case MGOS_WIFI_DISCONNECT_REASON_UNSPECIFIED:
+    case MGOS_WIFI_DISCONNECT_REASON_MAX:
+      break;
+    case MGOS_WIFI_DISCONNECT_REASON_LOCAL:
+      return "local";
+    case MGOS_WIFI_DISCONNECT_REASON_DEAUTH:
+      return "deauth";
+    case MGOS_WIFI_DISCONNECT_REASON_BEACON_TIMEOUT:
+      return "beacon_timeout";
+    case MGOS_WIFI_DISCONNECT_REASON_NO_AP_FOUND:
+      return "no_ap_found";
+    case MGOS_WIFI_DISCONNECT_REASON_AUTH_FAIL:
+      return "auth_fail";
+    case MGOS_WIFI_DISCONNECT_REASON_ASSOC_FAIL:
+      return "assoc_fail";
+    case MGOS_WIFI_DISCONNECT_REASON_AP_FULL:
+      return "ap_full";
+    case MGOS_WIFI_DISCONNECT_REASON_ROAM:
+      return "roam";
+    case MGOS_WIFI_DISCONNECT_REASON_HANDSHAKE_TIMEOUT:
+      return "handshake_timeout";
+  }
+  return "unspecified";
 }
 
 bool mgos_wifi_validate_sta_cfg(const struct mgos_config_wifi_sta *cfg,
@@ -227,55 +520,350 @@ bool mgos_wifi_setup_ap(const struct mgos_config_wifi_ap *cfg) {
   return ret;
 }
 
-struct scan_result_info {
-  int num_res;
-  struct mgos_wifi_scan_result *res;
-};
+static struct scan_req *scan_req_alloc(void) {
+  struct scan_req *req = NULL;
+  wifi_lock();
+  for (int i = 0; i < MGOS_WIFI_SCAN_MAX_REQS; i++) {
+    if (s_scan_req_pool[i].in_use) continue;
+    req = &s_scan_req_pool[i];
+    memset(req, 0, sizeof(*req));
+    req->in_use = true;
+    break;
+  }
+  wifi_unlock();
+  if (req == NULL) req = (struct scan_req *) calloc(1, sizeof(*req));
+  return req;
+}
 
-static void scan_cb_cb(void *arg) {
-  struct scan_result_info *ri = (struct scan_result_info *) arg;
+static void scan_req_free(struct scan_req *req) {
+  if (req >= s_scan_req_pool &&
+      req < s_scan_req_pool + MGOS_WIFI_SCAN_MAX_REQS) {
+    wifi_lock();
+    req->in_use = false;
+    wifi_unlock();
+  } else {
+    free(req);
+  }
+}
+
+/*
+ * Takes ownership of the results array. Returns NULL if out of memory,
+ * in which case `res` is freed.
+ */
+static struct scan_res_buf *scan_res_buf_new(
+    int num_res, struct mgos_wifi_scan_result *res) {
+  struct scan_res_buf *b = NULL;
+  wifi_lock();
+  for (int i = 0; i < MGOS_WIFI_SCAN_MAX_RESULT_BUFS; i++) {
+    if (s_scan_res_buf_pool[i].refs == 0) {
+      b = &s_scan_res_buf_pool[i];
+      break;
+    }
+  }
+  if (b == NULL) b = (struct scan_res_buf *) malloc(sizeof(*b));
+  if (b != NULL) {
+    memset(b, 0, sizeof(*b));
+    b->refs = 1;
+    b->num_res = num_res;
+    b->res = res;
+    STAILQ_INIT(&b->reqs);
+    SLIST_INSERT_HEAD(&s_scan_res_bufs, b, next);
+  } else {
+    free(res);
+  }
+  wifi_unlock();
+  return b;
+}
+
+static void scan_res_buf_unref(struct scan_res_buf *b) {
+  wifi_lock();
+  if (--b->refs > 0) {
+    wifi_unlock();
+    return;
+  }
+  SLIST_REMOVE(&s_scan_res_bufs, b, scan_res_buf, next);
+  /* A pool slot can be taken again as soon as the lock is released. */
+  struct mgos_wifi_scan_result *res = b->res;
+  b->res = NULL;
+  wifi_unlock();
+  free(res);
+  if (b < s_scan_res_buf_pool ||
+      b >= s_scan_res_buf_pool + MGOS_WIFI_SCAN_MAX_RESULT_BUFS) {
+    free(b);
+  }
+}
+
+static struct scan_res_buf *scan_res_buf_find(
+    const struct mgos_wifi_scan_result *res) {
+  struct scan_res_buf *b;
+  if (res == NULL) return NULL;
+  SLIST_FOREACH(b, &s_scan_res_bufs, next) {
+    if (b->res == res) return b;
+  }
+  return NULL;
+}
+
+bool mgos_wifi_scan_results_ref(const struct mgos_wifi_scan_result *res) {
+  wifi_lock();
+  struct scan_res_buf *b = scan_res_buf_find(res);
+  if (b != NULL) b->refs++;
+  wifi_unlock();
+  return (b != NULL);
+}
+
+void mgos_wifi_scan_results_unref(const struct mgos_wifi_scan_result *res) {
   wifi_lock();
-  SLIST_HEAD(scan_cbs, cb_info) scan_cbs;
-  memcpy(&scan_cbs, &s_scan_cbs, sizeof(scan_cbs));
-  memset(&s_scan_cbs, 0, sizeof(s_scan_cbs));
+  struct scan_res_buf *b = scan_res_buf_find(res);
+  if (b != NULL) scan_res_buf_unref(b);
   wifi_unlock();
-  struct cb_info *cbi, *cbit;
-  SLIST_FOREACH_SAFE(cbi, &scan_cbs, next, cbit) {
-    ((mgos_wifi_scan_cb_t) cbi->cb)(ri->num_res, ri->res, cbi->arg);
-    free(cbi);
+}
+
+void mgos_wifi_scan_results_deliver(int num_res,
+                                    struct mgos_wifi_scan_result *res,
+                                    mgos_wifi_scan_cb_t cb, void *arg) {
+  struct scan_res_buf *b = NULL;
+  if (num_res > 0) {
+    b = scan_res_buf_new(num_res, res);
+    if (b == NULL) num_res = -1;
+  } else {
+    free(res);
+  }
+  cb(num_res, (b != NULL ? b->res : NULL), arg);
+  if (b != NULL) scan_res_buf_unref(b);
+}
+
+/* Copies results matching the request into a new array. */
+static int scan_results_filter(const struct mgos_wifi_scan_params *p,
+                               int num_res,
+                               const struct mgos_wifi_scan_result *res,
+                               struct mgos_wifi_scan_result **fres);
+
+static bool scan_result_matches(const struct mgos_wifi_scan_params *p,
+                                const struct mgos_wifi_scan_result *r) {
+  if (p->ssid != NULL && strcmp(p->ssid, r->ssid) != 0) return false;
+  if (p->num_channels == 0) return true;
+  for (int i = 0; i < p->num_channels; i++) {
+    if (p->channels[i] == r->channel) return true;
+  }
+  return false;
+}
+
+static int scan_results_filter(const struct mgos_wifi_scan_params *p,
+                               int num_res,
+                               const struct mgos_wifi_scan_result *res,
+                               struct mgos_wifi_scan_result **fres) {
+  int num_fres = 0, i;
+  *fres = NULL;
+  for (i = 0; i < num_res; i++) {
+    if (scan_result_matches(p, &res[i])) num_fres++;
+  }
+  if (num_fres == 0) return 0;
+  *fres = (struct mgos_wifi_scan_result *) malloc(num_fres * sizeof(**fres));
+  if (*fres == NULL) return -1;
+  for (i = 0, num_fres = 0; i < num_res; i++) {
+    if (scan_result_matches(p, &res[i])) (*fres)[num_fres++] = res[i];
+  }
+  return num_fres;
+}
+
+bool mgos_wifi_has_cap(uint32_t cap) {
+  return ((s_caps.flags & cap) == cap);
+}
+
+int mgos_wifi_get_max_scan_channels(void) {
+  return s_caps.max_scan_channels;
+}
+
+/*
+ * Restrictions the port cannot apply are dropped: such a scan covers
+ * everything and its results can be shared by any request.
+ */
+static void scan_params_effective(const struct mgos_wifi_scan_params *p,
+                                  struct mgos_wifi_scan_params *ep) {
+  *ep = *p;
+  if (!mgos_wifi_has_cap(MGOS_WIFI_CAP_DIRECTED_SCAN)) ep->ssid = NULL;
+  if (!mgos_wifi_has_cap(MGOS_WIFI_CAP_SCAN_CHANNELS) ||
+      (s_caps.max_scan_channels > 0 &&
+       p->num_channels > s_caps.max_scan_channels)) {
+    ep->channels = NULL;
+    ep->num_channels = 0;
+  }
+}
+
+/* Returns true if results of scan with params p1 are sufficient for p2. */
+static bool scan_params_cover(const struct mgos_wifi_scan_params *p1,
+                              const struct mgos_wifi_scan_params *p2) {
+  struct mgos_wifi_scan_params ep1;
+  scan_params_effective(p1, &ep1);
+  p1 = &ep1;
+  if (p1->ssid != NULL &&
+      (p2->ssid == NULL || strcmp(p1->ssid, p2->ssid) != 0)) {
+    return false;
+  }
+  if (p1->num_channels == 0) return true;
+  if (p2->num_channels == 0) return false;
+  for (int i = 0; i < p2->num_channels; i++) {
+    if (memchr(p1->channels, p2->channels[i], p1->num_channels) == NULL) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void scan_start_pending(void);
+
+static void scan_cb_cb(void *arg) {
+  struct scan_res_buf *b = (struct scan_res_buf *) arg;
+  struct scan_req *req, *reqt;
+  STAILQ_FOREACH_SAFE(req, &b->reqs, next, reqt) {
+    const struct mgos_wifi_scan_params *p = &req->params;
+    if (b->num_res <= 0 || (p->ssid == NULL && p->num_channels == 0)) {
+      req->cb(b->num_res, b->res, req->arg);
+    } else {
+      /* Port may have been unable to limit the scan, filter the results. */
+      struct mgos_wifi_scan_result *fres = NULL;
+      int num_fres = scan_results_filter(p, b->num_res, b->res, &fres);
+      mgos_wifi_scan_results_deliver(num_fres, fres, req->cb, req->arg);
+    }
+    scan_req_free(req);
   }
-  free(ri->res);
-  free(ri);
+  scan_res_buf_unref(b);
+  wifi_lock();
+  scan_start_pending();
+  wifi_unlock();
 }
 
 void mgos_wifi_dev_scan_cb(int num_res, struct mgos_wifi_scan_result *res) {
+  struct scan_reqs reqs;
+  struct scan_req *req, *reqt;
   if (!s_scan_in_progress) return;
   LOG(LL_DEBUG, ("WiFi scan done, num_res %d", num_res));
-  struct scan_result_info *ri =
-      (struct scan_result_info *) calloc(1, sizeof(*ri));
-  ri->num_res = num_res;
-  ri->res = res;
-  s_scan_in_progress = false;
-  mgos_invoke_cb(scan_cb_cb, ri, false /* from_isr */);
+  mgos_wifi_stats_scan_done(num_res);
+  if (num_res <= 0) {
+    free(res);
+    res = NULL;
+  }
+  struct scan_res_buf *b = scan_res_buf_new(num_res, res);
+  STAILQ_INIT(&reqs);
+  wifi_lock();
+  const struct mgos_wifi_scan_params *ep = &s_cur_scan_params;
+  if (b != NULL) {
+    /* A truncated list says nothing about the networks that are missing. */
+    bool truncated =
+        (s_caps.max_scan_results > 0 && num_res >= s_caps.max_scan_results);
+    mgos_wifi_scan_table_update((ep->ssid == NULL && ep->num_channels == 0 &&
+                                 !s_scan_stopping && !truncated),
+                                num_res, res);
+    STAILQ_CONCAT(&b->reqs, &s_scan_reqs);
+  } else {
+    STAILQ_CONCAT(&reqs, &s_scan_reqs);
+  }
+  s_cur_scan_req = NULL;
+  s_scan_in_progress = s_scan_stopping = false;
+  wifi_unlock();
+  if (b != NULL) {
+    mgos_invoke_cb(scan_cb_cb, b, false /* from_isr */);
+    return;
+  }
+  /* Out of memory, the results are lost. */
+  STAILQ_FOREACH_SAFE(req, &reqs, next, reqt) {
+    req->cb(-1, NULL, req->arg);
+    scan_req_free(req);
+  }
 }
 
-void mgos_wifi_scan(mgos_wifi_scan_cb_t cb, void *arg) {
-  struct cb_info *cbi = (struct cb_info *) calloc(1, sizeof(*cbi));
-  if (cbi == NULL) return;
-  cbi->cb = cb;
-  cbi->arg = arg;
+bool mgos_wifi_dev_scan_partial_cb(int num_res,
+                                   const struct mgos_wifi_scan_result *res) {
+  bool stop = false;
+  struct scan_req *req;
   wifi_lock();
-  SLIST_INSERT_HEAD(&s_scan_cbs, cbi, next);
-  if (!s_scan_in_progress) {
-    if (mgos_wifi_dev_start_scan()) {
-      s_scan_in_progress = true;
+  if (!s_scan_in_progress || num_res <= 0) goto out;
+  stop = true;
+  STAILQ_FOREACH(req, &s_scan_reqs, next) {
+    const struct mgos_wifi_scan_params *p = &req->params;
+    if (req->done) continue;
+    if (p->partial_cb == NULL) {
+      stop = false;
+      continue;
+    }
+    if (p->ssid == NULL && p->num_channels == 0) {
+      req->done = p->partial_cb(num_res, res, req->arg);
+    } else {
+      struct mgos_wifi_scan_result *fres = NULL;
+      int num_fres = scan_results_filter(p, num_res, res, &fres);
+      if (num_fres > 0) req->done = p->partial_cb(num_fres, fres, req->arg);
+      free(fres);
+    }
+    if (!req->done) stop = false;
+  }
+  if (stop) {
+    LOG(LL_DEBUG, ("WiFi scan stopped early"));
+    s_scan_stopping = true;
+  }
+out:
+  wifi_unlock();
+  return stop;
+}
+
+/* Starts a scan for the first pending request and those it covers. */
+static void scan_start_pending(void) {
+  struct scan_req *req, *reqt;
+  if (s_scan_in_progress || STAILQ_EMPTY(&s_pending_scan_reqs)) return;
+  s_cur_scan_req = STAILQ_FIRST(&s_pending_scan_reqs);
+  STAILQ_FOREACH_SAFE(req, &s_pending_scan_reqs, next, reqt) {
+    if (!scan_params_cover(&s_cur_scan_req->params, &req->params)) continue;
+    STAILQ_REMOVE(&s_pending_scan_reqs, req, scan_req, next);
+    STAILQ_INSERT_TAIL(&s_scan_reqs, req, next);
+  }
+  s_scan_in_progress = true;
+  mgos_wifi_stats_scan_start();
+  /* The port is only asked for what it said it can do. */
+  scan_params_effective(&s_cur_scan_req->params, &s_cur_scan_params);
+  if (!mgos_wifi_dev_start_scan(&s_cur_scan_params)) {
+    mgos_wifi_dev_scan_cb(-1, NULL);
+  }
+}
+
+void mgos_wifi_scan_ex(const struct mgos_wifi_scan_params *params,
+                       mgos_wifi_scan_cb_t cb, void *arg) {
+  int num_channels = (params != NULL ? params->num_channels : 0);
+  struct scan_req *req = scan_req_alloc();
+  if (req == NULL) {
+    cb(-1, NULL, arg);
+    return;
+  }
+  if (num_channels > MGOS_WIFI_SCAN_MAX_CHANNELS) num_channels = 0;
+  req->cb = cb;
+  req->arg = arg;
+  if (params != NULL) {
+    req->params = *params;
+    if (num_channels > 0) {
+      memcpy(req->channels, params->channels, num_channels);
+      req->params.channels = req->channels;
     } else {
-      mgos_wifi_dev_scan_cb(-1, NULL);
+      req->params.channels = NULL;
+      req->params.num_channels = 0;
+    }
+    if (params->ssid != NULL) {
+      strncpy(req->ssid, params->ssid, sizeof(req->ssid) - 1);
+      req->params.ssid = req->ssid;
     }
   }
+  wifi_lock();
+  if (s_scan_in_progress && !s_scan_stopping &&
+      scan_params_cover(&s_cur_scan_req->params, &req->params)) {
+    STAILQ_INSERT_TAIL(&s_scan_reqs, req, next);
+  } else {
+    STAILQ_INSERT_TAIL(&s_pending_scan_reqs, req, next);
+    scan_start_pending();
+  }
   wifi_unlock();
 }
 
+void mgos_wifi_scan(mgos_wifi_scan_cb_t cb, void *arg) {
+  mgos_wifi_scan_ex(NULL, cb, arg);
+}
+
 bool mgos_wifi_setup(struct mgos_config_wifi *cfg) {
   bool result = false, trigger_ap = false;
   int gpio = cfg->ap.trigger_on_gpio;
@@ -292,7 +880,9 @@ bool mgos_wifi_setup(struct mgos_config_wifi *cfg) {
   const struct mgos_config_wifi_sta *sta_cfg = mgos_sys_config_get_wifi_sta();
   const struct mgos_config_wifi_sta *sta_cfg1 = mgos_sys_config_get_wifi_sta1();
   const struct mgos_config_wifi_sta *sta_cfg2 = mgos_sys_config_get_wifi_sta2();
-  bool sta_enabled = (sta_cfg->enable || sta_cfg1->enable || sta_cfg2->enable);
+  bool sta_db_enabled = mgos_sys_config_get_wifi_sta_db_enable();
+  bool sta_enabled = (sta_cfg->enable || sta_cfg1->enable ||
+                      sta_cfg2->enable || sta_db_enabled);
 
   if (trigger_ap || (cfg->ap.enable && !sta_enabled)) {
     struct mgos_config_wifi_ap ap_cfg;
@@ -303,26 +893,29 @@ bool mgos_wifi_setup(struct mgos_config_wifi *cfg) {
     mgos_wifi_setup_sta(&dummy_sta_cfg);
     result = mgos_wifi_setup_ap(&ap_cfg);
 #ifdef MGOS_WIFI_ENABLE_AP_STA /* ifdef-ok */
-  } else if (cfg->ap.enable && sta_enabled) {
+  } else if (cfg->ap.enable && sta_enabled &&
+             mgos_wifi_has_cap(MGOS_WIFI_CAP_AP_STA)) {
     LOG(LL_INFO, ("WiFi mode: %s", "AP+STA"));
     result = mgos_wifi_setup_ap(&cfg->ap);
     mgos_wifi_sta_clear_cfgs();
     bool sta_result = mgos_wifi_sta_add_cfg(sta_cfg);
     sta_result |= mgos_wifi_sta_add_cfg(sta_cfg1);
     sta_result |= mgos_wifi_sta_add_cfg(sta_cfg2);
-    if (sta_result) {
+    if (sta_result || sta_db_enabled) {
       sta_result = mgos_wifi_connect();
     }
     result |= sta_result;
 #endif
   } else if (sta_enabled) {
     LOG(LL_INFO, ("WiFi mode: %s", "STA"));
+    if (cfg->ap.enable) LOG(LL_WARN, ("AP+STA is not supported, AP is off"));
     /* Disable AP if it was enabled. */
     mgos_wifi_setup_ap(&dummy_ap_cfg);
     mgos_wifi_sta_clear_cfgs();
     result |= mgos_wifi_sta_add_cfg(sta_cfg);
     result |= mgos_wifi_sta_add_cfg(sta_cfg1);
     result |= mgos_wifi_sta_add_cfg(sta_cfg2);
+    if (sta_db_enabled) result = true;
     if (result) mgos_wifi_connect();
   } else {
     LOG(LL_INFO, ("WiFi mode: %s", "off"));
@@ -371,6 +964,10 @@ bool mgos_wifi_init(void) {
   mgos_event_register_base(MGOS_WIFI_EV_BASE, "wifi");
   mgos_sys_config_register_validator(validate_wifi_cfg);
   mgos_wifi_dev_init();
+  mgos_wifi_dev_get_caps(&s_caps);
+  LOG(LL_DEBUG, ("WiFi caps 0x%lx, max scan results %d, channels %d",
+                 (unsigned long) s_caps.flags, s_caps.max_scan_results,
+                 s_caps.max_scan_channels));
   bool ret =
       mgos_wifi_setup((struct mgos_config_wifi *) mgos_sys_config_get_wifi());
   if (!ret) {
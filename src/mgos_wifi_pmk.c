@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * WPA PSK derivation: PMK = PBKDF2-HMAC-SHA1(passphrase, SSID, 4096, 32).
+ */
+
+#include "mgos_wifi_sta.h"
+
+#include <string.h>
+
+#include "common/cs_sha1.h"
+
+#define SHA1_BLOCK_SIZE 64
+#define SHA1_DIGEST_SIZE 20
+
+/* HMAC key state: hash contexts with the inner and outer pads absorbed. */
+struct hmac_sha1_key {
+  cs_sha1_ctx inner, outer;
+};
+
+static void hmac_sha1_init(struct hmac_sha1_key *k, const uint8_t *key,
+                           size_t key_len) {
+  uint8_t pad[SHA1_BLOCK_SIZE], kh[SHA1_DIGEST_SIZE];
+  if (key_len > SHA1_BLOCK_SIZE) {
+    cs_sha1_ctx c;
+    cs_sha1_init(&c);
+    cs_sha1_update(&c, key, key_len);
+    cs_sha1_final(kh, &c);
+    key = kh;
+    key_len = sizeof(kh);
+  }
+  memset(pad, 0x36, sizeof(pad));
+  for (size_t i = 0; i < key_len; i++) pad[i] ^= key[i];
+  cs_sha1_init(&k->inner);
+  cs_sha1_update(&k->inner, pad, sizeof(pad));
+  memset(pad, 0x5c, sizeof(pad));
+  for (size_t i = 0; i < key_len; i++) pad[i] ^= key[i];
+  cs_sha1_init(&k->outer);
+  cs_sha1_update(&k->outer, pad, sizeof(pad));
+}
+
+static void hmac_sha1(const struct hmac_sha1_key *k, const uint8_t *data,
+                      size_t data_len, uint8_t out[SHA1_DIGEST_SIZE]) {
+  cs_sha1_ctx c = k->inner;
+  cs_sha1_update(&c, data, data_len);
+  cs_sha1_final(out, &c);
+  c = k->outer;
+  cs_sha1_update(&c, out, SHA1_DIGEST_SIZE);
+  cs_sha1_final(out, &c);
+}
+
+void mgos_wifi_pbkdf2_sha1(const uint8_t *pass, size_t pass_len,
+                           const uint8_t *salt, size_t salt_len,
+                           int iterations, uint8_t *out, size_t out_len) {
+  struct hmac_sha1_key k;
+  uint8_t u[SHA1_DIGEST_SIZE], t[SHA1_DIGEST_SIZE];
+  hmac_sha1_init(&k, pass, pass_len);
+  for (uint32_t block = 1; out_len > 0; block++) {
+    /* U1 = PRF(P, S || INT(i)) */
+    const uint8_t ib[4] = {(uint8_t)(block >> 24), (uint8_t)(block >> 16),
+                           (uint8_t)(block >> 8), (uint8_t) block};
+    cs_sha1_ctx c = k.inner;
+    cs_sha1_update(&c, salt, salt_len);
+    cs_sha1_update(&c, ib, sizeof(ib));
+    cs_sha1_final(u, &c);
+    c = k.outer;
+    cs_sha1_update(&c, u, sizeof(u));
+    cs_sha1_final(u, &c);
+    memcpy(t, u, sizeof(t));
+    /* Uj = PRF(P, Uj-1), T = U1 ^ U2 ^ ... */
+    for (int j = 1; j < iterations; j++) {
+      hmac_sha1(&k, u, sizeof(u), u);
+      for (size_t i = 0; i < sizeof(t); i++) t[i] ^= u[i];
+    }
+    size_t n = (out_len < sizeof(t) ? out_len : sizeof(t));
+    memcpy(out, t, n);
+    out += n;
+    out_len -= n;
+  }
+}
+
+void mgos_wifi_sta_derive_pmk(const char *ssid, const char *pass,
+                              uint8_t pmk[32]) {
+  mgos_wifi_pbkdf2_sha1((const uint8_t *) pass, strlen(pass),
+                        (const uint8_t *) ssid, strlen(ssid), 4096, pmk, 32);
+}
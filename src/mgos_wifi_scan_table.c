@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Scan table: results of all scans merged per BSSID, so that networks
+ * missed by one pass are still reported and repeated queries can be
+ * answered without going to the radio.
+ */
+
+#include "mgos_wifi.h"
+#include "mgos_wifi_sta.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+
+#ifndef MGOS_WIFI_SCAN_TABLE_SIZE
+#define MGOS_WIFI_SCAN_TABLE_SIZE 32
+#endif
+
+void wifi_lock(void);
+void wifi_unlock(void);
+
+struct scan_table_entry {
+  struct mgos_wifi_scan_result r; /* rssi is smoothed */
+  int64_t last_seen;              /* Uptime, us; 0 - unused */
+};
+
+static struct scan_table_entry s_table[MGOS_WIFI_SCAN_TABLE_SIZE];
+/* Completion time of the last scan that covered all channels and SSIDs. */
+static int64_t s_last_full_scan = 0;
+
+struct scan_cached_req {
+  mgos_wifi_scan_cb_t cb;
+  void *arg;
+  int num_res;
+  struct mgos_wifi_scan_result *res;
+};
+
+static bool scan_table_expired(const struct scan_table_entry *e, int64_t now) {
+  int64_t ttl = mgos_sys_config_get_wifi_scan_cache_ttl_ms() * 1000LL;
+  return (e->last_seen == 0 || now - e->last_seen > ttl);
+}
+
+static struct scan_table_entry *scan_table_get_entry(const uint8_t *bssid,
+                                                     int64_t now) {
+  struct scan_table_entry *e, *free_e = NULL, *oldest_e = NULL;
+  for (e = s_table; e < s_table + MGOS_WIFI_SCAN_TABLE_SIZE; e++) {
+    if (scan_table_expired(e, now)) {
+      if (free_e == NULL) free_e = e;
+      continue;
+    }
+    if (memcmp(e->r.bssid, bssid, sizeof(e->r.bssid)) == 0) return e;
+    /* Of the entries seen at the same time, the weakest goes first. */
+    if (oldest_e == NULL || e->last_seen < oldest_e->last_seen ||
+        (e->last_seen == oldest_e->last_seen && e->r.rssi < oldest_e->r.rssi)) {
+      oldest_e = e;
+    }
+  }
+  e = (free_e != NULL ? free_e : oldest_e);
+  memset(e, 0, sizeof(*e));
+  return e;
+}
+
+void mgos_wifi_scan_table_update(bool full, int num_res,
+                                 const struct mgos_wifi_scan_result *res) {
+  if (num_res < 0) return;
+  int64_t now = mgos_uptime_micros();
+  wifi_lock();
+  for (int i = 0; i < num_res; i++) {
+    const struct mgos_wifi_scan_result *r = &res[i];
+    struct scan_table_entry *e = scan_table_get_entry(r->bssid, now);
+    /* Single readings fluctuate by several dB, smooth them out. */
+    int rssi = (e->last_seen != 0 ? (e->r.rssi * 3 + r->rssi) / 4 : r->rssi);
+    e->r = *r;
+    e->r.rssi = rssi;
+    e->last_seen = now;
+  }
+  if (full) s_last_full_scan = now;
+  wifi_unlock();
+}
+
+/* Copies live table entries into a new array. */
+static int scan_table_snapshot(struct mgos_wifi_scan_result **res) {
+  int num_res = 0, i;
+  int64_t now = mgos_uptime_micros();
+  *res = NULL;
+  wifi_lock();
+  for (i = 0; i < MGOS_WIFI_SCAN_TABLE_SIZE; i++) {
+    if (!scan_table_expired(&s_table[i], now)) num_res++;
+  }
+  if (num_res > 0) {
+    *res = (struct mgos_wifi_scan_result *) malloc(num_res * sizeof(**res));
+    if (*res == NULL) num_res = -1;
+  }
+  if (*res != NULL) {
+    num_res = 0;
+    for (i = 0; i < MGOS_WIFI_SCAN_TABLE_SIZE; i++) {
+      if (scan_table_expired(&s_table[i], now)) continue;
+      (*res)[num_res++] = s_table[i].r;
+    }
+  }
+  wifi_unlock();
+  return num_res;
+}
+
+static void scan_cached_deliver_cb(void *arg) {
+  struct scan_cached_req *req = (struct scan_cached_req *) arg;
+  mgos_wifi_scan_results_deliver(req->num_res, req->res, req->cb, req->arg);
+  free(req);
+}
+
+/* Fresh scan is done and merged, answer from the table. */
+static void scan_cached_scan_cb(int num_res, struct mgos_wifi_scan_result *res,
+                                void *arg) {
+  struct scan_cached_req *req = (struct scan_cached_req *) arg;
+  struct mgos_wifi_scan_result *tres = NULL;
+  if (num_res >= 0) num_res = scan_table_snapshot(&tres);
+  mgos_wifi_scan_results_deliver(num_res, tres, req->cb, req->arg);
+  free(req);
+  (void) res;
+}
+
+void mgos_wifi_scan_cached(int max_age_ms, mgos_wifi_scan_cb_t cb,
+                           void *arg) {
+  struct scan_cached_req *req =
+      (struct scan_cached_req *) calloc(1, sizeof(*req));
+  if (req == NULL) {
+    cb(-1, NULL, arg);
+    return;
+  }
+  req->cb = cb;
+  req->arg = arg;
+  wifi_lock();
+  bool fresh = (s_last_full_scan != 0 && max_age_ms > 0 &&
+                mgos_uptime_micros() - s_last_full_scan <= max_age_ms * 1000LL);
+  wifi_unlock();
+  if (!fresh) {
+    mgos_wifi_scan(scan_cached_scan_cb, req);
+    return;
+  }
+  req->num_res = scan_table_snapshot(&req->res);
+  LOG(LL_DEBUG, ("Scan answered from the table, %d entries", req->num_res));
+  mgos_invoke_cb(scan_cached_deliver_cb, req, false /* from_isr */);
+}
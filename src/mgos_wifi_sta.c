@@ -17,6 +17,11 @@
 
 #include "mgos_wifi_sta.h"
 
+#include <limits.h>
+#include <math.h>
+
+#include "common/cs_file.h"
+#include "frozen.h"
 #include "mgos.h"
 #include "mgos_wifi.h"
 #include "mgos_wifi_hal.h"
@@ -25,22 +30,54 @@
 #define MGOS_WIFI_STA_AP_ATTEMPTS 3
 #endif
 
-#ifndef MGOS_WIFI_STA_FAILING_AP_RETRY_SECONDS
-#define MGOS_WIFI_STA_FAILING_AP_RETRY_SECONDS (60 * 60)  // 1 hour
+// Initial back-off for an AP that rejected us for lack of room.
+#ifndef MGOS_WIFI_STA_AP_FULL_BACKOFF_SECONDS
+#define MGOS_WIFI_STA_AP_FULL_BACKOFF_SECONDS 15
 #endif
+#define WIFI_STA_AP_MAX_BACKOFF_SECONDS 240
 
 #ifndef MGOS_WIFI_STA_AP_HISTORY_SIZE
 #define MGOS_WIFI_STA_AP_HISTORY_SIZE 20
 #endif
 
-#ifndef MGOS_WIFI_STA_ROAM_RSSI_HYST
-#define MGOS_WIFI_STA_ROAM_RSSI_HYST 5
-#endif
-
 #ifndef MGOS_WIFI_STA_MAX_AP_QUEUE_LEN
 #define MGOS_WIFI_STA_MAX_AP_QUEUE_LEN 2
 #endif
 
+// Max number of known network database entries kept in RAM at any time.
+#ifndef MGOS_WIFI_STA_DB_MAX_CFGS
+#define MGOS_WIFI_STA_DB_MAX_CFGS 8
+#endif
+
+// How many times a snapshot reader retries if it races with an update.
+#ifndef MGOS_WIFI_STA_SNAPSHOT_TRIES
+#define MGOS_WIFI_STA_SNAPSHOT_TRIES 16
+#endif
+
+#ifndef MGOS_WIFI_STA_LAST_AP_FILE
+#define MGOS_WIFI_STA_LAST_AP_FILE "wifi_last_ap.json"
+#endif
+
+/*
+ * AP history file format, numbers are little-endian.
+ * Header: "WH", version, number of entries (2 bytes),
+ *         wall clock time of the save in seconds (8 bytes, 0 if not set).
+ * Entry: bssid (6 bytes), rssi, num_attempts, channel,
+ *        seconds since the last attempt (4 bytes), num_ok, num_fail,
+ *        average time to IP in ms (2 bytes).
+ */
+#define WIFI_STA_HIST_VERSION 2
+#define WIFI_STA_HIST_HDR_SIZE 13
+#define WIFI_STA_HIST_ENTRY_SIZE 17
+// Wall clock is assumed to be set if it's past this (mid-2017).
+#define WIFI_STA_HIST_MIN_VALID_TIME 1500000000LL
+
+// Samples needed before RSSI trend is used to predict crossing of the roaming
+// threshold.
+#define WIFI_STA_ROAM_PREDICT_MIN_SAMPLES 8
+// Hysteresis for switching from RSSI polling back to notifications, dB.
+#define WIFI_STA_RSSI_WAKE_HYST 3
+
 void wifi_lock(void);
 void wifi_unlock(void);
 
@@ -59,31 +96,142 @@ enum wifi_sta_state {
 
 int8_t s_num_cfgs = 0;
 struct mgos_config_wifi_sta **s_cfgs = NULL;
+// Match descriptors for s_cfgs, compiled when the config is added so that
+// checking scan results does not involve string processing.
+struct wifi_sta_cfg_desc {
+  uint32_t ssid_hash;
+  uint8_t ssid_len;
+  uint32_t auth_modes;  // Bit mask of allowed mgos_wifi_auth_mode values.
+  bool have_bssid;
+  uint8_t bssid[6];
+  // WPA PSK, derived from the passphrase once so that the SDK does not
+  // have to do it on every connection attempt. pmk_ok: it can be.
+  bool pmk_ok, have_pmk;
+  uint8_t pmk[32];
+};
+static struct wifi_sta_cfg_desc *s_cfg_descs = NULL;
 const struct mgos_config_wifi_sta *s_cur_cfg = NULL;
+// Configs materialized from the known network database, indices in s_cfgs.
+static int8_t s_db_cfgs[MGOS_WIFI_STA_DB_MAX_CFGS];
+static int s_num_db_cfgs = 0;
+static int s_db_next_slot = 0;
+static bool s_pmk_cb_pending = false;
+
+// AP entries live in a fixed arena. Every entry is either on the queue, on
+// the history list or free. One spare entry is for a new AP that is being
+// queued while both the queue and the history are full.
+#define WIFI_AP_ARENA_SIZE \
+  (MGOS_WIFI_STA_AP_HISTORY_SIZE + MGOS_WIFI_STA_MAX_AP_QUEUE_LEN + 1)
+// BSSID index is open-addressed and kept at most half full.
+#define WIFI_AP_INDEX_SIZE (WIFI_AP_ARENA_SIZE * 2)
+#define WIFI_AUTH_MODE_UNKNOWN 0xff
+// Auth modes that configs are checked against, others are not filtered on.
+#define WIFI_STA_KNOWN_AUTH_MODES                                      \
+  ((1U << MGOS_WIFI_AUTH_MODE_OPEN) | (1U << MGOS_WIFI_AUTH_MODE_WEP) | \
+   (1U << MGOS_WIFI_AUTH_MODE_WPA_PSK) |                               \
+   (1U << MGOS_WIFI_AUTH_MODE_WPA2_PSK) |                              \
+   (1U << MGOS_WIFI_AUTH_MODE_WPA_WPA2_PSK) |                          \
+   (1U << MGOS_WIFI_AUTH_MODE_WPA2_ENTERPRISE))
+
+#define WIFI_AP_NONE 0xffff
+#if WIFI_AP_INDEX_SIZE >= WIFI_AP_NONE
+#error MGOS_WIFI_STA_AP_HISTORY_SIZE is too large
+#endif
+
+enum wifi_ap_entry_state {
+  WIFI_AP_FREE = 0,
+  WIFI_AP_QUEUED = 1,
+  WIFI_AP_HISTORY = 2,
+};
 
 struct wifi_ap_entry {
-  const struct mgos_config_wifi_sta *cfg;
+  int32_t last_attempt;  // Uptime, seconds.
   uint8_t bssid[6];
   int8_t rssi;
   uint8_t num_attempts;
-  int64_t last_attempt;
-  SLIST_ENTRY(wifi_ap_entry) next;
+  uint8_t channel;
+  uint8_t cfg_idx;    // Index in s_cfgs.
+  uint8_t state;      // enum wifi_ap_entry_state
+  uint8_t auth_mode;  // enum mgos_wifi_auth_mode or WIFI_AUTH_MODE_UNKNOWN
+  // Scoring inputs: BSSIDs on the same channel in the last scan,
+  // connections that did and did not get to IP, average time to IP.
+  uint8_t ch_load;
+  uint8_t num_ok, num_fail;
+  // Not to be retried for this long after the last attempt, seconds.
+  uint8_t backoff;
+  uint16_t tti_ms;
+  int16_t score;  // As of the last scan.
+  // History list (most recently used first) or free list links.
+  uint16_t prev, next;
 };
 
+// Channel load is counted per slot: 2.4 GHz channels map to themselves,
+// 5 GHz ones are 4 apart starting from 36. Slot 0 is "unknown".
+#define WIFI_STA_CH_SLOTS 52
+
 const struct wifi_ap_entry *s_cur_entry = NULL;
 static enum wifi_sta_state s_state = WIFI_STA_IDLE;
 static mgos_timer_id s_connect_timer_id = MGOS_INVALID_TIMER_ID;
-// AP is either on the queue or on the history list, not both.
-static SLIST_HEAD(s_ap_queue, wifi_ap_entry) s_ap_queue;
-static SLIST_HEAD(s_ap_history, wifi_ap_entry) s_ap_history;
+static struct wifi_ap_entry s_aps[WIFI_AP_ARENA_SIZE];
+static uint16_t s_aps_used = 0;  // Entries past this have never been used.
+static uint16_t s_ap_free = WIFI_AP_NONE;
+// Entry index + 1, 0 if the slot is empty.
+static uint16_t s_ap_index[WIFI_AP_INDEX_SIZE];
+// Candidate APs, best first.
+static uint16_t s_ap_queue[MGOS_WIFI_STA_MAX_AP_QUEUE_LEN];
+static int s_ap_queue_len = 0;
+static uint16_t s_ap_hist_head = WIFI_AP_NONE, s_ap_hist_tail = WIFI_AP_NONE;
+static int s_ap_hist_len = 0;
 static int64_t s_last_roam_attempt = 0;
 static bool s_roaming = false;
-static union {
-  int8_t samples[4];
-  uint32_t val;
-} s_rssi_info;
+// Switching APs with mgos_wifi_dev_sta_roam(), IP is retained.
+static bool s_roam_switch = false;
+// Chip roams on its own, see mgos_wifi_dev_sta_set_roam_offload().
+static bool s_roam_offload = false;
+static mgos_timer_id s_rssi_timer_id = MGOS_INVALID_TIMER_ID;
+// Signal is close to the roaming threshold, RSSI is being polled.
+static bool s_rssi_low = false;
+// Driver will notify us when signal gets close to the threshold.
+static bool s_rssi_thr_armed = false;
+// Last AP we got IP from, persisted for fast reconnect.
+static struct {
+  bool loaded;
+  int cfg_idx;
+  char ssid[33];
+  uint8_t bssid[6];
+  int channel;
+  int auth_mode;
+} s_last_ap = {.cfg_idx = -1, .auth_mode = WIFI_AUTH_MODE_UNKNOWN};
+// Current attempt was made without scanning.
+static bool s_fast_connect = false;
+// Scan in progress is limited to channels known APs were seen on.
+static bool s_directed_scan = false;
+// Directed scan has been tried, next one should cover all channels.
+static bool s_full_scan = false;
+static int64_t s_attempt_start = 0;
+// Scans since the last successful connection that led nowhere.
+static int s_num_futile_scans = 0;
+static uint32_t s_rand_state = 0;
+static mgos_wifi_sta_score_fn_t s_score_fn = NULL;
+static void *s_score_fn_arg = NULL;
+static bool s_hist_loaded = false;
+static bool s_hist_dirty = false;
+static uint32_t s_hist_saved_hash = 0;
+static mgos_timer_id s_hist_save_timer_id = MGOS_INVALID_TIMER_ID;
+// Association with the current AP, uptime.
+static int64_t s_link_up = 0;
+static struct sockaddr_in s_sta_ip;
+// Published state for readers on other tasks, protected by a sequence
+// counter (odd while an update is in progress) instead of the wifi lock.
+static uint32_t s_snap_seq = 0;
+static struct mgos_wifi_sta_snapshot s_snap;
+static int64_t s_snap_link_up = 0;
 
 static void mgos_wifi_sta_run(int wifi_ev, void *ev_data, bool timeout);
+static void mgos_wifi_sta_publish(void);
+static void mgos_wifi_sta_rssi_timer_cb(void *arg);
+static void mgos_wifi_sta_rssi_watch(void);
+static void mgos_wifi_sta_history_changed(void);
 
 static bool is_sys_cfg(const struct mgos_config_wifi_sta *cfg) {
   return (cfg == mgos_sys_config_get_wifi_sta() ||
@@ -94,32 +242,160 @@ static bool is_sys_cfg(const struct mgos_config_wifi_sta *cfg) {
 static void mgos_wifi_sta_free_cfg(struct mgos_config_wifi_sta *cfg) {
   if (is_sys_cfg(cfg)) return;
   mgos_config_wifi_sta_free(cfg);
+  free(cfg);
 }
 
-static struct wifi_ap_entry *mgos_wifi_sta_find_history_entry(
-    const uint8_t *bssid) {
-  struct wifi_ap_entry *ape = NULL;
-  SLIST_FOREACH(ape, &s_ap_history, next) {
+static const struct mgos_config_wifi_sta *ap_cfg(
+    const struct wifi_ap_entry *ape) {
+  return s_cfgs[ape->cfg_idx];
+}
+
+static int32_t mgos_wifi_sta_uptime_s(void) {
+  return (int32_t)(mgos_uptime_micros() / 1000000);
+}
+
+static unsigned int mgos_wifi_sta_bssid_slot(const uint8_t *bssid) {
+  // First 3 bytes are the vendor's OUI and are often the same.
+  uint32_t h = (((uint32_t) bssid[2] << 24) | ((uint32_t) bssid[3] << 16) |
+                ((uint32_t) bssid[4] << 8) | bssid[5]);
+  h ^= (((uint32_t) bssid[0] << 8) | bssid[1]);
+  h *= 2654435761U;
+  return (h >> 8) % WIFI_AP_INDEX_SIZE;
+}
+
+static struct wifi_ap_entry *mgos_wifi_sta_find_entry(const uint8_t *bssid) {
+  unsigned int i = mgos_wifi_sta_bssid_slot(bssid);
+  while (s_ap_index[i] != 0) {
+    struct wifi_ap_entry *ape = &s_aps[s_ap_index[i] - 1];
     if (memcmp(ape->bssid, bssid, sizeof(ape->bssid)) == 0) return ape;
+    if (++i == WIFI_AP_INDEX_SIZE) i = 0;
   }
   return NULL;
 }
 
+static void mgos_wifi_sta_index_remove(const struct wifi_ap_entry *ape) {
+  uint16_t v = (ape - s_aps) + 1;
+  unsigned int i = mgos_wifi_sta_bssid_slot(ape->bssid), j;
+  while (s_ap_index[i] != v) {
+    if (++i == WIFI_AP_INDEX_SIZE) i = 0;
+  }
+  // Shift back the entries that would otherwise become unreachable.
+  for (j = i;;) {
+    if (++j == WIFI_AP_INDEX_SIZE) j = 0;
+    if (s_ap_index[j] == 0) break;
+    unsigned int k = mgos_wifi_sta_bssid_slot(s_aps[s_ap_index[j] - 1].bssid);
+    // Entry at j can stay if its home slot is cyclically within (i, j].
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+    s_ap_index[i] = s_ap_index[j];
+    i = j;
+  }
+  s_ap_index[i] = 0;
+}
+
+/* Returns a new entry, the caller must put it on the queue or history. */
+static struct wifi_ap_entry *mgos_wifi_sta_alloc_entry(const uint8_t *bssid) {
+  struct wifi_ap_entry *ape = NULL;
+  if (s_ap_free != WIFI_AP_NONE) {
+    ape = &s_aps[s_ap_free];
+    s_ap_free = ape->next;
+  } else if (s_aps_used < WIFI_AP_ARENA_SIZE) {
+    ape = &s_aps[s_aps_used++];
+  } else {
+    return NULL;
+  }
+  memset(ape, 0, sizeof(*ape));
+  memcpy(ape->bssid, bssid, sizeof(ape->bssid));
+  ape->auth_mode = WIFI_AUTH_MODE_UNKNOWN;
+  unsigned int i = mgos_wifi_sta_bssid_slot(bssid);
+  while (s_ap_index[i] != 0) {
+    if (++i == WIFI_AP_INDEX_SIZE) i = 0;
+  }
+  s_ap_index[i] = (ape - s_aps) + 1;
+  return ape;
+}
+
+static void mgos_wifi_sta_free_entry(struct wifi_ap_entry *ape) {
+  mgos_wifi_sta_index_remove(ape);
+  ape->state = WIFI_AP_FREE;
+  ape->next = s_ap_free;
+  s_ap_free = ape - s_aps;
+}
+
 static void mgos_wifi_sta_remove_history_entry(struct wifi_ap_entry *ape) {
-  SLIST_REMOVE(&s_ap_history, ape, wifi_ap_entry, next);
+  if (ape->prev != WIFI_AP_NONE) {
+    s_aps[ape->prev].next = ape->next;
+  } else {
+    s_ap_hist_head = ape->next;
+  }
+  if (ape->next != WIFI_AP_NONE) {
+    s_aps[ape->next].prev = ape->prev;
+  } else {
+    s_ap_hist_tail = ape->prev;
+  }
+  s_ap_hist_len--;
 }
 
-static void mgos_wifi_sta_add_history_entry(struct wifi_ap_entry *ape) {
-  SLIST_INSERT_HEAD(&s_ap_history, ape, next);
-  int num = 0;
-  struct wifi_ap_entry *oldest = SLIST_FIRST(&s_ap_history);
-  SLIST_FOREACH(ape, &s_ap_history, next) {
-    num++;
-    if (ape->last_attempt < oldest->last_attempt) oldest = ape;
+static void mgos_wifi_sta_link_history_entry(struct wifi_ap_entry *ape,
+                                             bool at_tail) {
+  uint16_t idx = ape - s_aps;
+  ape->state = WIFI_AP_HISTORY;
+  if (at_tail) {
+    ape->prev = s_ap_hist_tail;
+    ape->next = WIFI_AP_NONE;
+    if (s_ap_hist_tail != WIFI_AP_NONE) s_aps[s_ap_hist_tail].next = idx;
+    s_ap_hist_tail = idx;
+    if (s_ap_hist_head == WIFI_AP_NONE) s_ap_hist_head = idx;
+  } else {
+    ape->prev = WIFI_AP_NONE;
+    ape->next = s_ap_hist_head;
+    if (s_ap_hist_head != WIFI_AP_NONE) s_aps[s_ap_hist_head].prev = idx;
+    s_ap_hist_head = idx;
+    if (s_ap_hist_tail == WIFI_AP_NONE) s_ap_hist_tail = idx;
   }
-  if (num > MGOS_WIFI_STA_AP_HISTORY_SIZE) {
+  s_ap_hist_len++;
+}
+
+static void mgos_wifi_sta_add_history_entry(struct wifi_ap_entry *ape) {
+  mgos_wifi_sta_history_changed();
+  mgos_wifi_sta_link_history_entry(ape, false /* at_tail */);
+  if (s_ap_hist_len > MGOS_WIFI_STA_AP_HISTORY_SIZE) {
+    // Evict the least recently used one, but not the one we are on.
+    struct wifi_ap_entry *oldest = &s_aps[s_ap_hist_tail];
+    if (oldest == s_cur_entry) oldest = &s_aps[oldest->prev];
     mgos_wifi_sta_remove_history_entry(oldest);
-    free(oldest);
+    mgos_wifi_sta_free_entry(oldest);
+  }
+}
+
+static struct wifi_ap_entry *mgos_wifi_sta_queue_head(void) {
+  return (s_ap_queue_len > 0 ? &s_aps[s_ap_queue[0]] : NULL);
+}
+
+static struct wifi_ap_entry *mgos_wifi_sta_queue_pop(void) {
+  struct wifi_ap_entry *ape = mgos_wifi_sta_queue_head();
+  if (ape == NULL) return NULL;
+  s_ap_queue_len--;
+  memmove(&s_ap_queue[0], &s_ap_queue[1],
+          s_ap_queue_len * sizeof(s_ap_queue[0]));
+  return ape;
+}
+
+static void mgos_wifi_sta_queue_insert(struct wifi_ap_entry *ape, int pos) {
+  memmove(&s_ap_queue[pos + 1], &s_ap_queue[pos],
+          (s_ap_queue_len - pos) * sizeof(s_ap_queue[0]));
+  s_ap_queue[pos] = ape - s_aps;
+  s_ap_queue_len++;
+  ape->state = WIFI_AP_QUEUED;
+}
+
+static void mgos_wifi_sta_queue_remove(struct wifi_ap_entry *ape) {
+  uint16_t idx = ape - s_aps;
+  for (int i = 0; i < s_ap_queue_len; i++) {
+    if (s_ap_queue[i] != idx) continue;
+    s_ap_queue_len--;
+    memmove(&s_ap_queue[i], &s_ap_queue[i + 1],
+            (s_ap_queue_len - i) * sizeof(s_ap_queue[0]));
+    break;
   }
 }
 
@@ -130,54 +406,604 @@ static const char *mgos_wifi_sta_bssid_to_str(const uint8_t *bssid,
   return bssid_s;
 }
 
-static bool check_ap(const struct mgos_wifi_scan_result *e,
-                     const struct mgos_config_wifi_sta **sta_cfg,
-                     const struct wifi_ap_entry *hape, const char **reason) {
-  *sta_cfg = NULL;
+static bool mgos_wifi_sta_str_to_bssid(const char *bssid_s, uint8_t *bssid) {
+  unsigned int b[6];
+  if (mgos_conf_str_empty(bssid_s) ||
+      sscanf(bssid_s, "%02x:%02x:%02x:%02x:%02x:%02x", &b[0], &b[1], &b[2],
+             &b[3], &b[4], &b[5]) != 6) {
+    return false;
+  }
+  for (int i = 0; i < 6; i++) bssid[i] = b[i];
+  return true;
+}
+
+uint32_t mgos_wifi_sta_ssid_hash(const char *ssid, uint8_t *len) {
+  uint32_t h = 2166136261U;
+  const char *p = ssid;
+  for (; *p != '\0'; p++) {
+    h = (h ^ (uint8_t) *p) * 16777619U;
+  }
+  if (len != NULL) *len = (uint8_t)(p - ssid);
+  return h;
+}
+
+static uint32_t mgos_wifi_sta_device_hash(void) {
+  const char *id = mgos_sys_config_get_device_id();
+  return mgos_wifi_sta_ssid_hash(id != NULL ? id : "", NULL);
+}
+
+// Jitter source, seeded with the device ID so that devices which lost the
+// same AP at the same time do not come back in lockstep.
+static uint32_t mgos_wifi_sta_rand(void) {
+  uint32_t x = s_rand_state;
+  if (x == 0) {
+    x = mgos_wifi_sta_device_hash() ^ (uint32_t) mgos_uptime_micros();
+  }
+  if (x == 0) x = 1;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  s_rand_state = x;
+  return x;
+}
+
+// Adds a random amount, up to wifi.sta_backoff.jitter_pct of the delay.
+static int mgos_wifi_sta_jitter_ms(int delay_ms) {
+  int jitter_pct = mgos_sys_config_get_wifi_sta_backoff_jitter_pct();
+  int64_t range = (int64_t) delay_ms * jitter_pct / 100;
+  if (range > INT32_MAX - delay_ms) range = INT32_MAX - delay_ms;
+  if (range <= 0) return delay_ms;
+  return delay_ms + (int) (mgos_wifi_sta_rand() % (uint32_t) range);
+}
+
+// base * 2^n, capped.
+static int mgos_wifi_sta_exp_delay(int base, int n, int max) {
+  if (base <= 0) return 0;
+  int d = base;
+  for (; n > 0 && d < max; n--) d = (d < max / 2 ? d * 2 : max);
+  return (d < max ? d : max);
+}
+
+// Failing AP is given another chance after wifi.sta_backoff.ap_retry_s,
+// doubling with each failure after that. Jitter is fixed per device and
+// BSSID, so that the decision does not flip back and forth.
+static int32_t mgos_wifi_sta_ap_retry_s(const struct wifi_ap_entry *ape) {
+  int n = ape->num_attempts - MGOS_WIFI_STA_AP_ATTEMPTS;
+  int32_t retry_s = mgos_wifi_sta_exp_delay(
+      mgos_sys_config_get_wifi_sta_backoff_ap_retry_s(), (n > 0 ? n : 0),
+      mgos_sys_config_get_wifi_sta_backoff_ap_retry_max_s());
+  int jitter_pct = mgos_sys_config_get_wifi_sta_backoff_jitter_pct();
+  int range = retry_s * jitter_pct / 100;
+  if (range > 0) {
+    uint32_t h = mgos_wifi_sta_device_hash();
+    for (int i = 0; i < (int) sizeof(ape->bssid); i++) {
+      h = (h ^ ape->bssid[i]) * 16777619U;
+    }
+    retry_s += (int32_t)(h % (uint32_t) range);
+  }
+  return retry_s;
+}
+
+static bool mgos_wifi_sta_ap_is_failing(const struct wifi_ap_entry *hape) {
+  return (hape != NULL && hape->num_attempts >= MGOS_WIFI_STA_AP_ATTEMPTS &&
+          (mgos_wifi_sta_uptime_s() - hape->last_attempt <
+           mgos_wifi_sta_ap_retry_s(hape)));
+}
+
+// Like failing APs, these are still tried when there is nothing else.
+static bool mgos_wifi_sta_ap_in_backoff(const struct wifi_ap_entry *hape) {
+  return (hape != NULL && hape->backoff > 0 &&
+          (mgos_wifi_sta_uptime_s() - hape->last_attempt < hape->backoff));
+}
+
+static int mgos_wifi_sta_ch_slot(int ch) {
+  if (ch <= 14) return (ch > 0 ? ch : 0);
+  int slot = 15 + (ch - 36) / 4;
+  return (slot >= 15 && slot < WIFI_STA_CH_SLOTS ? slot : 0);
+}
+
+/* Increments one counter of a pair, halving both when it saturates. */
+static void mgos_wifi_sta_count(uint8_t *cnt, uint8_t *other) {
+  if (*cnt == UINT8_MAX) {
+    *cnt /= 2;
+    *other /= 2;
+  }
+  (*cnt)++;
+}
+
+int mgos_wifi_sta_default_score(const struct mgos_wifi_sta_ap_info *ap) {
+  int score = ap->rssi * mgos_sys_config_get_wifi_sta_score_rssi_pct() / 100;
+  if (ap->cfg != NULL) score += ap->cfg->pref;
+  int num_tries = ap->num_successes + ap->num_failures;
+  if (num_tries > 0) {
+    score -= mgos_sys_config_get_wifi_sta_score_fail() * ap->num_failures /
+             num_tries;
+  }
+  score -= mgos_sys_config_get_wifi_sta_score_tti() * ap->avg_time_to_ip_ms /
+           1000;
+  if (ap->num_bss_on_channel > 1) {
+    score -= mgos_sys_config_get_wifi_sta_score_congestion() *
+             (ap->num_bss_on_channel - 1);
+  }
+  return score;
+}
+
+void mgos_wifi_sta_set_score_fn(mgos_wifi_sta_score_fn_t fn, void *arg) {
+  wifi_lock();
+  s_score_fn = fn;
+  s_score_fn_arg = arg;
+  wifi_unlock();
+}
+
+static int16_t mgos_wifi_sta_score(const uint8_t *bssid, int cfg_idx, int rssi,
+                                   int channel, int ch_load,
+                                   const struct wifi_ap_entry *ape) {
+  struct mgos_wifi_sta_ap_info ap = {
+      .bssid = bssid,
+      .cfg = s_cfgs[cfg_idx],
+      .rssi = rssi,
+      .channel = channel,
+      .num_bss_on_channel = ch_load,
+      .num_successes = (ape != NULL ? ape->num_ok : 0),
+      .num_failures = (ape != NULL ? ape->num_fail : 0),
+      .avg_time_to_ip_ms = (ape != NULL ? ape->tti_ms : 0),
+  };
+  int score = (s_score_fn != NULL ? s_score_fn(&ap, s_score_fn_arg)
+                                  : mgos_wifi_sta_default_score(&ap));
+  if (score < INT16_MIN) score = INT16_MIN;
+  if (score > INT16_MAX) score = INT16_MAX;
+  return score;
+}
+
+static void put_le(uint8_t *p, uint64_t v, int n) {
+  for (int i = 0; i < n; i++, v >>= 8) p[i] = (uint8_t) v;
+}
+
+static uint64_t get_le(const uint8_t *p, int n) {
+  uint64_t v = 0;
+  for (int i = n - 1; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+static int64_t mgos_wifi_sta_wall_time(void) {
+  int64_t now = (int64_t) mg_time();
+  return (now > WIFI_STA_HIST_MIN_VALID_TIME ? now : 0);
+}
+
+/*
+ * Worth keeping are APs with connection stats and failed attempts that have
+ * not expired yet.
+ */
+static bool mgos_wifi_sta_history_entry_persistent(
+    const struct wifi_ap_entry *ape, int32_t now) {
+  // Channels of APs that were candidates but have not been tried yet are
+  // worth keeping too, to limit scans to them.
+  return (ape->num_ok > 0 || ape->num_fail > 0 ||
+          (ape->num_attempts == 0 && ape->channel > 0) ||
+          (ape->num_attempts > 0 &&
+           now - ape->last_attempt < mgos_wifi_sta_ap_retry_s(ape)));
+}
+
+/* Hash of the persistent part of the history, used to skip no-op writes. */
+static uint32_t mgos_wifi_sta_history_hash(int32_t now, int *num) {
+  uint32_t h = 2166136261U;
+  *num = 0;
+  for (uint16_t i = s_ap_hist_head; i != WIFI_AP_NONE; i = s_aps[i].next) {
+    const struct wifi_ap_entry *ape = &s_aps[i];
+    if (!mgos_wifi_sta_history_entry_persistent(ape, now)) continue;
+    // Stats are coarsened, small fluctuations are not worth a write.
+    int num_tries = ape->num_ok + ape->num_fail;
+    uint8_t d[10];
+    memcpy(d, ape->bssid, 6);
+    d[6] = ape->num_attempts;
+    d[7] = ape->channel;
+    d[8] = (num_tries > 0 ? ape->num_fail * 10 / num_tries : 0xff);
+    d[9] = ape->tti_ms / 500;
+    for (size_t i = 0; i < sizeof(d); i++) h = (h ^ d[i]) * 16777619U;
+    (*num)++;
+  }
+  return h;
+}
+
+static void mgos_wifi_sta_save_history(void) {
+  int num = 0;
+  bool ok = false;
+  uint8_t *buf = NULL;
+  char *tmp_fn = NULL;
+  FILE *fp = NULL;
+  const char *fn = mgos_sys_config_get_wifi_sta_history_file();
+  int32_t now = mgos_wifi_sta_uptime_s();
+  uint32_t hash = mgos_wifi_sta_history_hash(now, &num);
+  s_hist_dirty = false;
+  if (mgos_conf_str_empty(fn) || hash == s_hist_saved_hash) return;
+  size_t len = WIFI_STA_HIST_HDR_SIZE + num * WIFI_STA_HIST_ENTRY_SIZE;
+  buf = (uint8_t *) malloc(len);
+  tmp_fn = (char *) malloc(strlen(fn) + 5);
+  if (buf == NULL || tmp_fn == NULL) goto out;
+  uint8_t *p = buf;
+  p[0] = 'W';
+  p[1] = 'H';
+  p[2] = WIFI_STA_HIST_VERSION;
+  put_le(p + 3, num, 2);
+  put_le(p + 5, mgos_wifi_sta_wall_time(), 8);
+  p += WIFI_STA_HIST_HDR_SIZE;
+  for (uint16_t i = s_ap_hist_head; i != WIFI_AP_NONE; i = s_aps[i].next) {
+    const struct wifi_ap_entry *ape = &s_aps[i];
+    if (!mgos_wifi_sta_history_entry_persistent(ape, now)) continue;
+    memcpy(p, ape->bssid, 6);
+    p[6] = (uint8_t) ape->rssi;
+    p[7] = ape->num_attempts;
+    p[8] = ape->channel;
+    put_le(p + 9, now - ape->last_attempt, 4);
+    p[13] = ape->num_ok;
+    p[14] = ape->num_fail;
+    put_le(p + 15, ape->tti_ms, 2);
+    p += WIFI_STA_HIST_ENTRY_SIZE;
+  }
+  // Write a new file and rename it over the old one, so that a reset in the
+  // middle of the write does not leave a truncated file behind.
+  sprintf(tmp_fn, "%s.tmp", fn);
+  fp = fopen(tmp_fn, "wb");
+  if (fp == NULL) goto out;
+  if (fwrite(buf, 1, len, fp) != len) goto out;
+  fclose(fp);
+  fp = NULL;
+  if (rename(tmp_fn, fn) != 0) {
+    remove(fn);
+    if (rename(tmp_fn, fn) != 0) goto out;
+  }
+  s_hist_saved_hash = hash;
+  LOG(LL_DEBUG, ("Saved %d AP history entries", num));
+  ok = true;
+
+out:
+  if (fp != NULL) fclose(fp);
+  if (!ok) {
+    LOG(LL_ERROR, ("Failed to save %s", fn));
+    if (tmp_fn != NULL) remove(tmp_fn);
+  }
+  free(tmp_fn);
+  free(buf);
+}
+
+static void mgos_wifi_sta_load_history(void) {
+  if (s_hist_loaded) return;
+  s_hist_loaded = true;
+  const char *fn = mgos_sys_config_get_wifi_sta_history_file();
+  if (mgos_conf_str_empty(fn)) return;
+  size_t size = 0;
+  char *data = cs_read_file(fn, &size);
+  if (data == NULL) return;
+  const uint8_t *p = (const uint8_t *) data;
+  int num = 0, num_loaded = 0;
+  if (size >= WIFI_STA_HIST_HDR_SIZE) num = get_le(p + 3, 2);
+  if (size >= WIFI_STA_HIST_HDR_SIZE && p[2] != WIFI_STA_HIST_VERSION) {
+    LOG(LL_INFO, ("%s: version %d, ignored", fn, p[2]));
+    goto out;
+  }
+  if (size < WIFI_STA_HIST_HDR_SIZE || p[0] != 'W' || p[1] != 'H' ||
+      size != (size_t)(WIFI_STA_HIST_HDR_SIZE +
+                       num * WIFI_STA_HIST_ENTRY_SIZE)) {
+    LOG(LL_ERROR, ("%s: invalid history file", fn));
+    goto out;
+  }
+  // Time spent powered off, if we can tell. Otherwise assume none, this will
+  // keep failing APs out for a bit longer than strictly necessary.
+  int64_t off_time = 0;
+  int64_t saved_at = (int64_t) get_le(p + 5, 8);
+  int64_t wall_now = mgos_wifi_sta_wall_time();
+  if (saved_at > 0 && wall_now > saved_at) off_time = wall_now - saved_at;
+  int32_t now = mgos_wifi_sta_uptime_s();
+  p += WIFI_STA_HIST_HDR_SIZE;
+  for (int i = 0; i < num; i++, p += WIFI_STA_HIST_ENTRY_SIZE) {
+    if (s_ap_hist_len >= MGOS_WIFI_STA_AP_HISTORY_SIZE) break;
+    int64_t age = (int64_t) get_le(p + 9, 4) + off_time;
+    if (age > INT32_MAX / 2) age = INT32_MAX / 2;
+    // What we've learned since boot takes precedence.
+    if (mgos_wifi_sta_find_entry(p) != NULL) continue;
+    struct wifi_ap_entry *ape = mgos_wifi_sta_alloc_entry(p);
+    if (ape == NULL) break;
+    ape->rssi = (int8_t) p[6];
+    ape->num_attempts = p[7];
+    ape->channel = p[8];
+    ape->last_attempt = now - (int32_t) age;
+    ape->num_ok = p[13];
+    ape->num_fail = p[14];
+    ape->tti_ms = get_le(p + 15, 2);
+    // Entries are saved most recent first and are older than anything
+    // learned since boot.
+    mgos_wifi_sta_link_history_entry(ape, true /* at_tail */);
+    num_loaded++;
+  }
+  s_hist_saved_hash = mgos_wifi_sta_history_hash(now, &num);
+  LOG(LL_INFO, ("Loaded %d AP history entries", num_loaded));
+
+out:
+  free(data);
+}
+
+static void mgos_wifi_sta_history_save_timer_cb(void *arg) {
+  wifi_lock();
+  s_hist_save_timer_id = MGOS_INVALID_TIMER_ID;
+  if (s_hist_dirty) mgos_wifi_sta_save_history();
+  wifi_unlock();
+  (void) arg;
+}
+
+/*
+ * Saves are batched: history changes on every connection attempt and we do
+ * not want to wear out the flash with every one of them.
+ */
+static void mgos_wifi_sta_history_changed(void) {
+  s_hist_dirty = true;
+  if (s_hist_save_timer_id != MGOS_INVALID_TIMER_ID) return;
+  s_hist_save_timer_id = mgos_set_timer(
+      mgos_sys_config_get_wifi_sta_history_save_interval() * 1000, 0,
+      mgos_wifi_sta_history_save_timer_cb, NULL);
+}
+
+static bool mgos_wifi_sta_add_cfg2(const struct mgos_config_wifi_sta *cfg,
+                                   const uint8_t *pmk);
+
+static bool mgos_wifi_sta_pmk_ok(const struct mgos_config_wifi_sta *cfg) {
+  // WPA passphrase is 8 to 63 characters.
+  return (!mgos_conf_str_empty(cfg->pass) && mgos_conf_str_empty(cfg->cert) &&
+          mgos_conf_str_empty(cfg->user) && strlen(cfg->pass) >= 8 &&
+          strlen(cfg->pass) <= 63 && mgos_sys_config_get_wifi_sta_pmk_cache() &&
+          mgos_wifi_has_cap(MGOS_WIFI_CAP_PMK));
+}
+
+// pmk is the key derived for cfg, NULL if it has not been.
+static void mgos_wifi_sta_compile_cfg(const struct mgos_config_wifi_sta *cfg,
+                                      const uint8_t *pmk,
+                                      struct wifi_sta_cfg_desc *d) {
+  memset(d, 0, sizeof(*d));
+  d->ssid_hash = mgos_wifi_sta_ssid_hash(cfg->ssid, &d->ssid_len);
+  bool have_pass = !mgos_conf_str_empty(cfg->pass);
+  bool is_eap =
+      (!mgos_conf_str_empty(cfg->cert) || !mgos_conf_str_empty(cfg->user));
+  if (!have_pass && !is_eap) {
+    d->auth_modes |= (1U << MGOS_WIFI_AUTH_MODE_OPEN);
+  }
+  if (is_eap) {
+    d->auth_modes |= (1U << MGOS_WIFI_AUTH_MODE_WPA2_ENTERPRISE);
+  }
+  if (have_pass) {
+    d->auth_modes |= (1U << MGOS_WIFI_AUTH_MODE_WEP) |
+                     (1U << MGOS_WIFI_AUTH_MODE_WPA_PSK) |
+                     (1U << MGOS_WIFI_AUTH_MODE_WPA2_PSK) |
+                     (1U << MGOS_WIFI_AUTH_MODE_WPA_WPA2_PSK);
+  }
+  // If the config specifies a particular BSSID, only that AP will do.
+  if (!mgos_conf_str_empty(cfg->bssid)) {
+    d->have_bssid = true;
+    if (!mgos_wifi_sta_str_to_bssid(cfg->bssid, d->bssid)) d->auth_modes = 0;
+  }
+  d->pmk_ok = mgos_wifi_sta_pmk_ok(cfg);
+  if (d->pmk_ok && pmk != NULL) {
+    memcpy(d->pmk, pmk, sizeof(d->pmk));
+    d->have_pmk = true;
+  }
+}
+
+// Until the key is there, the passphrase is used.
+static bool mgos_wifi_sta_use_pmk(const struct wifi_ap_entry *ape) {
+  if (!s_cfg_descs[ape->cfg_idx].have_pmk) return false;
+  switch (ape->auth_mode) {
+    case MGOS_WIFI_AUTH_MODE_WPA_PSK:
+    case MGOS_WIFI_AUTH_MODE_WPA2_PSK:
+    case MGOS_WIFI_AUTH_MODE_WPA_WPA2_PSK:
+      return true;
+  }
+  // Could be WEP.
+  return false;
+}
+
+/*
+ * Derives the key for one config that is missing it, with the lock released
+ * for the duration, and reschedules itself if there are more.
+ */
+static void mgos_wifi_sta_derive_pmk_cb(void *arg) {
+  char ssid[33], pass[64];
+  uint8_t pmk[32];
+  int i;
+  wifi_lock();
+  for (i = 0; i < s_num_cfgs; i++) {
+    if (s_cfg_descs[i].pmk_ok && !s_cfg_descs[i].have_pmk) break;
+  }
+  if (i == s_num_cfgs) {
+    s_pmk_cb_pending = false;
+    wifi_unlock();
+    return;
+  }
+  strncpy(ssid, s_cfgs[i]->ssid, sizeof(ssid) - 1);
+  ssid[sizeof(ssid) - 1] = '\0';
+  strncpy(pass, s_cfgs[i]->pass, sizeof(pass) - 1);
+  pass[sizeof(pass) - 1] = '\0';
+  wifi_unlock();
+  mgos_wifi_sta_derive_pmk(ssid, pass, pmk);
+  wifi_lock();
+  // The config may have been replaced meanwhile.
+  if (i < s_num_cfgs && s_cfg_descs[i].pmk_ok && !s_cfg_descs[i].have_pmk &&
+      strcmp(s_cfgs[i]->ssid, ssid) == 0 &&
+      strcmp(s_cfgs[i]->pass, pass) == 0) {
+    memcpy(s_cfg_descs[i].pmk, pmk, sizeof(pmk));
+    s_cfg_descs[i].have_pmk = true;
+  }
+  s_pmk_cb_pending =
+      mgos_invoke_cb(mgos_wifi_sta_derive_pmk_cb, NULL, false /* from_isr */);
+  wifi_unlock();
+  (void) arg;
+}
+
+// For configs that are added with the lock held, the key is derived in a step
+// of its own.
+static void mgos_wifi_sta_schedule_derive_pmk(void) {
+  if (s_pmk_cb_pending) return;
+  s_pmk_cb_pending =
+      mgos_invoke_cb(mgos_wifi_sta_derive_pmk_cb, NULL, false /* from_isr */);
+}
+
+static bool cfg_matches(int cfg_idx, const struct mgos_wifi_scan_result *e,
+                        uint32_t ssid_hash, uint8_t ssid_len) {
+  const struct wifi_sta_cfg_desc *d = &s_cfg_descs[cfg_idx];
+  if (d->ssid_hash != ssid_hash || d->ssid_len != ssid_len) return false;
+  uint32_t mode = ((unsigned) e->auth_mode < 32 ? 1U << e->auth_mode : 0);
+  if ((mode & WIFI_STA_KNOWN_AUTH_MODES) && !(d->auth_modes & mode)) {
+    return false;
+  }
+  if (d->have_bssid && memcmp(d->bssid, e->bssid, sizeof(d->bssid)) != 0) {
+    return false;
+  }
+  const struct mgos_config_wifi_sta *cfg = s_cfgs[cfg_idx];
+  return (cfg->enable && strcmp(cfg->ssid, e->ssid) == 0);
+}
+
+static bool mgos_wifi_sta_cfg_in_use(int cfg_idx) {
+  if (s_cur_entry != NULL && s_cur_entry->cfg_idx == cfg_idx) return true;
+  for (int i = 0; i < s_ap_queue_len; i++) {
+    if (s_aps[s_ap_queue[i]].cfg_idx == cfg_idx) return true;
+  }
+  return false;
+}
+
+/* Returns index of the config for the network in s_cfgs, -1 if none. */
+static int mgos_wifi_sta_find_cfg(const char *ssid) {
   for (int i = 0; i < s_num_cfgs; i++) {
-    const struct mgos_config_wifi_sta *cfg = s_cfgs[i];
-    if (!cfg->enable) continue;
-    if (strcmp(cfg->ssid, e->ssid) != 0) continue;
-    // Check if auth mode matches.
-    bool have_pass = !mgos_conf_str_empty(cfg->pass);
-    bool is_eap =
-        (!mgos_conf_str_empty(cfg->cert) || !mgos_conf_str_empty(cfg->user));
-    switch (e->auth_mode) {
-      case MGOS_WIFI_AUTH_MODE_OPEN:
-        if (have_pass || is_eap) continue;
-        break;
-      case MGOS_WIFI_AUTH_MODE_WPA2_ENTERPRISE:
-        if (!is_eap) continue;
-        break;
-      case MGOS_WIFI_AUTH_MODE_WEP:
-      case MGOS_WIFI_AUTH_MODE_WPA_PSK:
-      case MGOS_WIFI_AUTH_MODE_WPA2_PSK:
-      case MGOS_WIFI_AUTH_MODE_WPA_WPA2_PSK:
-        if (!have_pass) continue;
-        break;
+    if (strcmp(s_cfgs[i]->ssid, ssid) == 0) return i;
+  }
+  return -1;
+}
+
+/*
+ * Reads config for the network from the known network database. Does file
+ * I/O, so should not be called with the lock held if it can be helped.
+ */
+static bool mgos_wifi_sta_db_read_cfg(const char *ssid,
+                                      struct mgos_config_wifi_sta *cfg) {
+  memset(cfg, 0, sizeof(*cfg));
+  if (!mgos_wifi_sta_db_get(ssid, cfg)) return false;
+  char *msg = NULL;
+  if (cfg->enable && mgos_wifi_validate_sta_cfg(cfg, &msg)) return true;
+  if (cfg->enable) LOG(LL_ERROR, ("%s: %s", ssid, (msg ? msg : "")));
+  free(msg);
+  mgos_config_wifi_sta_free(cfg);
+  return false;
+}
+
+/*
+ * Adds config read from the database to s_cfgs, taking it over. Once there
+ * are MGOS_WIFI_STA_DB_MAX_CFGS of them, one that is not in use is replaced.
+ * pmk is its key, NULL if it is yet to be derived. Returns its index, or -1
+ * if there is no room.
+ */
+static int mgos_wifi_sta_db_add_cfg(struct mgos_config_wifi_sta *cfg,
+                                    const uint8_t *pmk) {
+  int res = -1;
+  if (s_num_db_cfgs < MGOS_WIFI_STA_DB_MAX_CFGS) {
+    if (!mgos_wifi_sta_add_cfg2(cfg, pmk)) goto out;
+    res = s_num_cfgs - 1;
+    s_db_cfgs[s_num_db_cfgs++] = res;
+    goto out;
+  }
+  for (int n = 0; n < MGOS_WIFI_STA_DB_MAX_CFGS; n++) {
+    int slot = (s_db_next_slot + n) % MGOS_WIFI_STA_DB_MAX_CFGS;
+    int i = s_db_cfgs[slot];
+    if (mgos_wifi_sta_cfg_in_use(i)) continue;
+    LOG(LL_DEBUG, ("Replacing %s with %s", s_cfgs[i]->ssid, cfg->ssid));
+    mgos_config_wifi_sta_free(s_cfgs[i]);
+    // Take over the parsed config instead of copying it, a copy could fail
+    // and leave the slot without an SSID.
+    *s_cfgs[i] = *cfg;
+    memset(cfg, 0, sizeof(*cfg));
+    mgos_wifi_sta_compile_cfg(s_cfgs[i], pmk, &s_cfg_descs[i]);
+    res = i;
+    s_db_next_slot = (slot + 1) % MGOS_WIFI_STA_DB_MAX_CFGS;
+    break;
+  }
+out:
+  mgos_config_wifi_sta_free(cfg);
+  if (res >= 0 && s_cfg_descs[res].pmk_ok && !s_cfg_descs[res].have_pmk) {
+    mgos_wifi_sta_schedule_derive_pmk();
+  }
+  return res;
+}
+
+/*
+ * Returns index of the config for the specified network from the known
+ * network database, adding it to s_cfgs if necessary.
+ */
+static int mgos_wifi_sta_db_cfg_idx(const char *ssid) {
+  struct mgos_config_wifi_sta cfg;
+  if (!mgos_sys_config_get_wifi_sta_db_enable()) return -1;
+  int i = mgos_wifi_sta_find_cfg(ssid);
+  if (i >= 0) return i;
+  if (!mgos_wifi_sta_db_read_cfg(ssid, &cfg)) return -1;
+  return mgos_wifi_sta_db_add_cfg(&cfg, NULL);
+}
+
+/*
+ * Brings in database configs for the networks in scan results that are not
+ * known yet. The list is made under the lock, the file is read and the keys
+ * are derived without it; ranking then only looks at s_cfgs.
+ */
+static void mgos_wifi_sta_db_fetch(int num_res,
+                                   const struct mgos_wifi_scan_result *res) {
+  int n = 0;
+  if (!mgos_sys_config_get_wifi_sta_db_enable() || num_res <= 0) return;
+  char(*ssids)[33] = (char(*)[33]) malloc(num_res * sizeof(*ssids));
+  if (ssids == NULL) return;
+  wifi_lock();
+  for (int i = 0; i < num_res; i++) {
+    const char *ssid = res[i].ssid;
+    if (ssid[0] == '\0' || mgos_wifi_sta_find_cfg(ssid) >= 0) continue;
+    int j = 0;
+    while (j < n && strcmp(ssids[j], ssid) != 0) j++;
+    if (j < n) continue;
+    strncpy(ssids[n], ssid, sizeof(ssids[n]) - 1);
+    ssids[n++][sizeof(ssids[0]) - 1] = '\0';
+  }
+  wifi_unlock();
+  for (int i = 0; i < n; i++) {
+    struct mgos_config_wifi_sta cfg;
+    uint8_t pmk[32];
+    if (!mgos_wifi_sta_db_read_cfg(ssids[i], &cfg)) continue;
+    // The network is in range and may be tried right after ranking.
+    bool have_pmk = mgos_wifi_sta_pmk_ok(&cfg);
+    if (have_pmk) mgos_wifi_sta_derive_pmk(cfg.ssid, cfg.pass, pmk);
+    wifi_lock();
+    if (mgos_wifi_sta_find_cfg(ssids[i]) < 0) {
+      mgos_wifi_sta_db_add_cfg(&cfg, (have_pmk ? pmk : NULL));
+    } else {
+      mgos_config_wifi_sta_free(&cfg);
     }
-    // If the config specifies a particular BSSID, check it.
-    if (!mgos_conf_str_empty(cfg->bssid)) {
-      char bssid_s[20];
-      mgos_wifi_sta_bssid_to_str(e->bssid, bssid_s);
-      if (strcasecmp(cfg->bssid, bssid_s) != 0) {
-        continue;
-      }
+    wifi_unlock();
+  }
+  free(ssids);
+}
+
+static bool check_ap(const struct mgos_wifi_scan_result *e, int rssi_thr,
+                     int *cfg_idx, const struct wifi_ap_entry *hape,
+                     const char **reason) {
+  *cfg_idx = -1;
+  uint8_t ssid_len;
+  uint32_t ssid_hash = mgos_wifi_sta_ssid_hash(e->ssid, &ssid_len);
+  // Database configs are brought in beforehand, see mgos_wifi_sta_db_fetch().
+  for (int i = 0; i < s_num_cfgs; i++) {
+    if (cfg_matches(i, e, ssid_hash, ssid_len)) {
+      *cfg_idx = i;
+      break;
     }
-    *sta_cfg = cfg;
-    break;
   }
-  if (*sta_cfg == NULL) {
+  if (*cfg_idx < 0) {
     *reason = "no matching config";
     return false;
   }
-  if (e->rssi < mgos_sys_config_get_wifi_sta_rssi_thr()) {
+  if (e->rssi < rssi_thr) {
     *reason = "too weak";
     return false;
   }
-  if (hape != NULL && hape->num_attempts >= MGOS_WIFI_STA_AP_ATTEMPTS &&
-      (mgos_uptime_micros() - hape->last_attempt <
-       (MGOS_WIFI_STA_FAILING_AP_RETRY_SECONDS * 1000000LL))) {
+  if (mgos_wifi_sta_ap_is_failing(hape)) {
     *reason = "bad history";
     return false;
   }
@@ -187,15 +1013,21 @@ static bool check_ap(const struct mgos_wifi_scan_result *e,
 
 static void mgos_wifi_sta_connect_timeout_timer_cb(void *arg) {
   wifi_lock();
+  s_connect_timer_id = MGOS_INVALID_TIMER_ID;
   mgos_wifi_sta_run(-1 /* wifi_ev */, NULL /* evd */, true /* timeout */);
   wifi_unlock();
   (void) arg;
 }
 
+static void clear_timeout(void) {
+  mgos_clear_timer(s_connect_timer_id);
+  s_connect_timer_id = MGOS_INVALID_TIMER_ID;
+}
+
 static void set_timeout_n(int timeout, bool run_now) {
   mgos_clear_timer(s_connect_timer_id);
   s_connect_timer_id = mgos_set_timer(
-      timeout, MGOS_TIMER_REPEAT, mgos_wifi_sta_connect_timeout_timer_cb, NULL);
+      timeout, 0, mgos_wifi_sta_connect_timeout_timer_cb, NULL);
   if (run_now) {
     mgos_wifi_sta_run(-1 /* wifi_ev */, NULL /* evd */, false /* timeout */);
   }
@@ -205,27 +1037,53 @@ static void set_timeout(bool run_now) {
   set_timeout_n(mgos_sys_config_get_wifi_sta_connect_timeout() * 1000, run_now);
 }
 
+// Delay before the next scan after all the candidates have failed.
+// First rescan is immediate, after that the delay grows exponentially.
+static int mgos_wifi_sta_rescan_delay_ms(void) {
+  if (s_num_futile_scans == 0) return 0;
+  return mgos_wifi_sta_jitter_ms(mgos_wifi_sta_exp_delay(
+      mgos_sys_config_get_wifi_sta_backoff_base_ms(), s_num_futile_scans - 1,
+      mgos_sys_config_get_wifi_sta_backoff_max_ms()));
+}
+
+// Random delay before reconnecting, to spread out the herd when an AP
+// that many devices were on goes away.
+static int mgos_wifi_sta_reconnect_delay_ms(void) {
+  int max_ms = mgos_sys_config_get_wifi_sta_backoff_reconnect_ms();
+  return (max_ms > 0 ? (int) (mgos_wifi_sta_rand() % (uint32_t) max_ms) : 0);
+}
+
 static void mgos_wifi_sta_build_queue(int num_res,
                                       struct mgos_wifi_scan_result *res,
+                                      const uint8_t *ch_load,
                                       bool check_history) {
+  int rssi_thr = mgos_sys_config_get_wifi_sta_rssi_thr();
   for (int i = 0; i < num_res; i++) {
     const struct mgos_wifi_scan_result *e = &res[i];
-    const struct mgos_config_wifi_sta *cfg = NULL;
+    int cfg_idx = -1;
     const char *reason = NULL;
-    struct wifi_ap_entry *eape = mgos_wifi_sta_find_history_entry(e->bssid);
-    bool ok = check_ap(e, &cfg, (check_history ? eape : NULL), &reason);
+    struct wifi_ap_entry *eape = mgos_wifi_sta_find_entry(e->bssid);
+    const struct wifi_ap_entry *hape =
+        (eape != NULL && eape->state == WIFI_AP_HISTORY ? eape : NULL);
+    bool ok = check_ap(e, rssi_thr, &cfg_idx, (check_history ? hape : NULL),
+                       &reason);
+    if (ok && check_history && mgos_wifi_sta_ap_in_backoff(hape)) {
+      ok = false;
+      reason = "backoff";
+    }
     /* Check if we already have this queued. */
-    int len = 0;
-    struct wifi_ap_entry *pape = NULL;
+    if (ok && eape != NULL && eape->state == WIFI_AP_QUEUED) {
+      ok = false;
+      reason = "dup";
+    }
+    int pos = 0, score = 0;
+    int load = ch_load[mgos_wifi_sta_ch_slot(e->channel)];
+    if (load == 0) load = 1;
     if (ok) {
-      struct wifi_ap_entry *ape = NULL;
-      SLIST_FOREACH(ape, &s_ap_queue, next) {
-        if (memcmp(ape->bssid, e->bssid, sizeof(e->bssid)) == 0) {
-          ok = false;
-          reason = "dup";
-          break;
-        }
-        len++;
+      score = mgos_wifi_sta_score(e->bssid, cfg_idx, e->rssi, e->channel, load,
+                                  eape);
+      for (int j = 0; j < s_ap_queue_len; j++) {
+        const struct wifi_ap_entry *ape = &s_aps[s_ap_queue[j]];
         /* Among bad ones, prefer those with fewer attempts.
          * This will have the effect of cycling through all available ones
          * even when there are more than the queue can hold. */
@@ -233,130 +1091,535 @@ static void mgos_wifi_sta_build_queue(int num_res,
             eape->num_attempts >= MGOS_WIFI_STA_AP_ATTEMPTS &&
             eape->num_attempts != ape->num_attempts) {
           if (eape->num_attempts > ape->num_attempts) {
-            pape = ape;
+            pos = j + 1;
           }
           continue;
         }
-        /* Stronger signal APs stay at the front of the queue. */
-        if (ape->rssi >= e->rssi) {
-          pape = ape;
+        /* Higher scoring APs stay at the front of the queue. */
+        if (ape->score >= score) {
+          pos = j + 1;
         }
       }
+      if (pos >= MGOS_WIFI_STA_MAX_AP_QUEUE_LEN) {
+        ok = false;
+        reason = "queue full";
+      }
     }
     if (ok) {
+      if (s_ap_queue_len == MGOS_WIFI_STA_MAX_AP_QUEUE_LEN) {
+        // If evicted entry has been tried before or is the one we are on
+        // (queued by a roaming scan), put it back on the history list.
+        // If it's a completely new AP that didn't make it, just drop it
+        // on the floor, we'll find it again next time.
+        struct wifi_ap_entry *ape = &s_aps[s_ap_queue[--s_ap_queue_len]];
+        if (ape->num_attempts > 0 || ape == s_cur_entry) {
+          mgos_wifi_sta_add_history_entry(ape);
+        } else {
+          mgos_wifi_sta_free_entry(ape);
+        }
+      }
+      // Eviction above may have pushed this AP out of history.
+      eape = mgos_wifi_sta_find_entry(e->bssid);
       if (eape == NULL) {
-        eape = calloc(1, sizeof(*eape));
-        memcpy(eape->bssid, e->bssid, sizeof(eape->bssid));
+        eape = mgos_wifi_sta_alloc_entry(e->bssid);
       } else {
         mgos_wifi_sta_remove_history_entry(eape);
       }
       if (eape == NULL) return;
-      eape->cfg = cfg;
+      eape->cfg_idx = cfg_idx;
+      eape->auth_mode = e->auth_mode;
       eape->rssi = e->rssi;
-      if (pape != NULL) {
-        SLIST_INSERT_AFTER(pape, eape, next);
-      } else {
-        SLIST_INSERT_HEAD(&s_ap_queue, eape, next);
-      }
-      len++;
-      while (len > MGOS_WIFI_STA_MAX_AP_QUEUE_LEN) {
-        len = 0;
-        pape = NULL;
-        struct wifi_ap_entry *ape = NULL;
-        SLIST_FOREACH(ape, &s_ap_queue, next) {
-          if (SLIST_NEXT(ape, next) == NULL) {
-            if (pape != NULL) {
-              SLIST_REMOVE_AFTER(pape, next);
-            } else {
-              SLIST_REMOVE_HEAD(&s_ap_queue, next);
-            }
-            // If evicted entry has been tried before, put it back on the
-            // history list. If it's a completely new AP that didn't make it,
-            // just drop it on the floor, we'll find it again next time.
-            if (ape->num_attempts > 0) {
-              mgos_wifi_sta_add_history_entry(ape);
-            } else {
-              free(ape);
-              if (eape == ape) eape = NULL;
-            }
-            break;
-          }
-          pape = ape;
-          len++;
-        }
-      }
+      eape->channel = e->channel;
+      eape->ch_load = load;
+      eape->score = score;
+      mgos_wifi_sta_queue_insert(eape, pos);
     }
     LOG(LL_DEBUG,
         ("  %d: SSID: %-32s, BSSID: %02x:%02x:%02x:%02x:%02x:%02x "
-         "auth: %d, ch: %3d, RSSI: %2d att %d - %d %s",
+         "auth: %d, ch: %3d, RSSI: %2d att %d score %d - %d %s",
          i, e->ssid, e->bssid[0], e->bssid[1], e->bssid[2], e->bssid[3],
          e->bssid[4], e->bssid[5], e->auth_mode, e->channel, e->rssi,
-         (eape ? eape->num_attempts : -1), ok, reason));
+         (eape ? eape->num_attempts : -1), score, ok, reason));
     (void) reason;
   }
 }
 
-void mgos_wifi_sta_scan_cb(int num_res, struct mgos_wifi_scan_result *res,
-                           void *arg) {
+// Cuts the scan short once there's an AP we'd be happy with. The final
+// results still go through the usual ranking, this one will be among them.
+static bool mgos_wifi_sta_scan_partial_cb(
+    int num_res, const struct mgos_wifi_scan_result *res, void *arg) {
+  int rssi_thr = mgos_sys_config_get_wifi_sta_rssi_thr();
+  int stop_score = mgos_sys_config_get_wifi_sta_scan_stop_score();
+  if (s_state != WIFI_STA_SCANNING || stop_score == 0) return false;
+  for (int i = 0; i < num_res; i++) {
+    const struct mgos_wifi_scan_result *e = &res[i];
+    int cfg_idx = -1, load = 0;
+    const char *reason = NULL;
+    struct wifi_ap_entry *eape = mgos_wifi_sta_find_entry(e->bssid);
+    const struct wifi_ap_entry *hape =
+        (eape != NULL && eape->state == WIFI_AP_HISTORY ? eape : NULL);
+    if (!check_ap(e, rssi_thr, &cfg_idx, hape, &reason) ||
+        mgos_wifi_sta_ap_in_backoff(hape)) {
+      continue;
+    }
+    // Partial results cover whole channels.
+    for (int j = 0; j < num_res; j++) {
+      if (res[j].channel == e->channel) load++;
+    }
+    int score = mgos_wifi_sta_score(e->bssid, cfg_idx, e->rssi, e->channel,
+                                    load, eape);
+    if (score >= stop_score) {
+      char bssid_s[20];
+      LOG(LL_DEBUG, ("%s (ch %d, score %d) is good enough, stopping scan",
+                     mgos_wifi_sta_bssid_to_str(e->bssid, bssid_s),
+                     e->channel, score));
+      return true;
+    }
+  }
+  (void) arg;
+  return false;
+}
+
+static void mgos_wifi_sta_process_scan(int num_res,
+                                       struct mgos_wifi_scan_result *res) {
   if (s_state != WIFI_STA_SCANNING) return;
   LOG(LL_DEBUG, ("WiFi scan result: %d entries", num_res));
   if (num_res < 0) {
     s_state = WIFI_STA_SCAN;
     return;
   }
-  mgos_wifi_sta_build_queue(num_res, res, true /* check_history */);
-  if (SLIST_EMPTY(&s_ap_queue)) {
+  if (s_directed_scan) {
+    // If this does not work out, widen the search.
+    s_full_scan = true;
+  }
+  uint8_t ch_load[WIFI_STA_CH_SLOTS];
+  memset(ch_load, 0, sizeof(ch_load));
+  for (int i = 0; i < num_res; i++) {
+    int slot = mgos_wifi_sta_ch_slot(res[i].channel);
+    if (slot > 0 && ch_load[slot] < UINT8_MAX) ch_load[slot]++;
+  }
+  mgos_wifi_sta_build_queue(num_res, res, ch_load, true /* check_history */);
+  if (s_ap_queue_len == 0) {
     /* No good quality APs left to try, keep trying bad ones. */
     LOG(LL_DEBUG, ("Second pass"));
-    mgos_wifi_sta_build_queue(num_res, res, false /* check_history */);
+    mgos_wifi_sta_build_queue(num_res, res, ch_load,
+                              false /* check_history */);
+  }
+  if (s_ap_queue_len == 0 && s_directed_scan) {
+    LOG(LL_DEBUG, ("Nothing on known channels, scanning all"));
+    s_state = WIFI_STA_SCAN;
+    set_timeout(true /* run_now */);
+    return;
   }
-  if (!SLIST_EMPTY(&s_ap_queue)) {
-    int i = 0;
-    struct wifi_ap_entry *ape = NULL;
+  if (s_ap_queue_len > 0) {
     LOG(LL_DEBUG, ("AP queue:"));
-    SLIST_FOREACH(ape, &s_ap_queue, next) {
+    for (int i = 0; i < s_ap_queue_len; i++) {
+      const struct wifi_ap_entry *ape = &s_aps[s_ap_queue[i]];
       const uint8_t *bssid = &ape->bssid[0];
-      LOG(LL_DEBUG, ("  %d: %02x:%02x:%02x:%02x:%02x:%02x %d %d", i, bssid[0],
-                     bssid[1], bssid[2], bssid[3], bssid[4], bssid[5],
-                     ape->rssi, ape->num_attempts));
-      i++;
+      LOG(LL_DEBUG, ("  %d: %02x:%02x:%02x:%02x:%02x:%02x %d %d %d", i,
+                     bssid[0], bssid[1], bssid[2], bssid[3], bssid[4],
+                     bssid[5], ape->rssi, ape->num_attempts, ape->score));
     }
   }
   s_state = WIFI_STA_CONNECT;
   set_timeout(true /* run_now */);
+}
+
+void mgos_wifi_sta_scan_cb(int num_res, struct mgos_wifi_scan_result *res,
+                           void *arg) {
+  mgos_wifi_sta_db_fetch(num_res, res);
+  wifi_lock();
+  mgos_wifi_sta_process_scan(num_res, res);
+  wifi_unlock();
   (void) arg;
 }
 
 static void mgos_wifi_sta_empty_queue(void) {
-  while (!SLIST_EMPTY(&s_ap_queue)) {
-    struct wifi_ap_entry *ape = SLIST_FIRST(&s_ap_queue);
-    SLIST_REMOVE_HEAD(&s_ap_queue, next);
+  struct wifi_ap_entry *ape;
+  while ((ape = mgos_wifi_sta_queue_pop()) != NULL) {
     mgos_wifi_sta_add_history_entry(ape);
   }
 }
 
+static void mgos_wifi_sta_load_last_ap(void) {
+  if (s_last_ap.loaded) return;
+  s_last_ap.loaded = true;
+  char *data = json_fread(MGOS_WIFI_STA_LAST_AP_FILE);
+  if (data == NULL) return;
+  char *ssid = NULL, *bssid_s = NULL;
+  int channel = 0, cfg_idx = -1, auth_mode = WIFI_AUTH_MODE_UNKNOWN;
+  json_scanf(data, strlen(data),
+             "{ssid: %Q, bssid: %Q, channel: %d, cfg: %d, auth: %d}", &ssid,
+             &bssid_s, &channel, &cfg_idx, &auth_mode);
+  if (ssid != NULL && strlen(ssid) < sizeof(s_last_ap.ssid) &&
+      mgos_wifi_sta_str_to_bssid(bssid_s, s_last_ap.bssid) && cfg_idx >= 0) {
+    strcpy(s_last_ap.ssid, ssid);
+    s_last_ap.channel = channel;
+    s_last_ap.cfg_idx = cfg_idx;
+    s_last_ap.auth_mode = auth_mode;
+  }
+  free(ssid);
+  free(bssid_s);
+  free(data);
+}
+
+static void mgos_wifi_sta_save_last_ap(const struct wifi_ap_entry *ape) {
+  int cfg_idx = ape->cfg_idx;
+  const char *ssid = ap_cfg(ape)->ssid;
+  if (strlen(ssid) >= sizeof(s_last_ap.ssid)) return;
+  mgos_wifi_sta_load_last_ap();
+  // Spare the flash if nothing has changed.
+  if (s_last_ap.cfg_idx == cfg_idx && s_last_ap.channel == ape->channel &&
+      s_last_ap.auth_mode == ape->auth_mode &&
+      memcmp(s_last_ap.bssid, ape->bssid, sizeof(ape->bssid)) == 0 &&
+      strcmp(s_last_ap.ssid, ssid) == 0) {
+    return;
+  }
+  s_last_ap.cfg_idx = cfg_idx;
+  s_last_ap.channel = ape->channel;
+  s_last_ap.auth_mode = ape->auth_mode;
+  memcpy(s_last_ap.bssid, ape->bssid, sizeof(ape->bssid));
+  strcpy(s_last_ap.ssid, ssid);
+  char bssid_s[20];
+  if (json_fprintf(MGOS_WIFI_STA_LAST_AP_FILE,
+                   "{ssid: %Q, bssid: %Q, channel: %d, cfg: %d, auth: %d}",
+                   s_last_ap.ssid,
+                   mgos_wifi_sta_bssid_to_str(s_last_ap.bssid, bssid_s),
+                   s_last_ap.channel, s_last_ap.cfg_idx,
+                   s_last_ap.auth_mode) < 0) {
+    LOG(LL_ERROR, ("Failed to save %s", MGOS_WIFI_STA_LAST_AP_FILE));
+  }
+}
+
+/*
+ * Prepares parameters for a scan limited to the channels where APs of
+ * the configured networks have been seen before. Returns false if nothing
+ * is known and a full scan should be performed.
+ */
+static bool mgos_wifi_sta_get_directed_scan_params(
+    struct mgos_wifi_scan_params *params, uint8_t *channels, int max_channels) {
+  int n = 0;
+  mgos_wifi_sta_load_last_ap();
+  if (s_last_ap.channel > 0) channels[n++] = s_last_ap.channel;
+  for (uint16_t i = s_ap_hist_head; i != WIFI_AP_NONE; i = s_aps[i].next) {
+    const struct wifi_ap_entry *ape = &s_aps[i];
+    if (ape->channel == 0 || mgos_wifi_sta_ap_is_failing(ape)) continue;
+    if (memchr(channels, ape->channel, n) != NULL) continue;
+    if (n == max_channels) return false;
+    channels[n++] = ape->channel;
+  }
+  if (n == 0) return false;
+  // Not filtering by SSID: it would not save any air time, and other
+  // networks' APs are needed to estimate channel load.
+  params->channels = channels;
+  params->num_channels = n;
+  return true;
+}
+
+/*
+ * Returns an AP that can be tried without scanning: either the one pinned
+ * in config (both bssid and channel are set) or the last one we were
+ * connected to.
+ */
+static struct wifi_ap_entry *mgos_wifi_sta_get_fast_connect_entry(void) {
+  uint8_t bssid[6];
+  int channel = 0, cfg_idx = -1, auth_mode = WIFI_AUTH_MODE_UNKNOWN;
+  for (int i = 0; i < s_num_cfgs; i++) {
+    const struct mgos_config_wifi_sta *c = s_cfgs[i];
+    if (c->enable && c->channel > 0 &&
+        mgos_wifi_sta_str_to_bssid(c->bssid, bssid)) {
+      cfg_idx = i;
+      channel = c->channel;
+      break;
+    }
+  }
+  if (cfg_idx < 0 && mgos_sys_config_get_wifi_sta_fast_connect()) {
+    mgos_wifi_sta_load_last_ap();
+    int i = s_last_ap.cfg_idx;
+    if (i < 0 || i >= s_num_cfgs ||
+        strcmp(s_cfgs[i]->ssid, s_last_ap.ssid) != 0) {
+      // Index is from a previous boot, network may be from the database.
+      i = mgos_wifi_sta_db_cfg_idx(s_last_ap.ssid);
+    }
+    if (i >= 0 && i < s_num_cfgs && s_cfgs[i]->enable &&
+        strcmp(s_cfgs[i]->ssid, s_last_ap.ssid) == 0) {
+      cfg_idx = i;
+      channel = s_last_ap.channel;
+      auth_mode = s_last_ap.auth_mode;
+      memcpy(bssid, s_last_ap.bssid, sizeof(bssid));
+    }
+  }
+  if (cfg_idx < 0) return NULL;
+  // Queue is empty at this point, so the AP can only be on the history list.
+  struct wifi_ap_entry *ape = mgos_wifi_sta_find_entry(bssid);
+  if (ape != NULL) {
+    // Known to be failing, let the scan find something better.
+    if (mgos_wifi_sta_ap_is_failing(ape)) return NULL;
+    mgos_wifi_sta_remove_history_entry(ape);
+  } else {
+    ape = mgos_wifi_sta_alloc_entry(bssid);
+    if (ape == NULL) return NULL;
+  }
+  ape->cfg_idx = cfg_idx;
+  ape->channel = channel;
+  ape->auth_mode = auth_mode;
+  return ape;
+}
+
+// Seconds until average RSSI reaches the roaming threshold if the current
+// trend continues, -1 if it is not heading there or there is too little data
+// to tell.
+static float mgos_wifi_sta_roam_eta(const struct mgos_wifi_sta_rssi_stats *rs) {
+  int thr = mgos_sys_config_get_wifi_sta_roam_rssi_thr();
+  int predict_s = mgos_sys_config_get_wifi_sta_roam_predict_s();
+  if (rs->mean < thr) return 0;
+  if (rs->trend >= 0 || rs->num_samples < WIFI_STA_ROAM_PREDICT_MIN_SAMPLES) {
+    return -1;
+  }
+  // Over the prediction horizon, decline should stand out from the noise.
+  if (-rs->trend * predict_s < 2 * sqrtf(rs->variance)) return -1;
+  return (rs->mean - thr) / -rs->trend;
+}
+
+// Threshold is about to be crossed, take any candidate that will be better
+// than the current AP by then.
+static bool mgos_wifi_sta_roam_commit(float eta) {
+  int commit_s = mgos_sys_config_get_wifi_sta_roam_commit_s();
+  return (eta > 0 && eta < commit_s);
+}
+
+// Roaming parameters go to the chip before connecting, if it can take them.
+static void mgos_wifi_sta_setup_roam_offload(void) {
+  struct mgos_wifi_roam_offload_params p = {
+      .enable = (mgos_sys_config_get_wifi_sta_roam_offload() &&
+                 mgos_sys_config_get_wifi_sta_roam_rssi_thr() < 0 &&
+                 mgos_sys_config_get_wifi_sta_roam_interval() > 0),
+      .rssi_thr = mgos_sys_config_get_wifi_sta_roam_rssi_thr(),
+      .hyst_db = mgos_sys_config_get_wifi_sta_roam_offload_hyst_db(),
+      .scan_interval_s = mgos_sys_config_get_wifi_sta_roam_interval(),
+  };
+  if (!mgos_wifi_has_cap(MGOS_WIFI_CAP_ROAM_OFFLOAD)) return;
+  s_roam_offload = (mgos_wifi_dev_sta_set_roam_offload(&p) && p.enable);
+}
+
+// Starts association with the AP, or roaming to it if `roam` is set.
+// Returns false if roaming is not possible.
+static bool mgos_wifi_sta_try_ap(struct wifi_ap_entry *ape, bool roam) {
+  uint8_t *bssid = &ape->bssid[0];
+  char bssid_s[20];
+  mgos_wifi_sta_bssid_to_str(bssid, bssid_s);
+  struct mgos_config_wifi_sta sta_cfg = *ap_cfg(ape);
+  sta_cfg.bssid = bssid_s;
+  sta_cfg.channel = ape->channel;
+  char pmk_hex[65];
+  if (mgos_wifi_sta_use_pmk(ape)) {
+    const uint8_t *pmk = s_cfg_descs[ape->cfg_idx].pmk;
+    for (int i = 0; i < 32; i++) {
+      snprintf(pmk_hex + i * 2, 3, "%02x", pmk[i]);
+    }
+    sta_cfg.pass = pmk_hex;
+  }
+  if (roam) {
+    if (!mgos_wifi_has_cap(MGOS_WIFI_CAP_ROAM) ||
+        !mgos_wifi_dev_sta_roam(&sta_cfg)) {
+      return false;
+    }
+  } else {
+    mgos_wifi_sta_setup_roam_offload();
+    mgos_wifi_dev_sta_setup(&sta_cfg);
+    mgos_wifi_dev_sta_connect();
+  }
+  ape->num_attempts++;
+  if (ape->num_attempts >= 200) {
+    /* Prevent overflow by scaling down the numbers. */
+    for (int i = 0; i < s_aps_used; i++) {
+      s_aps[i].num_attempts /= 2;
+    }
+  }
+  LOG(LL_INFO,
+      ("Trying %s AP %02x:%02x:%02x:%02x:%02x:%02x ch %d RSSI %d "
+       "attempt %d%s",
+       ap_cfg(ape)->ssid, bssid[0], bssid[1], bssid[2], bssid[3], bssid[4],
+       bssid[5], ape->channel, ape->rssi, ape->num_attempts,
+       (roam ? " (roam)" : s_fast_connect ? " (fast)" : "")));
+  ape->last_attempt = mgos_wifi_sta_uptime_s();
+  s_attempt_start = mgos_uptime_micros();
+  mgos_wifi_stats_sta_attempt();
+  return true;
+}
+
+static enum mgos_wifi_disconnect_reason mgos_wifi_sta_ev_reason(
+    int wifi_ev, void *ev_data) {
+  const struct mgos_wifi_sta_disconnected_arg *ea =
+      (const struct mgos_wifi_sta_disconnected_arg *) ev_data;
+  if (wifi_ev != MGOS_WIFI_EV_STA_DISCONNECTED || ea == NULL) {
+    return MGOS_WIFI_DISCONNECT_REASON_UNSPECIFIED;
+  }
+  return ea->reason;
+}
+
+// Accounts for a failed attempt, returns the reason.
+static enum mgos_wifi_disconnect_reason mgos_wifi_sta_attempt_failed(
+    int wifi_ev, void *ev_data) {
+  enum mgos_wifi_disconnect_reason reason =
+      mgos_wifi_sta_ev_reason(wifi_ev, ev_data);
+  mgos_wifi_stats_sta_attempt_failed(
+      (wifi_ev != MGOS_WIFI_EV_STA_DISCONNECTED), reason);
+  return reason;
+}
+
+// Adjusts retry policy for the AP according to why the attempt failed.
+static void mgos_wifi_sta_ap_failed(struct wifi_ap_entry *ape,
+                                    enum mgos_wifi_disconnect_reason reason) {
+  switch (reason) {
+    case MGOS_WIFI_DISCONNECT_REASON_AUTH_FAIL:
+      // Key is wrong, retrying will not help.
+      if (ape->num_attempts < MGOS_WIFI_STA_AP_ATTEMPTS) {
+        ape->num_attempts = MGOS_WIFI_STA_AP_ATTEMPTS;
+      }
+      ape->backoff = WIFI_STA_AP_MAX_BACKOFF_SECONDS;
+      break;
+    case MGOS_WIFI_DISCONNECT_REASON_HANDSHAKE_TIMEOUT:
+      // May be the key, may be the link. If this AP has never let us in,
+      // move on to others but keep it as a last resort, otherwise it is an
+      // ordinary failed attempt.
+      if (ape->num_ok == 0 && ape->num_attempts < MGOS_WIFI_STA_AP_ATTEMPTS) {
+        ape->num_attempts = MGOS_WIFI_STA_AP_ATTEMPTS;
+      }
+      break;
+    case MGOS_WIFI_DISCONNECT_REASON_AP_FULL:
+      // Give it time to free up, more each time.
+      if (ape->backoff == 0) {
+        ape->backoff = MGOS_WIFI_STA_AP_FULL_BACKOFF_SECONDS;
+      } else if (ape->backoff < WIFI_STA_AP_MAX_BACKOFF_SECONDS / 2) {
+        ape->backoff *= 2;
+      } else {
+        ape->backoff = WIFI_STA_AP_MAX_BACKOFF_SECONDS;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// Chip has moved to another AP by itself, follow it.
+static void mgos_wifi_sta_roamed(const struct mgos_wifi_sta_roamed_arg *ea) {
+  char bssid_s[20];
+  if (s_cur_entry == NULL || ea == NULL) return;
+  struct wifi_ap_entry *ape = mgos_wifi_sta_find_entry(ea->bssid);
+  if (ape == NULL) {
+    ape = mgos_wifi_sta_alloc_entry(ea->bssid);
+    if (ape == NULL) return;
+    ape->cfg_idx = s_cur_entry->cfg_idx;
+    ape->auth_mode = s_cur_entry->auth_mode;
+  } else if (ape->state == WIFI_AP_HISTORY) {
+    mgos_wifi_sta_remove_history_entry(ape);
+  } else if (ape->state == WIFI_AP_QUEUED) {
+    // A candidate from our last scan, we are on it now.
+    mgos_wifi_sta_queue_remove(ape);
+  }
+  if (ea->channel > 0) ape->channel = ea->channel;
+  ape->rssi = ea->rssi;
+  ape->num_attempts = 0;
+  ape->backoff = 0;
+  mgos_wifi_sta_count(&ape->num_ok, &ape->num_fail);
+  mgos_wifi_sta_add_history_entry(ape);
+  s_cur_entry = ape;
+  s_link_up = mgos_uptime_micros();
+  mgos_wifi_stats_sta_roam();
+  mgos_wifi_sta_save_last_ap(ape);
+  mgos_wifi_sta_rssi_reset();
+  mgos_wifi_sta_rssi_add_sample(ea->rssi);
+  LOG(LL_INFO, ("Following the chip to %s ch %d",
+                mgos_wifi_sta_bssid_to_str(ape->bssid, bssid_s),
+                ape->channel));
+}
+
 static void mgos_wifi_sta_run(int wifi_ev, void *ev_data, bool timeout) {
   LOG(LL_DEBUG, ("State %d ev %d timeout %d", s_state, wifi_ev, timeout));
+  if (wifi_ev == MGOS_WIFI_EV_STA_DISCONNECTED && s_roam_switch &&
+      mgos_wifi_sta_ev_reason(wifi_ev, ev_data) ==
+          MGOS_WIFI_DISCONNECT_REASON_ROAM) {
+    // Port left the current AP on its way to the new one, the outcome of the
+    // switch is yet to come.
+    mgos_wifi_stats_sta_disconnected(MGOS_WIFI_DISCONNECT_REASON_ROAM);
+    return;
+  }
   if (wifi_ev == MGOS_WIFI_EV_STA_DISCONNECTED) {
-    s_roaming = false;
+    // Failed attempts are accounted for below.
+    if (s_cur_entry != NULL && s_state != WIFI_STA_CONNECTING &&
+        s_state != WIFI_STA_CONNECTED) {
+      mgos_wifi_stats_sta_disconnected(
+          mgos_wifi_sta_ev_reason(wifi_ev, ev_data));
+    }
+    s_roaming = s_roam_switch = false;
     s_cur_entry = NULL;
   }
   switch (s_state) {
     case WIFI_STA_IDLE:
       break;
-    case WIFI_STA_INIT:
+    case WIFI_STA_INIT: {
+      // Connection may be started before mgos_wifi_sta_init().
+      mgos_wifi_sta_load_history();
+      mgos_wifi_stats_sta_start();
       mgos_wifi_dev_sta_disconnect();
-      s_state = WIFI_STA_SCAN;
-      set_timeout(true /* run_now */);
-      s_roaming = false;
+      if (s_rssi_thr_armed) {
+        mgos_wifi_dev_sta_set_rssi_thr(0);
+        s_rssi_thr_armed = false;
+      }
+      s_roaming = s_roam_switch = false;
       s_cur_entry = NULL;
+      s_full_scan = false;
+      mgos_wifi_sta_empty_queue();
+      struct wifi_ap_entry *ape = mgos_wifi_sta_get_fast_connect_entry();
+      if (ape != NULL) {
+        // Skip the scan and go straight to the AP we know. If that fails,
+        // the queue will be empty and we'll fall back to scanning.
+        mgos_wifi_sta_queue_insert(ape, 0);
+        s_fast_connect = true;
+        s_state = WIFI_STA_CONNECT;
+      } else {
+        s_fast_connect = false;
+        s_state = WIFI_STA_SCAN;
+      }
+      set_timeout(true /* run_now */);
       break;
-    case WIFI_STA_SCAN:
-      LOG(LL_DEBUG, ("Starting scan"));
+    }
+    case WIFI_STA_SCAN: {
+      struct mgos_wifi_scan_params params;
+      uint8_t channels[16];
+      int max_channels = mgos_wifi_get_max_scan_channels();
+      if (max_channels <= 0 || max_channels > (int) sizeof(channels)) {
+        max_channels = (int) sizeof(channels);
+      }
+      memset(&params, 0, sizeof(params));
+      params.dwell_ms = mgos_sys_config_get_wifi_sta_scan_dwell_ms();
+      if (s_roaming && mgos_sys_config_get_wifi_sta_roam_scan_dwell_ms() > 0) {
+        // Keep off-channel time short, we are still passing traffic.
+        params.dwell_ms = mgos_sys_config_get_wifi_sta_roam_scan_dwell_ms();
+      }
+      // When roaming we want the best AP, not just a good one.
+      if (!s_roaming && mgos_wifi_has_cap(MGOS_WIFI_CAP_SCAN_PARTIAL)) {
+        params.partial_cb = mgos_wifi_sta_scan_partial_cb;
+      }
       mgos_wifi_sta_empty_queue();
+      s_directed_scan = false;
+      // A port that scans all channels anyway would make it a full scan.
+      if (!s_roaming && !s_full_scan &&
+          mgos_sys_config_get_wifi_sta_directed_scan() &&
+          mgos_wifi_has_cap(MGOS_WIFI_CAP_SCAN_CHANNELS)) {
+        s_directed_scan = mgos_wifi_sta_get_directed_scan_params(
+            &params, channels, max_channels);
+      }
+      LOG(LL_DEBUG, ("Starting %s scan, %d channels",
+                     (s_directed_scan ? "directed" : "full"),
+                     params.num_channels));
       s_state = WIFI_STA_SCANNING;
-      mgos_wifi_scan(mgos_wifi_sta_scan_cb, NULL);
+      // May have come here from a backoff timer, make sure there's a deadline.
+      set_timeout(false /* run_now */);
+      mgos_wifi_scan_ex(&params, mgos_wifi_sta_scan_cb, NULL);
       break;
+    }
     case WIFI_STA_SCANNING:
       if (timeout) {
         s_state = WIFI_STA_SCAN;
@@ -365,18 +1628,41 @@ static void mgos_wifi_sta_run(int wifi_ev, void *ev_data, bool timeout) {
       break;
     case WIFI_STA_WAIT_CONNECT:
       if (!timeout) {
-        set_timeout_n(1000, false /* run_now */);
+        set_timeout_n(mgos_wifi_sta_jitter_ms(1000), false /* run_now */);
         break;
       }
       s_state = WIFI_STA_CONNECT;
       set_timeout_n(1000, true /* run_now */);
       break;
     case WIFI_STA_CONNECT: {
-      struct wifi_ap_entry *ape = SLIST_FIRST(&s_ap_queue);
+      struct wifi_ap_entry *ape = mgos_wifi_sta_queue_head();
       if (s_roaming) {
         s_roaming = false;
         /* If we are roaming and have no good candidate, go back. */
-        int cur_rssi = mgos_wifi_sta_get_rssi();
+        struct mgos_wifi_sta_rssi_stats rs;
+        bool commit = false;
+        int cur_rssi = mgos_wifi_sta_get_rssi_cached(
+            mgos_sys_config_get_wifi_sta_rssi_max_age_ms());
+        if (mgos_wifi_sta_get_rssi_stats(&rs)) {
+          cur_rssi = (int) rs.mean;
+          commit = mgos_wifi_sta_roam_commit(mgos_wifi_sta_roam_eta(&rs));
+          if (commit) {
+            // Compare with where the current AP is going to be.
+            int commit_s = mgos_sys_config_get_wifi_sta_roam_commit_s();
+            cur_rssi = (int) (rs.mean + rs.trend * commit_s);
+          }
+        }
+        if (commit && ape != NULL && ape == s_cur_entry) {
+          // Candidates were ranked when the current AP looked better.
+          mgos_wifi_sta_add_history_entry(mgos_wifi_sta_queue_pop());
+          ape = mgos_wifi_sta_queue_head();
+        }
+        int cur_score = INT16_MIN;
+        if (s_cur_entry != NULL) {
+          cur_score = mgos_wifi_sta_score(
+              s_cur_entry->bssid, s_cur_entry->cfg_idx, cur_rssi,
+              s_cur_entry->channel, s_cur_entry->ch_load, s_cur_entry);
+        }
         bool ok = false;
         if (ape == NULL) {
           LOG(LL_DEBUG, ("No alternative APs found"));
@@ -384,22 +1670,41 @@ static void mgos_wifi_sta_run(int wifi_ev, void *ev_data, bool timeout) {
                                                  sizeof(ape->bssid)) == 0) {
           LOG(LL_DEBUG, ("Current AP is best AP"));
         } else if (ape->rssi <= mgos_sys_config_get_wifi_sta_roam_rssi_thr() ||
-                   (ape->rssi - MGOS_WIFI_STA_ROAM_RSSI_HYST) < cur_rssi) {
-          LOG(LL_DEBUG, ("Best AP is not good enough (RSSI %d vs %d)",
-                         ape->rssi, cur_rssi));
+                   (ape->score -
+                        mgos_sys_config_get_wifi_sta_score_roam_hyst() <
+                    cur_score)) {
+          LOG(LL_DEBUG,
+              ("Best AP is not good enough (RSSI %d vs %d, score %d vs %d)",
+               ape->rssi, cur_rssi, ape->score, cur_score));
         } else {
           ok = true;
         }
         if (!ok) {
+          // Keep the candidates for a later commit, unless this was it.
+          if (commit) mgos_wifi_sta_empty_queue();
           s_state = WIFI_STA_IP_ACQUIRED;
-          set_timeout(true /* run_now */);
+          clear_timeout();
           break;
         }
-        /* We have a better AP candidate, disconnect and try to roam. */
+        /* We have a better AP candidate, try to roam. */
         char bssid_s[20];
-        LOG(LL_INFO, ("Trying to switch to %s (RSSI %d -> %d)",
+        mgos_wifi_stats_sta_roam();
+        LOG(LL_INFO, ("Trying to switch to %s (RSSI %d -> %d, score %d -> %d)",
                       mgos_wifi_sta_bssid_to_str(ape->bssid, bssid_s), cur_rssi,
-                      ape->rssi));
+                      ape->rssi, cur_score, ape->score));
+        if (mgos_sys_config_get_wifi_sta_roam_mbb() &&
+            mgos_wifi_sta_try_ap(ape, true /* roam */)) {
+          /*
+           * Depending on the port, the current link stays up until the new
+           * one is established or is dropped first, see
+           * mgos_wifi_dev_sta_roam().
+           */
+          s_roam_switch = true;
+          s_state = WIFI_STA_CONNECTING;
+          set_timeout(true /* run_now */);
+          break;
+        }
+        /* Not supported, disconnect and connect as usual. */
         mgos_wifi_dev_sta_disconnect();
         /* We need to allow some time for connection to terminate. */
         s_cur_entry = NULL;
@@ -408,73 +1713,108 @@ static void mgos_wifi_sta_run(int wifi_ev, void *ev_data, bool timeout) {
         break;
       }
       if (ape == NULL) {
-        LOG(LL_DEBUG, ("No more candidate APs"));
+        int delay_ms = mgos_wifi_sta_rescan_delay_ms();
+        s_num_futile_scans++;
         s_state = WIFI_STA_SCAN;
-        set_timeout(true /* run_now */);
-        break;
-      }
-      ape->num_attempts++;
-      if (ape->num_attempts >= 200) {
-        /* Prevent overflow by scaling down the numbers. */
-        struct wifi_ap_entry *ape2 = NULL;
-        SLIST_FOREACH(ape2, &s_ap_queue, next) {
-          ape2->num_attempts /= 2;
-        }
-        SLIST_FOREACH(ape2, &s_ap_history, next) {
-          ape2->num_attempts /= 2;
+        if (delay_ms > 0) {
+          LOG(LL_INFO, ("No usable APs, next scan in %d ms", delay_ms));
+          set_timeout_n(delay_ms, false /* run_now */);
+        } else {
+          LOG(LL_DEBUG, ("No more candidate APs"));
+          set_timeout(true /* run_now */);
         }
+        break;
       }
-      uint8_t *bssid = &ape->bssid[0];
-      LOG(LL_INFO,
-          ("Trying %s AP %02x:%02x:%02x:%02x:%02x:%02x RSSI %d attempt %d",
-           ape->cfg->ssid, bssid[0], bssid[1], bssid[2], bssid[3], bssid[4],
-           bssid[5], ape->rssi, ape->num_attempts));
-      ape->last_attempt = mgos_uptime_micros();
-      char bssid_s[20];
-      mgos_wifi_sta_bssid_to_str(bssid, bssid_s);
-      struct mgos_config_wifi_sta sta_cfg = *ape->cfg;
-      sta_cfg.bssid = bssid_s;
-      mgos_wifi_dev_sta_setup(&sta_cfg);
-      mgos_wifi_dev_sta_connect();
+      mgos_wifi_sta_try_ap(ape, false /* roam */);
       s_state = WIFI_STA_CONNECTING;
-      set_timeout(true /* run_now */);
+      if (s_fast_connect) {
+        set_timeout_n(
+            mgos_sys_config_get_wifi_sta_fast_connect_timeout() * 1000,
+            true /* run_now */);
+      } else {
+        set_timeout(true /* run_now */);
+      }
       break;
     }
     case WIFI_STA_CONNECTING: {
       if (wifi_ev == MGOS_WIFI_EV_STA_DISCONNECTED || timeout) {
         LOG(LL_INFO, ("Connect failed"));
+        enum mgos_wifi_disconnect_reason reason =
+            mgos_wifi_sta_attempt_failed(wifi_ev, ev_data);
+        s_fast_connect = false;
         // Remove the queue entry that failed.
-        struct wifi_ap_entry *ape = SLIST_FIRST(&s_ap_queue);
-        SLIST_REMOVE_HEAD(&s_ap_queue, next);
-        mgos_wifi_sta_add_history_entry(ape);
+        struct wifi_ap_entry *ape = mgos_wifi_sta_queue_pop();
+        if (ape != NULL) {
+          mgos_wifi_sta_count(&ape->num_fail, &ape->num_ok);
+          mgos_wifi_sta_ap_failed(ape, reason);
+          mgos_wifi_sta_add_history_entry(ape);
+        }
         // Stop connection attempts and let things settle before moving on.
         mgos_wifi_dev_sta_disconnect();
         s_cur_entry = NULL;
+        s_roam_switch = false;
         s_state = WIFI_STA_WAIT_CONNECT;
-        set_timeout_n(1000, false /* run_now */);
+        set_timeout_n(mgos_wifi_sta_jitter_ms(1000), false /* run_now */);
         break;
       }
       if (wifi_ev == MGOS_WIFI_EV_STA_CONNECTED) {
-        s_cur_entry = SLIST_FIRST(&s_ap_queue);
+        const struct mgos_wifi_sta_connected_arg *ea =
+            (const struct mgos_wifi_sta_connected_arg *) ev_data;
+        struct wifi_ap_entry *ape = mgos_wifi_sta_queue_head();
+        if (ape == NULL) break;
+        if (ea->channel > 0) ape->channel = ea->channel;
+        mgos_wifi_stats_sta_associated();
+        s_cur_entry = ape;
+        s_link_up = mgos_uptime_micros();
         s_state = WIFI_STA_CONNECTED;
+        if (s_fast_connect) {
+          // Fast connect budget only covers association, give DHCP the
+          // usual amount of time.
+          s_fast_connect = false;
+          set_timeout(false /* run_now */);
+        }
       }
       break;
     }
     case WIFI_STA_CONNECTED: {
       if (wifi_ev == MGOS_WIFI_EV_STA_IP_ACQUIRED) {
-        struct wifi_ap_entry *ape = SLIST_FIRST(&s_ap_queue);
+        struct wifi_ap_entry *ape = mgos_wifi_sta_queue_head();
+        if (ape == NULL) break;
         ape->num_attempts = 0;
+        ape->backoff = 0;
+        mgos_wifi_sta_count(&ape->num_ok, &ape->num_fail);
+        // Lease may be retained when roaming, that says nothing about the AP.
+        if (!s_roam_switch) {
+          int64_t tti_ms = (mgos_uptime_micros() - s_attempt_start) / 1000;
+          if (tti_ms > UINT16_MAX) tti_ms = UINT16_MAX;
+          ape->tti_ms =
+              (ape->tti_ms == 0 ? tti_ms : (ape->tti_ms * 3 + tti_ms) / 4);
+        }
+        s_roam_switch = false;
+        s_num_futile_scans = 0;
+        mgos_wifi_stats_sta_ip_acquired();
+        struct mgos_net_ip_info ip_info;
+        memset(&ip_info, 0, sizeof(ip_info));
+        mgos_wifi_dev_get_ip_info(MGOS_NET_IF_WIFI_STA, &ip_info);
+        s_sta_ip = ip_info.ip;
+        mgos_wifi_sta_save_last_ap(ape);
         mgos_wifi_sta_empty_queue();
         s_state = WIFI_STA_IP_ACQUIRED;
-        int8_t cur_rssi = (int8_t) mgos_wifi_sta_get_rssi();
-        for (int i = 0; i < (int) ARRAY_SIZE(s_rssi_info.samples); i++) {
-          s_rssi_info.samples[i] = cur_rssi;
-        }
+        // Nothing to time out while connected, we'll be told if that changes.
+        clear_timeout();
+        mgos_wifi_sta_rssi_reset();
+        mgos_wifi_sta_rssi_add_sample(mgos_wifi_sta_get_rssi_cached(
+            mgos_sys_config_get_wifi_sta_rssi_max_age_ms()));
+        s_rssi_low = true;
+        s_rssi_thr_armed = false;
+        mgos_wifi_sta_rssi_watch();
         break;
       }
-      int cur_rssi = mgos_wifi_sta_get_rssi();
+      int cur_rssi = mgos_wifi_sta_get_rssi_cached(
+          mgos_sys_config_get_wifi_sta_rssi_max_age_ms());
       if (timeout || wifi_ev == MGOS_WIFI_EV_STA_DISCONNECTED ||
           cur_rssi == 0) {
+        mgos_wifi_sta_attempt_failed(wifi_ev, ev_data);
         s_state = WIFI_STA_INIT;
         set_timeout_n(1000, false /* run_now */);
         break;
@@ -482,37 +1822,142 @@ static void mgos_wifi_sta_run(int wifi_ev, void *ev_data, bool timeout) {
       break;
     }
     case WIFI_STA_IP_ACQUIRED: {
-      int cur_rssi = mgos_wifi_sta_get_rssi();
-      if (wifi_ev == MGOS_WIFI_EV_STA_DISCONNECTED || cur_rssi == 0) {
+      if (wifi_ev == MGOS_WIFI_EV_STA_DISCONNECTED) {
         s_state = WIFI_STA_INIT;
-        set_timeout_n(1000, false /* run_now */);
-        break;
-      }
-      int roam_rssi_thr = mgos_sys_config_get_wifi_sta_roam_rssi_thr();
-      int roam_intvl = mgos_sys_config_get_wifi_sta_roam_interval();
-      if (roam_rssi_thr < 0 && roam_intvl > 0) {
-        s_rssi_info.val <<= 8;
-        s_rssi_info.samples[0] = cur_rssi;
-        int sum = 0;
-        for (int i = 0; i < (int) ARRAY_SIZE(s_rssi_info.samples); i++) {
-          sum += s_rssi_info.samples[i];
+        int delay_ms = mgos_wifi_sta_reconnect_delay_ms();
+        if (mgos_wifi_sta_ev_reason(wifi_ev, ev_data) !=
+            MGOS_WIFI_DISCONNECT_REASON_BEACON_TIMEOUT) {
+          delay_ms += 1000;
         }
-        int avg_rssi = sum / (int) ARRAY_SIZE(s_rssi_info.samples);
-        int64_t now = mgos_uptime_micros();
-        if (avg_rssi < roam_rssi_thr &&
-            (now - s_last_roam_attempt > roam_intvl * 1000000)) {
-          LOG(LL_INFO,
-              ("Current RSSI %d, will scan for a better AP", cur_rssi));
-          s_roaming = true;
-          s_state = WIFI_STA_SCAN;
+        // Beacon loss is often a brief outage, try to get back quickly.
+        if (delay_ms > 0) {
+          set_timeout_n(delay_ms, false /* run_now */);
+        } else {
           set_timeout(true /* run_now */);
-          s_last_roam_attempt = mgos_uptime_micros();
         }
+        break;
       }
+      if (wifi_ev == MGOS_WIFI_EV_STA_RSSI_LOW) {
+        const struct mgos_wifi_sta_rssi_low_arg *ea =
+            (const struct mgos_wifi_sta_rssi_low_arg *) ev_data;
+        s_rssi_thr_armed = false;
+        s_rssi_low = true;
+        // What we had before the signal dropped is of no use for the trend.
+        mgos_wifi_sta_rssi_reset();
+        mgos_wifi_sta_rssi_add_sample(ea->rssi);
+        mgos_wifi_sta_rssi_watch();
+      }
+      if (wifi_ev == MGOS_WIFI_EV_STA_ROAMED) {
+        mgos_wifi_sta_roamed(
+            (const struct mgos_wifi_sta_roamed_arg *) ev_data);
+        mgos_wifi_sta_rssi_watch();
+      }
+      // Roaming is checked as RSSI samples come in.
+      break;
     }
     case WIFI_STA_SHUTDOWN:
       break;
   }
+  mgos_wifi_sta_publish();
+}
+
+static bool mgos_wifi_sta_roam_enabled(void) {
+  // Scanning must not drop the link we are trying to improve on.
+  return (!s_roam_offload && mgos_wifi_has_cap(MGOS_WIFI_CAP_BG_SCAN) &&
+          mgos_sys_config_get_wifi_sta_roam_rssi_thr() < 0 &&
+          mgos_sys_config_get_wifi_sta_roam_interval() > 0);
+}
+
+static void mgos_wifi_sta_check_roam(void) {
+  struct mgos_wifi_sta_rssi_stats rs;
+  int roam_rssi_thr = mgos_sys_config_get_wifi_sta_roam_rssi_thr();
+  int roam_intvl = mgos_sys_config_get_wifi_sta_roam_interval();
+  int predict_s = mgos_sys_config_get_wifi_sta_roam_predict_s();
+  if (!mgos_wifi_sta_roam_enabled()) return;
+  if (!mgos_wifi_sta_get_rssi_stats(&rs)) return;
+  int64_t now = mgos_uptime_micros();
+  int64_t since_last = now - s_last_roam_attempt;
+  float eta = mgos_wifi_sta_roam_eta(&rs);
+  if (rs.mean < roam_rssi_thr) {
+    if (since_last <= roam_intvl * 1000000LL) return;
+  } else if (mgos_wifi_sta_roam_commit(eta) &&
+             mgos_wifi_sta_queue_head() != NULL &&
+             since_last < predict_s * 1000000LL) {
+    // Candidates from the last scan are fresh enough, go straight to them.
+    LOG(LL_INFO, ("RSSI %d (avg %d, trend %d dB/min), threshold in %d s, "
+                  "switching",
+                  rs.last, (int) rs.mean, (int) (rs.trend * 60), (int) eta));
+    s_roaming = true;
+    s_state = WIFI_STA_CONNECT;
+    set_timeout(true /* run_now */);
+    return;
+  } else if (eta >= 0 && eta < predict_s) {
+    // Look again each time the projected time to threshold halves.
+    int commit_s = mgos_sys_config_get_wifi_sta_roam_commit_s();
+    if (since_last < eta * 1000000 / 2 || since_last < commit_s * 1000000LL) {
+      return;
+    }
+  } else {
+    return;
+  }
+  LOG(LL_INFO, ("Current RSSI %d (avg %d, trend %d dB/min), "
+                "will scan for a better AP",
+                rs.last, (int) rs.mean, (int) (rs.trend * 60)));
+  s_roaming = true;
+  s_last_roam_attempt = now;
+  s_state = WIFI_STA_SCAN;
+  set_timeout(true /* run_now */);
+}
+
+// RSSI is only needed for roaming. While signal is well above the threshold,
+// let the driver tell us when it drops instead of polling, if it can.
+static void mgos_wifi_sta_rssi_watch(void) {
+  bool poll = false;
+  if (s_cur_entry != NULL && mgos_wifi_sta_roam_enabled()) {
+    struct mgos_wifi_sta_rssi_stats rs;
+    int wake_thr = mgos_sys_config_get_wifi_sta_roam_rssi_thr() +
+                   mgos_sys_config_get_wifi_sta_rssi_wake_margin_db();
+    if (s_rssi_low && mgos_wifi_sta_get_rssi_stats(&rs) &&
+        rs.mean > wake_thr + WIFI_STA_RSSI_WAKE_HYST) {
+      s_rssi_low = false;
+    }
+    if (!s_rssi_low && !s_rssi_thr_armed &&
+        mgos_wifi_has_cap(MGOS_WIFI_CAP_RSSI_EVENTS)) {
+      s_rssi_thr_armed = mgos_wifi_dev_sta_set_rssi_thr(wake_thr);
+    }
+    poll = (s_rssi_low || !s_rssi_thr_armed);
+  }
+  mgos_clear_timer(s_rssi_timer_id);
+  s_rssi_timer_id = MGOS_INVALID_TIMER_ID;
+  if (poll) {
+    s_rssi_timer_id =
+        mgos_set_timer(mgos_sys_config_get_wifi_sta_rssi_interval_ms(), 0,
+                       mgos_wifi_sta_rssi_timer_cb, NULL);
+  }
+}
+
+static void mgos_wifi_sta_rssi_timer_cb(void *arg) {
+  wifi_lock();
+  s_rssi_timer_id = MGOS_INVALID_TIMER_ID;
+  if (s_cur_entry != NULL) {
+    int rssi = mgos_wifi_sta_get_rssi_cached(
+        mgos_sys_config_get_wifi_sta_rssi_max_age_ms());
+    if (rssi == 0 && s_state == WIFI_STA_IP_ACQUIRED) {
+      // Link is gone and we have not been told.
+      mgos_wifi_stats_sta_disconnected(
+          MGOS_WIFI_DISCONNECT_REASON_UNSPECIFIED);
+      s_state = WIFI_STA_INIT;
+      set_timeout_n(1000 + mgos_wifi_sta_reconnect_delay_ms(),
+                    false /* run_now */);
+    } else {
+      mgos_wifi_sta_rssi_add_sample(rssi);
+      if (s_state == WIFI_STA_IP_ACQUIRED) mgos_wifi_sta_check_roam();
+      mgos_wifi_sta_rssi_watch();
+    }
+  }
+  mgos_wifi_sta_publish();
+  wifi_unlock();
+  (void) arg;
 }
 
 static void mgos_wifi_ev_handler(int ev, void *evd, void *cb_arg) {
@@ -530,6 +1975,7 @@ bool mgos_wifi_connect(void) {
       ret = false;
       break;
     case WIFI_STA_IDLE:
+      s_num_futile_scans = 0;
       s_state = WIFI_STA_INIT;
       set_timeout(true /* run_now */);
       break;
@@ -558,15 +2004,17 @@ bool mgos_wifi_disconnect(void) {
   mgos_clear_timer(s_connect_timer_id);
   s_connect_timer_id = MGOS_INVALID_TIMER_ID;
   s_state = WIFI_STA_IDLE;
+  mgos_wifi_stats_sta_stop();
   if (disconnect) {
     ret = mgos_wifi_dev_sta_disconnect();
     s_cur_entry = NULL;
   }
+  mgos_wifi_sta_publish();
   wifi_unlock();
   return ret;
 }
 
-enum mgos_wifi_status mgos_wifi_get_status(void) {
+static enum mgos_wifi_status mgos_wifi_sta_status(void) {
   switch (s_state) {
     case WIFI_STA_IDLE:
     case WIFI_STA_SHUTDOWN:
@@ -580,18 +2028,66 @@ enum mgos_wifi_status mgos_wifi_get_status(void) {
       }
     case WIFI_STA_INIT:
     case WIFI_STA_WAIT_CONNECT:
+      return MGOS_WIFI_CONNECTING;
     case WIFI_STA_CONNECT:
     case WIFI_STA_CONNECTING:
-      return MGOS_WIFI_CONNECTING;
     case WIFI_STA_CONNECTED:
-      return MGOS_WIFI_CONNECTED;
+      if (s_roam_switch) return MGOS_WIFI_IP_ACQUIRED;
+      return (s_state == WIFI_STA_CONNECTED ? MGOS_WIFI_CONNECTED
+                                            : MGOS_WIFI_CONNECTING);
     case WIFI_STA_IP_ACQUIRED:
       return MGOS_WIFI_IP_ACQUIRED;
   }
   return MGOS_WIFI_DISCONNECTED;
 }
 
-char *mgos_wifi_get_status_str(void) {
+// Called with wifi lock held, which makes this the only writer.
+static void mgos_wifi_sta_publish(void) {
+  struct mgos_wifi_sta_snapshot snap;
+  struct mgos_wifi_sta_rssi_stats rs;
+  int64_t link_up = 0;
+  memset(&snap, 0, sizeof(snap));
+  snap.status = mgos_wifi_sta_status();
+  if (s_cur_entry != NULL) {
+    strncpy(snap.ssid, ap_cfg(s_cur_entry)->ssid, sizeof(snap.ssid) - 1);
+    memcpy(snap.bssid, s_cur_entry->bssid, sizeof(snap.bssid));
+    snap.channel = s_cur_entry->channel;
+    if (mgos_wifi_sta_get_rssi_stats(&rs)) snap.rssi = rs.last;
+    link_up = s_link_up;
+  }
+  if (snap.status == MGOS_WIFI_IP_ACQUIRED) snap.ip = s_sta_ip;
+  if (link_up == s_snap_link_up && memcmp(&snap, &s_snap, sizeof(snap)) == 0) {
+    return;
+  }
+  __atomic_store_n(&s_snap_seq, s_snap_seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&s_snap, &snap, sizeof(s_snap));
+  s_snap_link_up = link_up;
+  __atomic_store_n(&s_snap_seq, s_snap_seq + 1, __ATOMIC_RELEASE);
+}
+
+bool mgos_wifi_sta_get_snapshot(struct mgos_wifi_sta_snapshot *snap) {
+  for (int i = 0; i < MGOS_WIFI_STA_SNAPSHOT_TRIES; i++) {
+    uint32_t seq = __atomic_load_n(&s_snap_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) continue;
+    memcpy(snap, &s_snap, sizeof(*snap));
+    int64_t link_up = s_snap_link_up;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s_snap_seq, __ATOMIC_RELAXED) != seq) continue;
+    if (link_up != 0) {
+      snap->link_uptime_s = (mgos_uptime_micros() - link_up) / 1000000;
+    }
+    return true;
+  }
+  return false;
+}
+
+enum mgos_wifi_status mgos_wifi_get_status(void) {
+  return (enum mgos_wifi_status) __atomic_load_n(&s_snap.status,
+                                                 __ATOMIC_RELAXED);
+}
+
+char *mgos_wifi_get_status_str_r(char *buf, size_t len) {
   const char *s = NULL;
   enum mgos_wifi_status st = mgos_wifi_get_status();
   switch (st) {
@@ -608,13 +2104,21 @@ char *mgos_wifi_get_status_str(void) {
       s = "got ip";
       break;
   }
-  return (s != NULL ? strdup(s) : NULL);
+  if (s == NULL || strlen(s) >= len) return NULL;
+  return strcpy(buf, s);
+}
+
+char *mgos_wifi_get_status_str(void) {
+  char buf[16];
+  if (mgos_wifi_get_status_str_r(buf, sizeof(buf)) == NULL) return NULL;
+  return strdup(buf);
 }
 
 static void mgos_wifi_shutdown_cb(void *arg) {
   mgos_wifi_disconnect();
   wifi_lock();
   s_state = WIFI_STA_SHUTDOWN;
+  mgos_wifi_sta_publish();
   wifi_unlock();
   (void) arg;
 }
@@ -624,6 +2128,9 @@ static void mgos_wifi_reboot_after_ev_handler(int ev, void *evd, void *cb_arg) {
       (struct mgos_event_reboot_after_arg *) evd;
   int64_t time_to_reboot_ms =
       (arg->reboot_at_uptime_micros - mgos_uptime_micros()) / 1000;
+  wifi_lock();
+  if (s_hist_dirty) mgos_wifi_sta_save_history();
+  wifi_unlock();
   if (time_to_reboot_ms > 50) {
     mgos_set_timer(time_to_reboot_ms - 50, 0, mgos_wifi_shutdown_cb, NULL);
   } else {
@@ -633,7 +2140,8 @@ static void mgos_wifi_reboot_after_ev_handler(int ev, void *evd, void *cb_arg) {
   (void) cb_arg;
 }
 
-bool mgos_wifi_sta_add_cfg(const struct mgos_config_wifi_sta *cfg) {
+static bool mgos_wifi_sta_add_cfg2(const struct mgos_config_wifi_sta *cfg,
+                                   const uint8_t *pmk) {
   if (!cfg->enable) return false;
   if (!mgos_wifi_validate_sta_cfg(cfg, NULL)) return false;
   struct mgos_config_wifi_sta *cfg2;
@@ -642,43 +2150,78 @@ bool mgos_wifi_sta_add_cfg(const struct mgos_config_wifi_sta *cfg) {
   } else {
     cfg2 = calloc(1, sizeof(*cfg));
     if (cfg2 == NULL) return false;
-    if (!mgos_config_wifi_sta_copy(cfg, cfg2)) return false;
+    if (!mgos_config_wifi_sta_copy(cfg, cfg2)) goto out_err;
   }
+  struct wifi_sta_cfg_desc *descs =
+      realloc(s_cfg_descs, (s_num_cfgs + 1) * sizeof(*s_cfg_descs));
+  if (descs == NULL) goto out_err;
+  s_cfg_descs = descs;
   struct mgos_config_wifi_sta **cfgs =
       realloc(s_cfgs, (s_num_cfgs + 1) * sizeof(*s_cfgs));
-  if (cfgs == NULL) return false;
+  if (cfgs == NULL) goto out_err;
   cfgs[s_num_cfgs] = cfg2;
+  mgos_wifi_sta_compile_cfg(cfg2, pmk, &descs[s_num_cfgs]);
   s_cfgs = cfgs;
   s_num_cfgs++;
   return true;
+
+out_err:
+  mgos_wifi_sta_free_cfg(cfg2);
+  return false;
+}
+
+bool mgos_wifi_sta_add_cfg(const struct mgos_config_wifi_sta *cfg) {
+  uint8_t pmk[32];
+  // The lock is not held here, so the key is derived straight away.
+  bool have_pmk = (cfg->enable && mgos_wifi_sta_pmk_ok(cfg));
+  if (have_pmk) mgos_wifi_sta_derive_pmk(cfg->ssid, cfg->pass, pmk);
+  return mgos_wifi_sta_add_cfg2(cfg, (have_pmk ? pmk : NULL));
 }
 
 void mgos_wifi_sta_clear_cfgs(void) {
   s_cur_entry = NULL;
-  while (!SLIST_EMPTY(&s_ap_queue)) {
-    struct wifi_ap_entry *ape = SLIST_FIRST(&s_ap_queue);
-    SLIST_REMOVE_HEAD(&s_ap_queue, next);
-    free(ape);
-  }
-  while (!SLIST_EMPTY(&s_ap_history)) {
-    struct wifi_ap_entry *ape = SLIST_FIRST(&s_ap_history);
-    SLIST_REMOVE_HEAD(&s_ap_history, next);
-    free(ape);
-  }
+  mgos_wifi_sta_publish();
+  // History is per BSSID and outlives the configs, cfg_idx of an entry is
+  // only relied upon while it is queued. Queued ones go back to history.
+  mgos_wifi_sta_empty_queue();
   for (int i = 0; i < s_num_cfgs; i++) {
     mgos_wifi_sta_free_cfg(s_cfgs[i]);
   }
   s_num_cfgs = 0;
   free(s_cfgs);
   s_cfgs = NULL;
+  free(s_cfg_descs);
+  s_cfg_descs = NULL;
+  s_num_db_cfgs = 0;
+  s_db_next_slot = 0;
+  mgos_wifi_sta_db_reset();
+}
+
+char *mgos_wifi_get_connected_ssid_r(char *buf, size_t len) {
+  struct mgos_wifi_sta_snapshot snap;
+  if (!mgos_wifi_sta_get_snapshot(&snap) || snap.ssid[0] == '\0' ||
+      strlen(snap.ssid) >= len) {
+    return NULL;
+  }
+  return strcpy(buf, snap.ssid);
 }
 
 char *mgos_wifi_get_connected_ssid(void) {
-  if (s_cur_entry == NULL) return NULL;
-  return strdup(s_cur_entry->cfg->ssid);
+  char buf[33];
+  if (mgos_wifi_get_connected_ssid_r(buf, sizeof(buf)) == NULL) return NULL;
+  return strdup(buf);
+}
+
+char *mgos_wifi_get_sta_default_dns(void) {
+  char buf[16];
+  if (mgos_wifi_get_sta_default_dns_r(buf, sizeof(buf)) == NULL) return NULL;
+  return strdup(buf);
 }
 
 void mgos_wifi_sta_init(void) {
+  wifi_lock();
+  mgos_wifi_sta_load_history();
+  wifi_unlock();
   mgos_event_add_group_handler(MGOS_WIFI_EV_BASE, mgos_wifi_ev_handler, NULL);
   mgos_event_add_handler(MGOS_EVENT_REBOOT_AFTER,
                          mgos_wifi_reboot_after_ev_handler, NULL);
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Known network database: a file with one station config per line, JSON
+ * object with the same fields as wifi.sta. Only an index of SSID hashes and
+ * line offsets is kept in RAM, entries are parsed on demand.
+ */
+
+#include "mgos_wifi_sta.h"
+
+#include <stdio.h>
+
+#include "common/mg_str.h"
+#include "frozen.h"
+#include "mgos.h"
+
+#ifndef MGOS_WIFI_STA_DB_MAX_LINE
+#define MGOS_WIFI_STA_DB_MAX_LINE 512
+#endif
+
+struct wifi_sta_db_entry {
+  uint32_t hash;
+  uint32_t offset;
+};
+
+static struct {
+  bool loaded;
+  int num_entries;
+  struct wifi_sta_db_entry *entries;
+  int index_size;
+  uint16_t *index; /* Entry number + 1, 0 - empty slot */
+} s_db;
+
+static bool mgos_wifi_sta_db_add(uint32_t hash, uint32_t offset) {
+  if (s_db.num_entries == UINT16_MAX - 1) return false;
+  struct wifi_sta_db_entry *entries = (struct wifi_sta_db_entry *) realloc(
+      s_db.entries, (s_db.num_entries + 1) * sizeof(*entries));
+  if (entries == NULL) return false;
+  entries[s_db.num_entries].hash = hash;
+  entries[s_db.num_entries].offset = offset;
+  s_db.entries = entries;
+  s_db.num_entries++;
+  return true;
+}
+
+static bool mgos_wifi_sta_db_build_index(void) {
+  /* Keep the table at most half full. */
+  s_db.index_size = s_db.num_entries * 2 + 1;
+  s_db.index = (uint16_t *) calloc(s_db.index_size, sizeof(*s_db.index));
+  if (s_db.index == NULL) return false;
+  for (int i = 0; i < s_db.num_entries; i++) {
+    int slot = s_db.entries[i].hash % s_db.index_size;
+    while (s_db.index[slot] != 0) {
+      if (++slot == s_db.index_size) slot = 0;
+    }
+    s_db.index[slot] = i + 1;
+  }
+  return true;
+}
+
+static void mgos_wifi_sta_db_load(void) {
+  FILE *fp = NULL;
+  char *buf = NULL;
+  const char *fn = mgos_sys_config_get_wifi_sta_db_file();
+  s_db.loaded = true;
+  if (mgos_conf_str_empty(fn)) return;
+  fp = fopen(fn, "r");
+  if (fp == NULL) {
+    LOG(LL_ERROR, ("Failed to open %s", fn));
+    goto out;
+  }
+  buf = (char *) malloc(MGOS_WIFI_STA_DB_MAX_LINE);
+  if (buf == NULL) goto out;
+  long offset = 0;
+  while (fgets(buf, MGOS_WIFI_STA_DB_MAX_LINE, fp) != NULL) {
+    int len = strlen(buf);
+    long line_offset = offset;
+    offset += len;
+    if (len > 0 && buf[len - 1] != '\n' && !feof(fp)) {
+      LOG(LL_ERROR, ("%s: line at %ld is too long", fn, line_offset));
+      int c;
+      while ((c = fgetc(fp)) != EOF && c != '\n') offset++;
+      if (c == '\n') offset++;
+      continue;
+    }
+    char *ssid = NULL;
+    json_scanf(buf, len, "{ssid: %Q}", &ssid);
+    if (ssid != NULL) {
+      uint32_t hash = mgos_wifi_sta_ssid_hash(ssid, NULL);
+      bool ok = mgos_wifi_sta_db_add(hash, line_offset);
+      free(ssid);
+      if (!ok) break;
+    }
+  }
+  if (!mgos_wifi_sta_db_build_index()) {
+    s_db.num_entries = 0;
+    goto out;
+  }
+  LOG(LL_INFO, ("%s: %d networks", fn, s_db.num_entries));
+
+out:
+  free(buf);
+  if (fp != NULL) fclose(fp);
+}
+
+static bool mgos_wifi_sta_db_read(uint32_t offset, const char *ssid,
+                                  struct mgos_config_wifi_sta *cfg) {
+  bool res = false;
+  char *buf = NULL;
+  FILE *fp = fopen(mgos_sys_config_get_wifi_sta_db_file(), "r");
+  if (fp == NULL || fseek(fp, offset, SEEK_SET) != 0) goto out;
+  buf = (char *) malloc(MGOS_WIFI_STA_DB_MAX_LINE);
+  if (buf == NULL || fgets(buf, MGOS_WIFI_STA_DB_MAX_LINE, fp) == NULL) {
+    goto out;
+  }
+  /* Entries are enabled unless explicitly disabled. */
+  bool enable = true;
+  json_scanf(buf, strlen(buf), "{enable: %B}", &enable);
+  if (!mgos_config_wifi_sta_parse(mg_mk_str(buf), cfg)) goto out;
+  if (mgos_conf_str_empty(cfg->ssid) || strcmp(cfg->ssid, ssid) != 0) {
+    /* Hash collision. */
+    mgos_config_wifi_sta_free(cfg);
+    goto out;
+  }
+  cfg->enable = enable;
+  res = true;
+
+out:
+  free(buf);
+  if (fp != NULL) fclose(fp);
+  return res;
+}
+
+bool mgos_wifi_sta_db_get(const char *ssid, struct mgos_config_wifi_sta *cfg) {
+  if (!mgos_sys_config_get_wifi_sta_db_enable()) return false;
+  if (!s_db.loaded) mgos_wifi_sta_db_load();
+  if (s_db.num_entries == 0) return false;
+  uint32_t hash = mgos_wifi_sta_ssid_hash(ssid, NULL);
+  int slot = hash % s_db.index_size;
+  while (s_db.index[slot] != 0) {
+    const struct wifi_sta_db_entry *e = &s_db.entries[s_db.index[slot] - 1];
+    if (e->hash == hash && mgos_wifi_sta_db_read(e->offset, ssid, cfg)) {
+      return true;
+    }
+    if (++slot == s_db.index_size) slot = 0;
+  }
+  return false;
+}
+
+void mgos_wifi_sta_db_reset(void) {
+  free(s_db.entries);
+  free(s_db.index);
+  memset(&s_db, 0, sizeof(s_db));
+}
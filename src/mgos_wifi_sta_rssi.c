@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Signal strength estimator for the current AP: exponentially weighted mean
+ * and variance, plus least squares slope over a window of recent samples.
+ * Samples too far from the mean are treated as fades and ignored, unless
+ * there are several in a row, in which case the level has really changed.
+ */
+
+#include "mgos_wifi_sta.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "mgos.h"
+
+#ifndef MGOS_WIFI_STA_RSSI_WINDOW
+#define MGOS_WIFI_STA_RSSI_WINDOW 16
+#endif
+
+/* Samples needed before outlier rejection kicks in. */
+#define RSSI_MIN_SAMPLES 4
+/* Consecutive outliers that are accepted as a level change. */
+#define RSSI_MAX_OUTLIERS 3
+/* Lower bound for standard deviation used in outlier test, dB. */
+#define RSSI_MIN_SD 2.0f
+
+void wifi_lock(void);
+void wifi_unlock(void);
+
+static struct {
+  int num_samples;
+  int num_outliers, num_outliers_seq;
+  int last;
+  float mean, var;
+  int64_t t0_ms;
+  /* Window of accepted samples: time since t0 and value. */
+  int wnd_len, wnd_pos;
+  uint32_t wnd_t[MGOS_WIFI_STA_RSSI_WINDOW];
+  int8_t wnd_v[MGOS_WIFI_STA_RSSI_WINDOW];
+} s_rssi;
+
+/* Last reading from the driver or an event. */
+static struct {
+  int rssi;
+  int64_t time; /* Uptime, us; 0 - none */
+} s_rssi_cache;
+
+void mgos_wifi_sta_rssi_cache_set(int rssi) {
+  wifi_lock();
+  s_rssi_cache.rssi = rssi;
+  s_rssi_cache.time = (rssi < 0 ? mgos_uptime_micros() : 0);
+  wifi_unlock();
+}
+
+int mgos_wifi_sta_get_rssi_cached(int max_age_ms) {
+  int rssi;
+  wifi_lock();
+  int64_t now = mgos_uptime_micros();
+  if (s_rssi_cache.time != 0 &&
+      now - s_rssi_cache.time <= max_age_ms * 1000LL) {
+    rssi = s_rssi_cache.rssi;
+  } else {
+    rssi = mgos_wifi_sta_get_rssi();
+    s_rssi_cache.rssi = rssi;
+    s_rssi_cache.time = (rssi < 0 ? now : 0);
+  }
+  wifi_unlock();
+  return rssi;
+}
+
+void mgos_wifi_sta_rssi_reset(void) {
+  memset(&s_rssi, 0, sizeof(s_rssi));
+}
+
+static void mgos_wifi_sta_rssi_accept(int64_t now_ms, int rssi) {
+  float alpha = mgos_sys_config_get_wifi_sta_rssi_alpha_pct() / 100.0f;
+  if (alpha <= 0 || alpha > 1) alpha = 0.2f;
+  if (s_rssi.num_samples == 0) {
+    s_rssi.mean = rssi;
+    s_rssi.var = 0;
+    s_rssi.t0_ms = now_ms;
+  } else {
+    float d = rssi - s_rssi.mean;
+    s_rssi.mean += alpha * d;
+    s_rssi.var = (1 - alpha) * (s_rssi.var + alpha * d * d);
+  }
+  s_rssi.num_samples++;
+  s_rssi.wnd_t[s_rssi.wnd_pos] = (uint32_t)(now_ms - s_rssi.t0_ms);
+  s_rssi.wnd_v[s_rssi.wnd_pos] = (int8_t) rssi;
+  s_rssi.wnd_pos = (s_rssi.wnd_pos + 1) % MGOS_WIFI_STA_RSSI_WINDOW;
+  if (s_rssi.wnd_len < MGOS_WIFI_STA_RSSI_WINDOW) s_rssi.wnd_len++;
+}
+
+void mgos_wifi_sta_rssi_add_sample(int rssi) {
+  int64_t now_ms = mgos_uptime_micros() / 1000;
+  if (rssi >= 0) return; /* Not connected */
+  s_rssi.last = rssi;
+  if (s_rssi.num_samples >= RSSI_MIN_SAMPLES) {
+    float sd = sqrtf(s_rssi.var);
+    float k = mgos_sys_config_get_wifi_sta_rssi_outlier_sd();
+    if (sd < RSSI_MIN_SD) sd = RSSI_MIN_SD;
+    if (k > 0 && fabsf(rssi - s_rssi.mean) > k * sd &&
+        ++s_rssi.num_outliers_seq < RSSI_MAX_OUTLIERS) {
+      s_rssi.num_outliers++;
+      return;
+    }
+  }
+  s_rssi.num_outliers_seq = 0;
+  mgos_wifi_sta_rssi_accept(now_ms, rssi);
+}
+
+/* Least squares slope over the window, dB per second. */
+static float mgos_wifi_sta_rssi_slope(void) {
+  int n = s_rssi.wnd_len;
+  if (n < 2) return 0;
+  float mt = 0, mv = 0;
+  for (int i = 0; i < n; i++) {
+    mt += s_rssi.wnd_t[i] / 1000.0f;
+    mv += s_rssi.wnd_v[i];
+  }
+  mt /= n;
+  mv /= n;
+  float stv = 0, stt = 0;
+  for (int i = 0; i < n; i++) {
+    float dt = s_rssi.wnd_t[i] / 1000.0f - mt;
+    stv += dt * (s_rssi.wnd_v[i] - mv);
+    stt += dt * dt;
+  }
+  return (stt > 0 ? stv / stt : 0);
+}
+
+bool mgos_wifi_sta_get_rssi_stats(struct mgos_wifi_sta_rssi_stats *stats) {
+  bool res = false;
+  memset(stats, 0, sizeof(*stats));
+  wifi_lock();
+  if (s_rssi.num_samples == 0) goto out;
+  stats->num_samples = s_rssi.num_samples;
+  stats->num_outliers = s_rssi.num_outliers;
+  stats->last = s_rssi.last;
+  stats->mean = s_rssi.mean;
+  stats->variance = s_rssi.var;
+  stats->trend = mgos_wifi_sta_rssi_slope();
+  res = true;
+out:
+  wifi_unlock();
+  return res;
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Connection statistics. Updated by the scan code and the station state
+ * machine, all updates are a few increments.
+ */
+
+#include "mgos_wifi.h"
+#include "mgos_wifi_sta.h"
+
+#include <string.h>
+
+#include "common/mbuf.h"
+#include "frozen.h"
+#include "mgos.h"
+
+void wifi_lock(void);
+void wifi_unlock(void);
+
+static struct mgos_wifi_stats s_stats;
+/* Start of the scan, connection attempt and of (re)connecting, 0 - none. */
+static int64_t s_scan_start_us, s_attempt_start_us, s_sta_start_us;
+
+static void hist_add(struct mgos_wifi_stats_hist *h, int64_t start_us) {
+  int64_t v = (mgos_uptime_micros() - start_us) / 1000;
+  uint32_t ms = (v < 0 ? 0 : v > UINT32_MAX ? UINT32_MAX : (uint32_t) v);
+  int i = 0;
+  while (i < MGOS_WIFI_STATS_HIST_BUCKETS - 1 &&
+         ms >= ((uint32_t) MGOS_WIFI_STATS_HIST_BASE_MS << i)) {
+    i++;
+  }
+  h->buckets[i]++;
+  h->count++;
+  h->sum_ms += ms;
+  if (ms > h->max_ms) h->max_ms = ms;
+}
+
+static void reasons_add(uint32_t *counts,
+                        enum mgos_wifi_disconnect_reason reason) {
+  if ((int) reason < 0 || reason >= MGOS_WIFI_DISCONNECT_REASON_MAX) {
+    reason = MGOS_WIFI_DISCONNECT_REASON_UNSPECIFIED;
+  }
+  counts[reason]++;
+}
+
+void mgos_wifi_stats_scan_start(void) {
+  wifi_lock();
+  s_stats.scans_started++;
+  s_scan_start_us = mgos_uptime_micros();
+  wifi_unlock();
+}
+
+void mgos_wifi_stats_scan_done(int num_res) {
+  wifi_lock();
+  if (num_res < 0) {
+    s_stats.scans_failed++;
+  } else if (s_scan_start_us != 0) {
+    hist_add(&s_stats.scan_ms, s_scan_start_us);
+  }
+  s_scan_start_us = 0;
+  wifi_unlock();
+}
+
+void mgos_wifi_stats_sta_start(void) {
+  if (s_sta_start_us == 0) s_sta_start_us = mgos_uptime_micros();
+}
+
+void mgos_wifi_stats_sta_stop(void) {
+  s_sta_start_us = s_attempt_start_us = 0;
+}
+
+void mgos_wifi_stats_sta_attempt(void) {
+  s_stats.connect_attempts++;
+  s_attempt_start_us = mgos_uptime_micros();
+}
+
+void mgos_wifi_stats_sta_roam(void) {
+  s_stats.roams++;
+}
+
+void mgos_wifi_stats_sta_associated(void) {
+  if (s_attempt_start_us == 0) return;
+  hist_add(&s_stats.assoc_ms, s_attempt_start_us);
+  s_attempt_start_us = 0;
+}
+
+void mgos_wifi_stats_sta_attempt_failed(
+    bool timeout, enum mgos_wifi_disconnect_reason reason) {
+  if (timeout) {
+    s_stats.connect_timeouts++;
+  } else {
+    reasons_add(s_stats.connect_failures, reason);
+  }
+  s_attempt_start_us = 0;
+}
+
+void mgos_wifi_stats_sta_ip_acquired(void) {
+  if (s_sta_start_us == 0) return;
+  hist_add(&s_stats.ip_ms, s_sta_start_us);
+  s_sta_start_us = 0;
+}
+
+void mgos_wifi_stats_sta_disconnected(
+    enum mgos_wifi_disconnect_reason reason) {
+  reasons_add(s_stats.disconnects, reason);
+  /* Time to IP includes the time it took to notice. */
+  s_sta_start_us = mgos_uptime_micros();
+}
+
+void mgos_wifi_stats_events(uint32_t num_lost, uint32_t num_coalesced) {
+  wifi_lock();
+  s_stats.events_lost += num_lost;
+  s_stats.events_coalesced += num_coalesced;
+  wifi_unlock();
+}
+
+void mgos_wifi_get_stats(struct mgos_wifi_stats *stats) {
+  wifi_lock();
+  *stats = s_stats;
+  wifi_unlock();
+}
+
+void mgos_wifi_reset_stats(void) {
+  wifi_lock();
+  memset(&s_stats, 0, sizeof(s_stats));
+  wifi_unlock();
+}
+
+int mgos_wifi_stats_hist_percentile(const struct mgos_wifi_stats_hist *h,
+                                    int pct) {
+  if (h->count == 0) return -1;
+  uint32_t n = 0, target = ((uint64_t) h->count * pct + 99) / 100;
+  if (target == 0) target = 1;
+  for (int i = 0; i < MGOS_WIFI_STATS_HIST_BUCKETS - 1; i++) {
+    n += h->buckets[i];
+    if (n >= target) {
+      uint32_t ub = (uint32_t) MGOS_WIFI_STATS_HIST_BASE_MS << i;
+      return (int) (ub < h->max_ms ? ub : h->max_ms);
+    }
+  }
+  return (int) h->max_ms;
+}
+
+static int json_print_hist(struct json_out *out, va_list *ap) {
+  const struct mgos_wifi_stats_hist *h =
+      va_arg(*ap, const struct mgos_wifi_stats_hist *);
+  int len = json_printf(
+      out, "{count: %u, sum_ms: %llu, max_ms: %u, p50: %d, p99: %d, ",
+      (unsigned) h->count, (unsigned long long) h->sum_ms,
+      (unsigned) h->max_ms, mgos_wifi_stats_hist_percentile(h, 50),
+      mgos_wifi_stats_hist_percentile(h, 99));
+  len += json_printf(out, "buckets: [");
+  for (int i = 0; i < MGOS_WIFI_STATS_HIST_BUCKETS; i++) {
+    len += json_printf(out, "%s%u", (i > 0 ? ", " : ""),
+                       (unsigned) h->buckets[i]);
+  }
+  len += json_printf(out, "]}");
+  return len;
+}
+
+static int json_print_reasons(struct json_out *out, va_list *ap) {
+  const uint32_t *counts = va_arg(*ap, const uint32_t *);
+  int len = json_printf(out, "{");
+  for (int i = 0; i < MGOS_WIFI_DISCONNECT_REASON_MAX; i++) {
+    len += json_printf(out, "%s%Q: %u", (i > 0 ? ", " : ""),
+                       mgos_wifi_disconnect_reason_str(
+                           (enum mgos_wifi_disconnect_reason) i),
+                       (unsigned) counts[i]);
+  }
+  len += json_printf(out, "}");
+  return len;
+}
+
+char *mgos_wifi_get_stats_json(void) {
+  struct mgos_wifi_stats st;
+  struct mbuf mb;
+  struct json_out out = JSON_OUT_MBUF(&mb);
+  mgos_wifi_get_stats(&st);
+  mbuf_init(&mb, 0);
+  json_printf(&out,
+              "{scans_started: %u, scans_failed: %u, scan_ms: %M, "
+              "connect_attempts: %u, connect_timeouts: %u, "
+              "connect_failures: %M, assoc_ms: %M, ip_ms: %M, "
+              "roams: %u, disconnects: %M, events_lost: %u, "
+              "events_coalesced: %u}",
+              (unsigned) st.scans_started, (unsigned) st.scans_failed,
+              json_print_hist, &st.scan_ms, (unsigned) st.connect_attempts,
+              (unsigned) st.connect_timeouts, json_print_reasons,
+              st.connect_failures, json_print_hist, &st.assoc_ms,
+              json_print_hist, &st.ip_ms, (unsigned) st.roams,
+              json_print_reasons, st.disconnects, (unsigned) st.events_lost,
+              (unsigned) st.events_coalesced);
+  mbuf_append(&mb, "", 1);
+  return mb.buf;
+}
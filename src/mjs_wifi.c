@@ -66,13 +66,16 @@ void mgos_wifi_scan_js_cb(int num_res, struct mgos_wifi_scan_result *res,
 void mgos_wifi_scan_js(struct mjs *mjs) {
   struct scan_ctx *ctx;
   mjs_val_t cb = mjs_arg(mjs, 0);
+  mjs_val_t max_age_arg = mjs_arg(mjs, 1);
+  int max_age_ms = mgos_sys_config_get_wifi_scan_cache_js_max_age_ms();
   if (!mjs_is_function(cb)) return; /* Throw an error? */
+  if (mjs_is_number(max_age_arg)) max_age_ms = mjs_get_int(mjs, max_age_arg);
   ctx = (struct scan_ctx *) calloc(1, sizeof(*ctx));
   if (ctx == NULL) return;
   ctx->mjs = mjs;
   ctx->cb = cb;
   mjs_own(mjs, &ctx->cb);
-  mgos_wifi_scan(mgos_wifi_scan_js_cb, ctx);
+  mgos_wifi_scan_cached(max_age_ms, mgos_wifi_scan_js_cb, ctx);
 }
 
 #endif /* MGOS_HAVE_MJS */
@@ -57,6 +57,50 @@ bool mgos_wifi_dev_get_ip_info(int if_instance,
   return false;
 }
 
+// Thresholds handed over by the station, see
+// mgos_wifi_dev_sta_set_roam_offload().
+static struct {
+  int enable;
+  int rssi_thr;
+  int hyst_db;
+  int period;
+} s_roam_offload;
+
+// BG scan and roaming settings are applied on join, see
+// rsi_wlan_execute_post_connect_cmds().
+static void rs14100_wifi_set_roaming_params(void) {
+  const struct mgos_config_wifi_sta_params_bg_scan *bcfg =
+      mgos_sys_config_get_wifi_sta_params_bg_scan();
+  g_wifi_sta_bg_scan_params.enable = &bcfg->enable;
+  g_wifi_sta_bg_scan_params.period = &bcfg->period;
+  g_wifi_sta_bg_scan_params.rssi_threshold = &bcfg->rssi_threshold;
+  g_wifi_sta_bg_scan_params.rssi_tolerance = &bcfg->rssi_tolerance;
+  g_wifi_sta_bg_scan_params.active_duration_ms = &bcfg->active_duration_ms;
+  g_wifi_sta_bg_scan_params.passive_duration_ms = &bcfg->passive_duration_ms;
+  const struct mgos_config_wifi_sta_params_roaming *rcfg =
+      mgos_sys_config_get_wifi_sta_params_roaming();
+  g_wifi_sta_roaming_params.enable = &rcfg->enable;
+  g_wifi_sta_roaming_params.rssi_threshold = &rcfg->rssi_threshold;
+  g_wifi_sta_roaming_params.rssi_hysteresis = &rcfg->rssi_hysteresis;
+}
+
+bool mgos_wifi_dev_sta_set_roam_offload(
+    const struct mgos_wifi_roam_offload_params *params) {
+  rs14100_wifi_set_roaming_params();
+  if (!params->enable) return false;
+  s_roam_offload.enable = true;
+  s_roam_offload.rssi_thr = params->rssi_thr;
+  s_roam_offload.hyst_db = params->hyst_db;
+  s_roam_offload.period = params->scan_interval_s;
+  g_wifi_sta_bg_scan_params.enable = &s_roam_offload.enable;
+  g_wifi_sta_bg_scan_params.period = &s_roam_offload.period;
+  g_wifi_sta_bg_scan_params.rssi_threshold = &s_roam_offload.rssi_thr;
+  g_wifi_sta_roaming_params.enable = &s_roam_offload.enable;
+  g_wifi_sta_roaming_params.rssi_threshold = &s_roam_offload.rssi_thr;
+  g_wifi_sta_roaming_params.rssi_hysteresis = &s_roam_offload.hyst_db;
+  return true;
+}
+
 void mgos_wifi_dev_init(void) {
   NETIF_DECLARE_EXT_CALLBACK(s_rs14100_wifi_sta_ext_cb);
   netif_add_ext_callback(&s_rs14100_wifi_sta_ext_cb,
@@ -75,19 +119,7 @@ void mgos_wifi_dev_init(void) {
     rsi_wireless_init(RSI_WLAN_CLIENT_MODE, 0);
     rsi_wlan_radio_init();
   }
-  const struct mgos_config_wifi_sta_params_bg_scan *bcfg =
-      mgos_sys_config_get_wifi_sta_params_bg_scan();
-  g_wifi_sta_bg_scan_params.enable = &bcfg->enable;
-  g_wifi_sta_bg_scan_params.period = &bcfg->period;
-  g_wifi_sta_bg_scan_params.rssi_threshold = &bcfg->rssi_threshold;
-  g_wifi_sta_bg_scan_params.rssi_tolerance = &bcfg->rssi_tolerance;
-  g_wifi_sta_bg_scan_params.active_duration_ms = &bcfg->active_duration_ms;
-  g_wifi_sta_bg_scan_params.passive_duration_ms = &bcfg->passive_duration_ms;
-  const struct mgos_config_wifi_sta_params_roaming *rcfg =
-      mgos_sys_config_get_wifi_sta_params_roaming();
-  g_wifi_sta_roaming_params.enable = &rcfg->enable;
-  g_wifi_sta_roaming_params.rssi_threshold = &rcfg->rssi_threshold;
-  g_wifi_sta_roaming_params.rssi_hysteresis = &rcfg->rssi_hysteresis;
+  rs14100_wifi_set_roaming_params();
 }
 
 void mgos_wifi_dev_deinit(void) {
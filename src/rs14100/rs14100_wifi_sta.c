@@ -49,6 +49,7 @@ struct rs14100_sta_ctx {
   bool dhcp_enabled, waiting_dhcp;
   uint8_t sta_bssid[6];
   int sta_channel;
+  int sta_rssi;
 };
 
 struct rs14100_sta_ctx s_sta_ctx;
@@ -89,6 +90,16 @@ static void rs14100_wifi_sta_join_cb_tcpip(void *arg) {
       mgos_wifi_dev_event_cb(&dei);
     }
   } else if (ok && ctx->connected) {
+    struct mgos_wifi_dev_event_info dei = {
+        .ev = MGOS_WIFI_EV_STA_ROAMED,
+        .sta_roamed =
+            {
+                .channel = ctx->sta_channel,
+                .rssi = ctx->sta_rssi,
+            },
+    };
+    memcpy(dei.sta_roamed.bssid, ctx->sta_bssid, 6);
+    mgos_wifi_dev_event_cb(&dei);
     // When roaming, we want to trigger DHCP renewal just in case
     // we roamed onto a network with the same SSID but different IP settings.
     struct dhcp *dhcp = ((struct dhcp *) netif_get_client_data(
@@ -104,7 +115,10 @@ static void rs14100_wifi_sta_join_cb_tcpip(void *arg) {
         .ev = MGOS_WIFI_EV_STA_DISCONNECTED,
         .sta_disconnected =
             {
-                .reason = status,
+                .reason = (status == RSI_ERROR_WLAN_NO_AP_FOUND
+                               ? MGOS_WIFI_DISCONNECT_REASON_NO_AP_FOUND
+                               : MGOS_WIFI_DISCONNECT_REASON_UNSPECIFIED),
+                .raw_reason = status,
             },
     };
     mgos_wifi_dev_event_cb(&dei);
@@ -247,6 +261,7 @@ static void rs14100_wifi_state_notification_handler(uint16_t status,
     case 0x80:
       memcpy(ctx->sta_bssid, sn->bssid, sizeof(ctx->sta_bssid));
       ctx->sta_channel = sn->channel;
+      ctx->sta_rssi = (sn->rssi_val != 100 ? -sn->rssi_val : 0);
       if (ctx->connected) {  // Roaming.
         LOG(LL_INFO, ("WiFi STA: Moved to BSSID %02x:%02x:%02x:%02x:%02x:%02x "
                       "ch %d RSSI %d",
@@ -335,6 +350,16 @@ out:
   return res;
 }
 
+void mgos_wifi_dev_get_caps(struct mgos_wifi_dev_caps *caps) {
+  // No AP yet. Firmware roams by itself and does not take a PSK.
+  caps->flags = MGOS_WIFI_CAP_DIRECTED_SCAN | MGOS_WIFI_CAP_SCAN_CHANNELS |
+                MGOS_WIFI_CAP_BG_SCAN | MGOS_WIFI_CAP_ROAM_OFFLOAD;
+  // Scan response has room for this many.
+  caps->max_scan_results = (int) ARRAY_SIZE(((rsi_rsp_scan_t *) 0)->scan_info);
+  // Only one channel or all of them can be scanned.
+  caps->max_scan_channels = 1;
+}
+
 bool mgos_wifi_dev_sta_connect(void) {
   struct rs14100_sta_ctx *ctx = &s_sta_ctx;
   rsi_security_mode_t sec = RSI_OPEN;
@@ -354,7 +379,8 @@ bool mgos_wifi_dev_sta_connect(void) {
         .ev = MGOS_WIFI_EV_STA_DISCONNECTED,
         .sta_disconnected =
             {
-                .reason = status,
+                .reason = MGOS_WIFI_DISCONNECT_REASON_NO_AP_FOUND,
+                .raw_reason = status,
             },
     };
     mgos_wifi_dev_event_cb(&dei);
@@ -381,6 +407,18 @@ bool mgos_wifi_dev_sta_disconnect(void) {
   return true;
 }
 
+bool mgos_wifi_dev_sta_set_rssi_thr(int rssi_thr) {
+  (void) rssi_thr;
+  return false;
+}
+
+bool mgos_wifi_dev_sta_roam(const struct mgos_config_wifi_sta *cfg) {
+  // Firmware roams on its own based on BG scan results, see
+  // wifi.sta_params.roaming and mgos_wifi_dev_sta_set_roam_offload().
+  (void) cfg;
+  return false;
+}
+
 bool rs14100_wifi_sta_get_ip_info(struct mgos_net_ip_info *ip_info) {
   return mgos_lwip_if_get_ip_info(s_sta_ctx.netif, ip_info);
 }
@@ -441,7 +479,7 @@ static void rs14100_wifi_scan_cb(uint16_t status, const uint8_t *buffer,
   (void) length;
 }
 
-bool mgos_wifi_dev_start_scan(void) {
+bool mgos_wifi_dev_start_scan(const struct mgos_wifi_scan_params *params) {
   struct rs14100_sta_ctx *ctx = &s_sta_ctx;
   if (ctx->connecting) return false;  // Already busy scanning.
   int32_t status;
@@ -449,7 +487,10 @@ bool mgos_wifi_dev_start_scan(void) {
   if (ctx->connected) {
     status = rsi_wlan_bgscan_async(rs14100_wifi_scan_cb);
   } else {
-    status = rsi_wlan_scan_async(NULL, 0, rs14100_wifi_scan_cb);
+    // Only one channel or all of them can be scanned.
+    uint8_t channel = (params->num_channels == 1 ? params->channels[0] : 0);
+    status = rsi_wlan_scan_async((int8_t *) params->ssid, channel,
+                                 rs14100_wifi_scan_cb);
   }
   switch (status) {
     case RSI_ERROR_WLAN_NO_AP_FOUND:
@@ -463,7 +504,7 @@ bool mgos_wifi_dev_start_scan(void) {
   }
 }
 
-char *mgos_wifi_get_sta_default_dns(void) {
+char *mgos_wifi_get_sta_default_dns_r(char *buf, size_t len) {
   const ip_addr_t *dns_ip = dns_getserver(0);
   if (dns_ip->addr == 0) return NULL;
   struct sockaddr_in a = {
@@ -471,5 +512,6 @@ char *mgos_wifi_get_sta_default_dns(void) {
   };
   char dns_ip_str[16];
   mgos_net_ip_to_str(&a, dns_ip_str);
-  return strdup(dns_ip_str);
+  if (strlen(dns_ip_str) >= len) return NULL;
+  return strcpy(buf, dns_ip_str);
 }
@@ -0,0 +1,939 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ubuntu_wifi.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_dbg.h"
+#include "frozen.h"
+
+#include "mgos.h"
+#include "mgos_net_hal.h"
+#include "mgos_sys_config.h"
+#include "mgos_wifi.h"
+#include "mgos_wifi_hal.h"
+#include "mgos_wifi_sta.h"
+
+/* Signal below this level is treated as out of range. */
+#define SIM_MIN_RSSI (-95)
+
+#define SIM_TICK_MS 100
+/* Depth of a fade in link RSSI readings, dB. */
+#define SIM_FADE_DB 20
+
+/* Disconnect reasons, same numbering as ESP32 and ESP8266 use. */
+#define SIM_REASON_ASSOC_TOOMANY 5
+#define SIM_REASON_ASSOC_LEAVE 8
+#define SIM_REASON_4WAY_HANDSHAKE_TIMEOUT 15
+#define SIM_REASON_BEACON_TIMEOUT 200
+#define SIM_REASON_NO_AP_FOUND 201
+#define SIM_REASON_ASSOC_FAIL 203
+
+struct sim_ap {
+  char ssid[33];
+  char pass[65];
+  uint8_t pmk[32]; /* Derived from pass */
+  uint8_t bssid[6];
+  int channel;
+  enum mgos_wifi_auth_mode auth_mode;
+  int rssi;         /* At scenario start */
+  int rssi_per_min; /* Linear drift, dB per minute */
+  int down_at_ms;   /* Outage window, 0 - no outage */
+  int up_at_ms;     /* 0 - never comes back */
+  int fail_pct;     /* Probability of association failure, % */
+  int full_pct;     /* Probability of rejection for lack of room, % */
+  int dhcp_ms;      /* Overrides the scenario's, 0 - use that */
+};
+
+/* Event on the simulator clock, see ubuntu_wifi_sim_set_timer(). */
+struct sim_timer {
+  mgos_timer_id id;
+  int64_t due_us;
+  uint64_t seq;    /* Events due at the same time run in order of arming */
+  int interval_ms; /* Repeat interval, 0 - one-shot */
+  timer_callback cb;
+  void *arg;
+};
+
+struct sim_scenario {
+  int scan_dwell_ms; /* Per channel */
+  int num_channels;
+  int assoc_ms;
+  int handshake_ms; /* Time it takes to detect a wrong key */
+  int pbkdf2_ms;    /* Time it takes to derive PMK from a passphrase */
+  int dhcp_ms;
+  int beacon_timeout_ms;
+  int rssi_noise_db; /* Link RSSI jitter, +/- dB */
+  int fade_pct;      /* Probability of a deep fade in a link RSSI reading */
+  int seed;
+  int num_aps;
+  struct sim_ap *aps;
+};
+
+static struct {
+  struct sim_scenario sc;
+  /* Virtual clock */
+  int64_t now_us;
+  int64_t t0_us; /* Scenario start */
+  struct sim_timer *timers;
+  int num_timers;
+  mgos_timer_id last_timer_id;
+  uint64_t last_timer_seq;
+  mgos_timer_id rt_timer_id; /* Keeps the clock in step with uptime */
+  uint32_t rnd;
+  /* Station */
+  char *ssid, *pass;
+  bool pmk_set; /* pass is a raw PSK */
+  uint8_t pmk[32];
+  bool bssid_set;
+  uint8_t bssid[6];
+  int channel; /* 0 - not specified */
+  const struct sim_ap *cur_ap;
+  bool connected, ip_acquired;
+  int64_t beacon_lost_ms;
+  int64_t link_lost_ms;
+  int64_t ip_lost_ms; /* For dead air accounting, -1 - have IP or never had */
+  bool roaming;       /* Authenticating with a new AP, old link is up */
+  int rssi_thr;       /* Armed RSSI_LOW notification, 0 - none */
+  /* Roaming by the "chip", see mgos_wifi_dev_sta_set_roam_offload() */
+  struct mgos_wifi_roam_offload_params roam;
+  int64_t roam_scan_ms; /* Last background scan */
+  mgos_timer_id op_timer_id; /* Association or DHCP in progress */
+  mgos_timer_id scan_timer_id;
+  uint64_t scan_channels; /* Bit mask, 0 - all */
+  char scan_ssid[33];     /* Empty - any */
+  int scan_ch;            /* Channel the radio is on */
+  int scan_dwell_ms;
+  int scan_num_res;
+  struct mgos_wifi_scan_result *scan_res; /* Channels swept so far */
+  mgos_timer_id tick_timer_id;
+  /* Access point */
+  bool ap_enabled;
+  struct ubuntu_wifi_sim_stats stats;
+} s_sim;
+
+/* clang-format off */
+static const struct {
+  const char *name;
+  const char *json;
+} s_sim_presets[] = {
+    {"basic",
+     "{\"aps\": ["
+     "{\"ssid\": \"SimNet\", \"pass\": \"SimPass123\", "
+     "\"bssid\": \"02:00:00:00:00:01\", \"ch\": 6, \"rssi\": -55}]}"},
+    /* Strongest AP goes down for 40 seconds, a weaker one stays up. */
+    {"ap_reboot",
+     "{\"aps\": ["
+     "{\"ssid\": \"SimNet\", \"pass\": \"SimPass123\", "
+     "\"bssid\": \"02:00:00:00:00:01\", \"ch\": 1, \"rssi\": -50, "
+     "\"down_at\": 20000, \"up_at\": 60000}, "
+     "{\"ssid\": \"SimNet\", \"pass\": \"SimPass123\", "
+     "\"bssid\": \"02:00:00:00:00:02\", \"ch\": 11, \"rssi\": -72}]}"},
+    /* Strongest AP has been misconfigured with a different key. */
+    {"wrong_pass",
+     "{\"aps\": ["
+     "{\"ssid\": \"SimNet\", \"pass\": \"NotSimPass\", "
+     "\"bssid\": \"02:00:00:00:00:01\", \"ch\": 6, \"rssi\": -45}, "
+     "{\"ssid\": \"SimNet\", \"pass\": \"SimPass123\", "
+     "\"bssid\": \"02:00:00:00:00:02\", \"ch\": 1, \"rssi\": -60}, "
+     "{\"ssid\": \"SimNet\", \"pass\": \"SimPass123\", "
+     "\"bssid\": \"02:00:00:00:00:03\", \"ch\": 11, \"rssi\": -65}]}"},
+    /* 50 BSSIDs of the same network plus some foreign ones. */
+    {"dense",
+     "{\"aps\": ["
+     "{\"ssid\": \"SimNet\", \"pass\": \"SimPass123\", "
+     "\"bssid\": \"02:00:00:00:01:00\", \"ch\": 1, \"rssi\": -48, "
+     "\"count\": 50, \"rssi_step\": -1, \"ch_step\": 5, \"fail_pct\": 20}, "
+     "{\"ssid\": \"Neighbour\", \"pass\": \"whatever1\", "
+     "\"bssid\": \"02:00:00:00:02:00\", \"ch\": 3, \"rssi\": -40, "
+     "\"count\": 20, \"rssi_step\": -2, \"ch_step\": 1}]}"},
+    /* Strongest AP is overloaded: sits on a busy channel, often refuses
+     * association and is slow to hand out addresses. */
+    {"overloaded",
+     "{\"aps\": ["
+     "{\"ssid\": \"SimNet\", \"pass\": \"SimPass123\", "
+     "\"bssid\": \"02:00:00:00:00:01\", \"ch\": 6, \"rssi\": -45, "
+     "\"fail_pct\": 60, \"dhcp_ms\": 4000}, "
+     "{\"ssid\": \"SimNet\", \"pass\": \"SimPass123\", "
+     "\"bssid\": \"02:00:00:00:00:02\", \"ch\": 11, \"rssi\": -60}, "
+     "{\"ssid\": \"Neighbour\", \"pass\": \"whatever1\", "
+     "\"bssid\": \"02:00:00:00:02:00\", \"ch\": 6, \"rssi\": -50, "
+     "\"count\": 8, \"rssi_step\": -3}]}"},
+};
+/* clang-format on */
+
+int64_t ubuntu_wifi_sim_uptime_micros(void) {
+  return s_sim.now_us;
+}
+
+int64_t ubuntu_wifi_sim_now_ms(void) {
+  return (s_sim.now_us - s_sim.t0_us) / 1000;
+}
+
+mgos_timer_id ubuntu_wifi_sim_set_timer(int msecs, int flags,
+                                        timer_callback cb, void *arg) {
+  struct sim_timer *timers =
+      realloc(s_sim.timers, (s_sim.num_timers + 1) * sizeof(*timers));
+  if (timers == NULL) return MGOS_INVALID_TIMER_ID;
+  s_sim.timers = timers;
+  struct sim_timer *t = &timers[s_sim.num_timers++];
+  t->id = ++s_sim.last_timer_id;
+  t->due_us = s_sim.now_us;
+  if (!(flags & MGOS_TIMER_RUN_NOW)) t->due_us += (int64_t) msecs * 1000;
+  t->seq = ++s_sim.last_timer_seq;
+  t->interval_ms = ((flags & MGOS_TIMER_REPEAT) ? msecs : 0);
+  t->cb = cb;
+  t->arg = arg;
+  return t->id;
+}
+
+void ubuntu_wifi_sim_clear_timer(mgos_timer_id id) {
+  for (int i = 0; i < s_sim.num_timers; i++) {
+    if (s_sim.timers[i].id != id) continue;
+    s_sim.timers[i] = s_sim.timers[--s_sim.num_timers];
+    return;
+  }
+}
+
+/* Returns index of the event to run next, -1 if there are none. */
+static int sim_next_timer(void) {
+  int next = -1;
+  for (int i = 0; i < s_sim.num_timers; i++) {
+    const struct sim_timer *t = &s_sim.timers[i];
+    if (next < 0 || t->due_us < s_sim.timers[next].due_us ||
+        (t->due_us == s_sim.timers[next].due_us &&
+         t->seq < s_sim.timers[next].seq)) {
+      next = i;
+    }
+  }
+  return next;
+}
+
+void ubuntu_wifi_sim_run(int64_t until_us) {
+  for (;;) {
+    int i = sim_next_timer();
+    if (i < 0 || s_sim.timers[i].due_us > until_us) break;
+    struct sim_timer t = s_sim.timers[i];
+    if (t.due_us > s_sim.now_us) s_sim.now_us = t.due_us;
+    if (t.interval_ms > 0) {
+      s_sim.timers[i].due_us = s_sim.now_us + (int64_t) t.interval_ms * 1000;
+      s_sim.timers[i].seq = ++s_sim.last_timer_seq;
+    } else {
+      s_sim.timers[i] = s_sim.timers[--s_sim.num_timers];
+    }
+    t.cb(t.arg);
+  }
+  if (until_us > s_sim.now_us) s_sim.now_us = until_us;
+}
+
+void ubuntu_wifi_sim_pmk_derived(void) {
+  s_sim.now_us += (int64_t) s_sim.sc.pbkdf2_ms * 1000;
+}
+
+static mgos_timer_id sim_set_timer(int msecs, timer_callback cb) {
+  return ubuntu_wifi_sim_set_timer(msecs, 0, cb, NULL);
+}
+
+/* Firmware builds: the clock follows uptime. */
+static void sim_rt_timer_cb(void *arg) {
+  ubuntu_wifi_sim_run(mgos_uptime_micros());
+  (void) arg;
+}
+
+void ubuntu_wifi_sim_get_stats(struct ubuntu_wifi_sim_stats *stats) {
+  *stats = s_sim.stats;
+}
+
+static uint32_t sim_rand(void) {
+  /* xorshift32, deterministic for a given scenario seed. */
+  uint32_t x = s_sim.rnd;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  s_sim.rnd = x;
+  return x;
+}
+
+static bool sim_ap_is_up(const struct sim_ap *ap, int64_t now) {
+  if (ap->down_at_ms <= 0 || now < ap->down_at_ms) return true;
+  return (ap->up_at_ms > 0 && now >= ap->up_at_ms);
+}
+
+static int sim_ap_rssi(const struct sim_ap *ap, int64_t now) {
+  int rssi = ap->rssi + (int) (ap->rssi_per_min * now / 60000);
+  if (rssi < -100) rssi = -100;
+  if (rssi > -10) rssi = -10;
+  return rssi;
+}
+
+static bool sim_ap_is_visible(const struct sim_ap *ap, int64_t now) {
+  return (sim_ap_is_up(ap, now) && sim_ap_rssi(ap, now) >= SIM_MIN_RSSI);
+}
+
+static void sim_sta_disconnected(int raw_reason) {
+  enum mgos_wifi_disconnect_reason reason;
+  switch (raw_reason) {
+    case SIM_REASON_BEACON_TIMEOUT:
+      reason = MGOS_WIFI_DISCONNECT_REASON_BEACON_TIMEOUT;
+      break;
+    case SIM_REASON_NO_AP_FOUND:
+      reason = MGOS_WIFI_DISCONNECT_REASON_NO_AP_FOUND;
+      break;
+    case SIM_REASON_ASSOC_FAIL:
+      reason = MGOS_WIFI_DISCONNECT_REASON_ASSOC_FAIL;
+      break;
+    default:
+      reason = mgos_wifi_ieee80211_disconnect_reason(raw_reason);
+  }
+  /* Like ESP32, see mgos_wifi_dev_sta_roam(). */
+  if (s_sim.roaming && raw_reason == SIM_REASON_ASSOC_LEAVE) {
+    reason = MGOS_WIFI_DISCONNECT_REASON_ROAM;
+  }
+  struct mgos_wifi_dev_event_info dei = {
+      .ev = MGOS_WIFI_EV_STA_DISCONNECTED,
+      .sta_disconnected =
+          {
+              .reason = reason,
+              .raw_reason = raw_reason,
+          },
+  };
+  mgos_wifi_dev_event_cb(&dei);
+}
+
+static void sim_sta_drop_link(void) {
+  ubuntu_wifi_sim_clear_timer(s_sim.op_timer_id);
+  s_sim.op_timer_id = MGOS_INVALID_TIMER_ID;
+  if (s_sim.ip_acquired) s_sim.ip_lost_ms = ubuntu_wifi_sim_now_ms();
+  s_sim.connected = s_sim.ip_acquired = s_sim.roaming = false;
+  s_sim.rssi_thr = 0;
+  s_sim.cur_ap = NULL;
+  s_sim.beacon_lost_ms = -1;
+}
+
+static void sim_report(const char *what) {
+  const struct ubuntu_wifi_sim_stats *st = &s_sim.stats;
+  if (!mgos_sys_config_get_wifi_sim_report()) return;
+  LOG(LL_INFO, ("SIM: %s at %lld ms: scans %d, attempts %d, links lost %d, "
+                "time to IP %lld ms, failover %lld ms (max %lld ms), "
+                "roams %d, dead air %lld ms, RSSI reads %d",
+                what, (long long) ubuntu_wifi_sim_now_ms(), st->num_scans,
+                st->num_attempts, st->num_links_lost,
+                (long long) st->first_ip_ms, (long long) st->last_failover_ms,
+                (long long) st->max_failover_ms, st->num_roams,
+                (long long) st->dead_air_ms, st->num_rssi_reads));
+}
+
+static void sim_dhcp_timer_cb(void *arg) {
+  int64_t now = ubuntu_wifi_sim_now_ms();
+  struct ubuntu_wifi_sim_stats *st = &s_sim.stats;
+  s_sim.op_timer_id = MGOS_INVALID_TIMER_ID;
+  s_sim.ip_acquired = true;
+  if (st->first_ip_ms < 0) st->first_ip_ms = now;
+  if (s_sim.ip_lost_ms >= 0) {
+    st->dead_air_ms += now - s_sim.ip_lost_ms;
+    s_sim.ip_lost_ms = -1;
+  }
+  if (s_sim.link_lost_ms >= 0) {
+    st->last_failover_ms = now - s_sim.link_lost_ms;
+    if (st->last_failover_ms > st->max_failover_ms) {
+      st->max_failover_ms = st->last_failover_ms;
+    }
+    s_sim.link_lost_ms = -1;
+  }
+  sim_report("IP acquired");
+  struct mgos_wifi_dev_event_info dei = {
+      .ev = MGOS_WIFI_EV_STA_IP_ACQUIRED,
+  };
+  mgos_wifi_dev_event_cb(&dei);
+  (void) arg;
+}
+
+static void sim_handshake_fail_timer_cb(void *arg) {
+  s_sim.op_timer_id = MGOS_INVALID_TIMER_ID;
+  sim_sta_drop_link();
+  sim_sta_disconnected(SIM_REASON_4WAY_HANDSHAKE_TIMEOUT);
+  (void) arg;
+}
+
+static const struct sim_ap *sim_find_ap(int64_t now) {
+  const struct sim_ap *best = NULL;
+  for (int i = 0; i < s_sim.sc.num_aps; i++) {
+    const struct sim_ap *ap = &s_sim.sc.aps[i];
+    if (strcmp(ap->ssid, s_sim.ssid) != 0) continue;
+    if (s_sim.bssid_set && memcmp(ap->bssid, s_sim.bssid, 6) != 0) continue;
+    if (s_sim.channel > 0 && ap->channel != s_sim.channel) continue;
+    if (!sim_ap_is_visible(ap, now)) continue;
+    if (best == NULL || sim_ap_rssi(ap, now) > sim_ap_rssi(best, now)) {
+      best = ap;
+    }
+  }
+  return best;
+}
+
+static void sim_assoc_timer_cb(void *arg) {
+  int64_t now = ubuntu_wifi_sim_now_ms();
+  s_sim.op_timer_id = MGOS_INVALID_TIMER_ID;
+  const struct sim_ap *ap = sim_find_ap(now);
+  if (ap == NULL) {
+    sim_sta_drop_link();
+    sim_sta_disconnected(SIM_REASON_NO_AP_FOUND);
+    return;
+  }
+  bool key_ok = (s_sim.pmk_set ? memcmp(ap->pmk, s_sim.pmk, 32) == 0
+                               : (s_sim.pass != NULL &&
+                                  strcmp(ap->pass, s_sim.pass) == 0));
+  if (ap->auth_mode != MGOS_WIFI_AUTH_MODE_OPEN && !key_ok) {
+    s_sim.op_timer_id =
+        sim_set_timer(s_sim.sc.handshake_ms, sim_handshake_fail_timer_cb);
+    return;
+  }
+  if (ap->fail_pct > 0 && (int) (sim_rand() % 100) < ap->fail_pct) {
+    sim_sta_drop_link();
+    sim_sta_disconnected(SIM_REASON_ASSOC_FAIL);
+    return;
+  }
+  if (ap->full_pct > 0 && (int) (sim_rand() % 100) < ap->full_pct) {
+    sim_sta_drop_link();
+    sim_sta_disconnected(SIM_REASON_ASSOC_TOOMANY);
+    return;
+  }
+  bool roamed = s_sim.roaming;
+  s_sim.roaming = false;
+  s_sim.cur_ap = ap;
+  s_sim.connected = true;
+  s_sim.beacon_lost_ms = -1;
+  struct mgos_wifi_dev_event_info dei = {
+      .ev = MGOS_WIFI_EV_STA_CONNECTED,
+      .sta_connected =
+          {
+              .channel = ap->channel,
+          },
+  };
+  memcpy(dei.sta_connected.bssid, ap->bssid, 6);
+  mgos_wifi_dev_event_cb(&dei);
+  if (roamed) {
+    s_sim.stats.num_roams++;
+    sim_report("Roamed");
+  }
+  if (roamed && !mgos_sys_config_get_wifi_sim_roam_bbm()) {
+    /* Same network, the lease is still good. */
+    dei.ev = MGOS_WIFI_EV_STA_IP_ACQUIRED;
+    mgos_wifi_dev_event_cb(&dei);
+    return;
+  }
+  s_sim.op_timer_id = sim_set_timer(
+      (ap->dhcp_ms > 0 ? ap->dhcp_ms : s_sim.sc.dhcp_ms), sim_dhcp_timer_cb);
+  (void) arg;
+}
+
+/*
+ * Background scan by the "chip" while signal is low: moves to the strongest
+ * AP of the same network if it is better by the hysteresis.
+ */
+static void sim_roam_check(int rssi, int64_t now) {
+  const struct sim_ap *best = NULL;
+  if (!s_sim.roam.enable || !s_sim.ip_acquired || s_sim.roaming ||
+      rssi >= s_sim.roam.rssi_thr ||
+      now - s_sim.roam_scan_ms < s_sim.roam.scan_interval_s * 1000) {
+    return;
+  }
+  s_sim.roam_scan_ms = now;
+  s_sim.stats.num_scans++;
+  for (int i = 0; i < s_sim.sc.num_aps; i++) {
+    const struct sim_ap *ap = &s_sim.sc.aps[i];
+    if (ap == s_sim.cur_ap || strcmp(ap->ssid, s_sim.cur_ap->ssid) != 0 ||
+        !sim_ap_is_visible(ap, now)) {
+      continue;
+    }
+    if (best == NULL || sim_ap_rssi(ap, now) > sim_ap_rssi(best, now)) {
+      best = ap;
+    }
+  }
+  if (best == NULL || sim_ap_rssi(best, now) < rssi + s_sim.roam.hyst_db) {
+    return;
+  }
+  s_sim.cur_ap = best;
+  s_sim.stats.num_roams++;
+  sim_report("Roamed by itself");
+  struct mgos_wifi_dev_event_info dei = {
+      .ev = MGOS_WIFI_EV_STA_ROAMED,
+      .sta_roamed =
+          {
+              .channel = best->channel,
+              .rssi = sim_ap_rssi(best, now),
+          },
+  };
+  memcpy(dei.sta_roamed.bssid, best->bssid, 6);
+  mgos_wifi_dev_event_cb(&dei);
+}
+
+/* Advances the RF model: detects loss of the AP we are associated with. */
+static void sim_tick_timer_cb(void *arg) {
+  int64_t now = ubuntu_wifi_sim_now_ms();
+  if (!s_sim.connected) return;
+  if (sim_ap_is_visible(s_sim.cur_ap, now)) {
+    s_sim.beacon_lost_ms = -1;
+    int rssi = sim_ap_rssi(s_sim.cur_ap, now);
+    sim_roam_check(rssi, now);
+    if (s_sim.rssi_thr != 0 && rssi < s_sim.rssi_thr) {
+      struct mgos_wifi_dev_event_info dei = {
+          .ev = MGOS_WIFI_EV_STA_RSSI_LOW,
+          .sta_rssi_low = {.rssi = rssi},
+      };
+      s_sim.rssi_thr = 0;
+      mgos_wifi_dev_event_cb(&dei);
+    }
+    return;
+  }
+  if (s_sim.beacon_lost_ms < 0) s_sim.beacon_lost_ms = now;
+  if (now - s_sim.beacon_lost_ms < s_sim.sc.beacon_timeout_ms) return;
+  if (s_sim.ip_acquired) s_sim.link_lost_ms = s_sim.beacon_lost_ms;
+  s_sim.stats.num_links_lost++;
+  sim_sta_drop_link();
+  /* Traffic stopped when beacons did. */
+  if (s_sim.link_lost_ms >= 0) s_sim.ip_lost_ms = s_sim.link_lost_ms;
+  sim_report("Link lost");
+  sim_sta_disconnected(SIM_REASON_BEACON_TIMEOUT);
+  (void) arg;
+}
+
+static bool sim_parse_bssid(const char *s, uint8_t *bssid) {
+  unsigned int b[6];
+  if (s == NULL || sscanf(s, "%02x:%02x:%02x:%02x:%02x:%02x", &b[0], &b[1],
+                          &b[2], &b[3], &b[4], &b[5]) != 6) {
+    return false;
+  }
+  for (int i = 0; i < 6; i++) bssid[i] = b[i];
+  return true;
+}
+
+static bool sim_parse_ap(const struct json_token *t, struct sim_scenario *sc) {
+  bool res = false;
+  char *ssid = NULL, *pass = NULL, *bssid = NULL;
+  struct sim_ap ap = {.channel = 6, .rssi = -60};
+  int count = 1, rssi_step = 0, ch_step = 0;
+  json_scanf(t->ptr, t->len,
+             "{ssid: %Q, pass: %Q, bssid: %Q, ch: %d, rssi: %d, "
+             "rssi_per_min: %d, down_at: %d, up_at: %d, fail_pct: %d, "
+             "full_pct: %d, dhcp_ms: %d, count: %d, rssi_step: %d, "
+             "ch_step: %d}",
+             &ssid, &pass, &bssid, &ap.channel, &ap.rssi, &ap.rssi_per_min,
+             &ap.down_at_ms, &ap.up_at_ms, &ap.fail_pct, &ap.full_pct,
+             &ap.dhcp_ms, &count, &rssi_step, &ch_step);
+  if (ssid == NULL || strlen(ssid) >= sizeof(ap.ssid) ||
+      !sim_parse_bssid(bssid, ap.bssid) || count < 1 ||
+      (pass != NULL && strlen(pass) >= sizeof(ap.pass))) {
+    LOG(LL_ERROR, ("SIM: invalid AP entry %.*s", t->len, t->ptr));
+    goto out;
+  }
+  strcpy(ap.ssid, ssid);
+  if (!mgos_conf_str_empty(pass)) {
+    strcpy(ap.pass, pass);
+    mgos_wifi_sta_derive_pmk(ap.ssid, ap.pass, ap.pmk);
+    ap.auth_mode = MGOS_WIFI_AUTH_MODE_WPA2_PSK;
+  } else {
+    ap.auth_mode = MGOS_WIFI_AUTH_MODE_OPEN;
+  }
+  struct sim_ap *aps =
+      realloc(sc->aps, (sc->num_aps + count) * sizeof(*sc->aps));
+  if (aps == NULL) goto out;
+  sc->aps = aps;
+  for (int i = 0; i < count; i++) {
+    struct sim_ap *ape = &sc->aps[sc->num_aps++];
+    *ape = ap;
+    ape->bssid[4] += (i >> 8);
+    ape->bssid[5] += (i & 0xff);
+    ape->rssi += i * rssi_step;
+    ape->channel = ((ap.channel - 1 + i * ch_step) % sc->num_channels) + 1;
+  }
+  res = true;
+out:
+  free(ssid);
+  free(pass);
+  free(bssid);
+  return res;
+}
+
+static bool sim_parse_scenario(const char *json, struct sim_scenario *sc) {
+  int len = strlen(json);
+  struct json_token t;
+  memset(sc, 0, sizeof(*sc));
+  sc->scan_dwell_ms = 120;
+  sc->num_channels = 13;
+  sc->assoc_ms = 150;
+  sc->handshake_ms = 2000;
+  sc->pbkdf2_ms = 1500;
+  sc->dhcp_ms = 500;
+  sc->beacon_timeout_ms = 6000;
+  sc->seed = 1;
+  json_scanf(json, len,
+             "{scan_dwell_ms: %d, num_channels: %d, assoc_ms: %d, "
+             "handshake_ms: %d, pbkdf2_ms: %d, dhcp_ms: %d, "
+             "beacon_timeout_ms: %d, rssi_noise_db: %d, fade_pct: %d, "
+             "seed: %d}",
+             &sc->scan_dwell_ms, &sc->num_channels, &sc->assoc_ms,
+             &sc->handshake_ms, &sc->pbkdf2_ms, &sc->dhcp_ms,
+             &sc->beacon_timeout_ms, &sc->rssi_noise_db, &sc->fade_pct,
+             &sc->seed);
+  if (sc->num_channels < 1) sc->num_channels = 1;
+  for (int i = 0; json_scanf_array_elem(json, len, ".aps", i, &t) > 0; i++) {
+    if (!sim_parse_ap(&t, sc)) {
+      free(sc->aps);
+      sc->aps = NULL;
+      sc->num_aps = 0;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ubuntu_wifi_sim_load(const char *scenario) {
+  char *json_file = NULL;
+  const char *json = NULL;
+  struct sim_scenario sc;
+  if (mgos_conf_str_empty(scenario)) scenario = "basic";
+  for (int i = 0; i < (int) ARRAY_SIZE(s_sim_presets); i++) {
+    if (strcmp(s_sim_presets[i].name, scenario) == 0) {
+      json = s_sim_presets[i].json;
+      break;
+    }
+  }
+  if (json == NULL) json = json_file = json_fread(scenario);
+  if (json == NULL) {
+    LOG(LL_ERROR, ("SIM: failed to read %s", scenario));
+    return false;
+  }
+  bool res = sim_parse_scenario(json, &sc);
+  free(json_file);
+  if (!res) return false;
+  sim_sta_drop_link();
+  ubuntu_wifi_sim_clear_timer(s_sim.scan_timer_id);
+  s_sim.scan_timer_id = MGOS_INVALID_TIMER_ID;
+  free(s_sim.scan_res);
+  s_sim.scan_res = NULL;
+  s_sim.scan_num_res = 0;
+  free(s_sim.sc.aps);
+  s_sim.sc = sc;
+  s_sim.rnd = (sc.seed != 0 ? (uint32_t) sc.seed : 1);
+  s_sim.t0_us = s_sim.now_us;
+  s_sim.link_lost_ms = s_sim.ip_lost_ms = -1;
+  memset(&s_sim.stats, 0, sizeof(s_sim.stats));
+  s_sim.stats.first_ip_ms = s_sim.stats.last_failover_ms = -1;
+  LOG(LL_INFO, ("SIM: scenario %s, %d APs", scenario, sc.num_aps));
+  return true;
+}
+
+bool mgos_wifi_dev_ap_setup(const struct mgos_config_wifi_ap *cfg) {
+  s_sim.ap_enabled = cfg->enable;
+  if (cfg->enable) {
+    LOG(LL_INFO, ("SIM: AP %s, channel %d", cfg->ssid, cfg->channel));
+  }
+  return true;
+}
+
+static bool sim_sta_set_target(const struct mgos_config_wifi_sta *cfg) {
+  free(s_sim.ssid);
+  free(s_sim.pass);
+  s_sim.ssid = s_sim.pass = NULL;
+  s_sim.bssid_set = false;
+  s_sim.channel = 0;
+  if (!cfg->enable) return true;
+  if (!mgos_conf_str_empty(cfg->bssid)) {
+    if (!sim_parse_bssid(cfg->bssid, s_sim.bssid)) {
+      LOG(LL_ERROR, ("Invalid BSSID!"));
+      return false;
+    }
+    s_sim.bssid_set = true;
+  }
+  if (cfg->channel > 0 && cfg->channel <= s_sim.sc.num_channels) {
+    s_sim.channel = cfg->channel;
+  }
+  s_sim.ssid = strdup(cfg->ssid);
+  if (!mgos_conf_str_empty(cfg->pass)) s_sim.pass = strdup(cfg->pass);
+  /* Like the real drivers, treat 64 hex digits as a raw PSK. */
+  s_sim.pmk_set = (s_sim.pass != NULL && strlen(s_sim.pass) == 64);
+  for (int i = 0; s_sim.pmk_set && i < 32; i++) {
+    unsigned int b;
+    if (sscanf(s_sim.pass + i * 2, "%2x", &b) != 1) {
+      s_sim.pmk_set = false;
+      break;
+    }
+    s_sim.pmk[i] = b;
+  }
+  return true;
+}
+
+bool mgos_wifi_dev_sta_setup(const struct mgos_config_wifi_sta *cfg) {
+  mgos_wifi_dev_sta_disconnect();
+  return sim_sta_set_target(cfg);
+}
+
+static int sim_assoc_time_ms(void) {
+  /* Like the real drivers, sweep all channels looking for the AP first,
+   * unless told which one to use. */
+  int delay_ms = s_sim.sc.assoc_ms;
+  if (s_sim.channel == 0) {
+    delay_ms += s_sim.sc.num_channels * s_sim.sc.scan_dwell_ms;
+  }
+  /* And derive the PMK, unless given one. */
+  if (s_sim.pass != NULL && !s_sim.pmk_set) delay_ms += s_sim.sc.pbkdf2_ms;
+  return delay_ms;
+}
+
+void mgos_wifi_dev_get_caps(struct mgos_wifi_dev_caps *caps) {
+  caps->flags = MGOS_WIFI_CAP_DIRECTED_SCAN | MGOS_WIFI_CAP_SCAN_CHANNELS |
+                MGOS_WIFI_CAP_SCAN_PARTIAL | MGOS_WIFI_CAP_BG_SCAN |
+                MGOS_WIFI_CAP_PMK | MGOS_WIFI_CAP_RSSI_EVENTS |
+                MGOS_WIFI_CAP_ROAM | MGOS_WIFI_CAP_AP_STA;
+  if (mgos_sys_config_get_wifi_sim_roam_offload()) {
+    caps->flags |= MGOS_WIFI_CAP_ROAM_OFFLOAD;
+  }
+  /* Model a less capable chip. */
+  caps->flags &= ~((uint32_t) mgos_sys_config_get_wifi_sim_caps_off());
+  caps->max_scan_results = mgos_sys_config_get_wifi_sim_max_scan_results();
+  caps->max_scan_channels = 0;
+}
+
+bool mgos_wifi_dev_sta_connect(void) {
+  if (s_sim.ssid == NULL) return false;
+  sim_sta_drop_link();
+  s_sim.stats.num_attempts++;
+  s_sim.op_timer_id = sim_set_timer(sim_assoc_time_ms(), sim_assoc_timer_cb);
+  return true;
+}
+
+bool mgos_wifi_dev_sta_disconnect(void) {
+  bool was_connected = s_sim.connected;
+  sim_sta_drop_link();
+  if (was_connected) sim_sta_disconnected(SIM_REASON_ASSOC_LEAVE);
+  return true;
+}
+
+/*
+ * Models make-before-break: the old link stays up while the new AP is
+ * authenticated, then traffic moves over and the lease is kept. With
+ * `wifi.sim.roam_bbm` it is what ESP32 does instead: the current AP is left
+ * first, the new one is associated with on the known channel and DHCP runs
+ * again.
+ */
+bool mgos_wifi_dev_sta_roam(const struct mgos_config_wifi_sta *cfg) {
+  if (!s_sim.ip_acquired || s_sim.op_timer_id != MGOS_INVALID_TIMER_ID ||
+      s_sim.ssid == NULL || strcmp(cfg->ssid, s_sim.ssid) != 0) {
+    return false;
+  }
+  if (!sim_sta_set_target(cfg)) return false;
+  if (mgos_sys_config_get_wifi_sim_roam_bbm()) {
+    sim_sta_drop_link();
+    s_sim.roaming = true;
+    sim_sta_disconnected(SIM_REASON_ASSOC_LEAVE);
+  }
+  s_sim.roaming = true;
+  s_sim.stats.num_attempts++;
+  s_sim.op_timer_id = sim_set_timer(sim_assoc_time_ms(), sim_assoc_timer_cb);
+  return true;
+}
+
+bool mgos_wifi_dev_sta_set_roam_offload(
+    const struct mgos_wifi_roam_offload_params *params) {
+  memset(&s_sim.roam, 0, sizeof(s_sim.roam));
+  if (!params->enable || !mgos_sys_config_get_wifi_sim_roam_offload()) {
+    return false;
+  }
+  s_sim.roam = *params;
+  return true;
+}
+
+bool mgos_wifi_dev_get_ip_info(int if_instance,
+                               struct mgos_net_ip_info *ip_info) {
+  switch (if_instance) {
+    case MGOS_NET_IF_WIFI_STA: {
+      if (!s_sim.ip_acquired) return false;
+      return (mgos_net_str_to_ip("10.0.0.100", &ip_info->ip) &&
+              mgos_net_str_to_ip("255.255.255.0", &ip_info->netmask) &&
+              mgos_net_str_to_ip("10.0.0.1", &ip_info->gw));
+    }
+    case MGOS_NET_IF_WIFI_AP: {
+      const struct mgos_config_wifi_ap *cfg = mgos_sys_config_get_wifi_ap();
+      if (!s_sim.ap_enabled) return false;
+      return (mgos_net_str_to_ip(cfg->ip, &ip_info->ip) &&
+              mgos_net_str_to_ip(cfg->netmask, &ip_info->netmask) &&
+              (mgos_conf_str_empty(cfg->gw) ||
+               mgos_net_str_to_ip(cfg->gw, &ip_info->gw)));
+    }
+  }
+  return false;
+}
+
+char *mgos_wifi_get_sta_default_dns_r(char *buf, size_t len) {
+  const char *dns = "10.0.0.1";
+  if (!s_sim.ip_acquired || strlen(dns) >= len) return NULL;
+  return strcpy(buf, dns);
+}
+
+bool mgos_wifi_dev_sta_set_rssi_thr(int rssi_thr) {
+  s_sim.rssi_thr = rssi_thr;
+  return true;
+}
+
+int mgos_wifi_sta_get_rssi(void) {
+  if (!s_sim.connected) return 0;
+  s_sim.stats.num_rssi_reads++;
+  int rssi = sim_ap_rssi(s_sim.cur_ap, ubuntu_wifi_sim_now_ms());
+  int noise = s_sim.sc.rssi_noise_db;
+  if (noise > 0) rssi += (int) (sim_rand() % (2 * noise + 1)) - noise;
+  if (s_sim.sc.fade_pct > 0 && (int) (sim_rand() % 100) < s_sim.sc.fade_pct) {
+    rssi -= SIM_FADE_DB;
+  }
+  return (rssi < -100 ? -100 : rssi);
+}
+
+static bool sim_scan_has_channel(int ch) {
+  if (s_sim.scan_channels == 0) return (ch >= 1 && ch <= s_sim.sc.num_channels);
+  return (ch >= 0 && ch < 64 && (s_sim.scan_channels & (1ULL << ch)));
+}
+
+static bool sim_ap_is_scanned(const struct sim_ap *ap, int ch, int64_t now) {
+  bool on_ch = (ap->channel == ch);
+  if (!sim_ap_is_visible(ap, now)) return false;
+  /* APs outside the regulatory range are picked up on the last channel. */
+  if (s_sim.scan_channels == 0 && ch == s_sim.sc.num_channels &&
+      ap->channel > ch) {
+    on_ch = true;
+  }
+  if (!on_ch) return false;
+  return (s_sim.scan_ssid[0] == '\0' || strcmp(ap->ssid, s_sim.scan_ssid) == 0);
+}
+
+/* Returns the next channel to sweep, 0 - done. */
+static int sim_scan_next_channel(int ch) {
+  while (++ch < 64) {
+    if (sim_scan_has_channel(ch)) return ch;
+  }
+  return 0;
+}
+
+static void sim_scan_done(int num_res) {
+  struct mgos_wifi_scan_result *res = s_sim.scan_res;
+  ubuntu_wifi_sim_clear_timer(s_sim.scan_timer_id);
+  s_sim.scan_timer_id = MGOS_INVALID_TIMER_ID;
+  s_sim.scan_res = NULL;
+  s_sim.scan_num_res = 0;
+  if (num_res < 0) {
+    free(res);
+    res = NULL;
+  }
+  /* Chip's result list is full, the rest are dropped. */
+  int max_res = mgos_sys_config_get_wifi_sim_max_scan_results();
+  if (max_res > 0 && num_res > max_res) num_res = max_res;
+  mgos_wifi_dev_scan_cb(num_res, res);
+}
+
+/* Radio is done with the current channel. */
+static void sim_scan_timer_cb(void *arg) {
+  int64_t now = ubuntu_wifi_sim_now_ms();
+  int ch = s_sim.scan_ch, num_res = 0;
+  s_sim.scan_timer_id = MGOS_INVALID_TIMER_ID;
+  for (int i = 0; i < s_sim.sc.num_aps; i++) {
+    if (sim_ap_is_scanned(&s_sim.sc.aps[i], ch, now)) num_res++;
+  }
+  struct mgos_wifi_scan_result *ch_res = NULL; /* Found on this channel */
+  if (num_res > 0) {
+    struct mgos_wifi_scan_result *res = realloc(
+        s_sim.scan_res, (s_sim.scan_num_res + num_res) * sizeof(*res));
+    if (res == NULL) {
+      sim_scan_done(-1);
+      return;
+    }
+    s_sim.scan_res = res;
+    ch_res = res + s_sim.scan_num_res;
+  }
+  for (int i = 0, j = 0; i < s_sim.sc.num_aps && j < num_res; i++) {
+    const struct sim_ap *ap = &s_sim.sc.aps[i];
+    struct mgos_wifi_scan_result *r = &ch_res[j];
+    if (!sim_ap_is_scanned(ap, ch, now)) continue;
+    memset(r, 0, sizeof(*r));
+    strcpy(r->ssid, ap->ssid);
+    memcpy(r->bssid, ap->bssid, sizeof(r->bssid));
+    r->auth_mode = ap->auth_mode;
+    r->channel = ap->channel;
+    r->rssi = sim_ap_rssi(ap, now);
+    j++;
+  }
+  s_sim.scan_num_res += num_res;
+  bool stop = mgos_wifi_dev_scan_partial_cb(num_res, ch_res);
+  s_sim.scan_ch = sim_scan_next_channel(ch);
+  if (stop || s_sim.scan_ch == 0) {
+    sim_scan_done(s_sim.scan_num_res);
+    return;
+  }
+  /* Traffic stalls while the radio is off the home channel. */
+  if (s_sim.ip_acquired) s_sim.stats.dead_air_ms += s_sim.scan_dwell_ms;
+  s_sim.scan_timer_id = sim_set_timer(s_sim.scan_dwell_ms, sim_scan_timer_cb);
+  (void) arg;
+}
+
+bool mgos_wifi_dev_start_scan(const struct mgos_wifi_scan_params *params) {
+  if (s_sim.scan_timer_id != MGOS_INVALID_TIMER_ID) return false;
+  s_sim.scan_dwell_ms =
+      (params->dwell_ms > 0 ? params->dwell_ms : s_sim.sc.scan_dwell_ms);
+  s_sim.scan_channels = 0;
+  for (int i = 0; i < params->num_channels; i++) {
+    s_sim.scan_channels |= (1ULL << (params->channels[i] & 63));
+  }
+  s_sim.scan_ssid[0] = '\0';
+  if (params->ssid != NULL) {
+    strncpy(s_sim.scan_ssid, params->ssid, sizeof(s_sim.scan_ssid) - 1);
+  }
+  s_sim.stats.num_scans++;
+  /* Radio sweeps the channels one by one, reporting as it goes. */
+  s_sim.scan_ch = sim_scan_next_channel(0);
+  if (s_sim.scan_ch == 0) {
+    sim_scan_done(0);
+    return true;
+  }
+  if (s_sim.ip_acquired) s_sim.stats.dead_air_ms += s_sim.scan_dwell_ms;
+  s_sim.scan_timer_id = sim_set_timer(s_sim.scan_dwell_ms, sim_scan_timer_cb);
+  return true;
+}
+
+void mgos_wifi_dev_init(void) {
+  if (mgos_sys_config_get_wifi_sim_realtime()) {
+    s_sim.now_us = mgos_uptime_micros();
+    s_sim.rt_timer_id = mgos_set_timer(SIM_TICK_MS, MGOS_TIMER_REPEAT,
+                                       sim_rt_timer_cb, NULL);
+  }
+  ubuntu_wifi_sim_load(mgos_sys_config_get_wifi_sim_scenario());
+  s_sim.tick_timer_id = ubuntu_wifi_sim_set_timer(
+      SIM_TICK_MS, MGOS_TIMER_REPEAT, sim_tick_timer_cb, NULL);
+}
+
+void mgos_wifi_dev_deinit(void) {
+  sim_sta_drop_link();
+  ubuntu_wifi_sim_clear_timer(s_sim.scan_timer_id);
+  s_sim.scan_timer_id = MGOS_INVALID_TIMER_ID;
+  free(s_sim.scan_res);
+  s_sim.scan_res = NULL;
+  s_sim.scan_num_res = 0;
+  ubuntu_wifi_sim_clear_timer(s_sim.tick_timer_id);
+  s_sim.tick_timer_id = MGOS_INVALID_TIMER_ID;
+  mgos_clear_timer(s_sim.rt_timer_id);
+  s_sim.rt_timer_id = MGOS_INVALID_TIMER_ID;
+}
@@ -0,0 +1,277 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) Mongoose OS Contributors
+# All rights reserved
+#
+# Licensed under the Apache License, Version 2.0 (the ""License"");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an ""AS IS"" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Generates mgos_sys_config.{h,c} for host builds from the config_schema of
+# mos.yml, the way mos does for firmware: one struct per object, accessors,
+# copy / free / defaults helpers and a parser for flat objects. Also emits
+# host_sys_config_set() so that the runner can override any setting by name.
+#
+# Usage: gen_sys_config.py mos.yml platform out_dir
+
+import collections
+import os
+import sys
+
+import yaml
+
+C_TYPES = {"b": "bool", "i": "int", "s": "const char *", "d": "double",
+           "f": "float"}
+SCANF_FMT = {"b": "%B", "i": "%d", "s": "%Q", "d": "%lf", "f": "%f"}
+
+
+def load_schema(mos_yml, platform):
+    with open(mos_yml) as f:
+        y = yaml.safe_load(f)
+    # Core settings the library reads.
+    schema = [["device", "o"], ["device.id", "s", ""]]
+    schema += y.get("config_schema", [])
+    for cond in y.get("conds", []):
+        if cond["when"].replace(" ", "") == 'mos.platform=="%s"' % platform:
+            schema += cond["apply"].get("config_schema", [])
+    return schema
+
+
+def build_tree(schema):
+    # path -> {"t": type, "d": default} or {"t": "o", "type": type path}
+    nodes = collections.OrderedDict()
+    for e in schema:
+        path, kind = e[0], e[1] if len(e) > 1 else None
+        if kind == "o":
+            nodes[path] = {"t": "o", "type": path}
+        elif kind in C_TYPES:
+            dflt = e[2] if len(e) > 2 and not isinstance(e[2], dict) else None
+            nodes[path] = {"t": kind, "d": dflt}
+        elif isinstance(kind, str) and nodes.get(kind, {}).get("t") == "o":
+            # Same type as another object, e.g. wifi.sta1 is a wifi.sta.
+            nodes[path] = {"t": "o", "type": nodes[kind]["type"]}
+            for p in list(nodes.keys()):
+                if p.startswith(kind + "."):
+                    nodes[path + p[len(kind):]] = dict(nodes[p])
+        elif path in nodes:
+            # Default override.
+            nodes[path] = dict(nodes[path], d=kind)
+    return nodes
+
+
+def children(nodes, path):
+    prefix = path + "." if path else ""
+    return [p for p in nodes
+            if p.startswith(prefix) and "." not in p[len(prefix):]]
+
+
+def struct_name(nodes, path):
+    if not path:
+        return "mgos_config"
+    return "mgos_config_" + nodes[path]["type"].replace(".", "_")
+
+
+def c_str(s):
+    return '"%s"' % str(s).replace("\\", "\\\\").replace('"', '\\"')
+
+
+def c_value(t, v):
+    if t == "s":
+        return c_str(v)
+    if t == "b":
+        return "true" if v else "false"
+    return str(v)
+
+
+def main():
+    mos_yml, platform, out_dir = sys.argv[1:4]
+    nodes = build_tree(load_schema(mos_yml, platform))
+    h, c = [], []
+    h.append("/* Generated by gen_sys_config.py from %s, do not edit. */" %
+             os.path.basename(mos_yml))
+    h.append("#pragma once\n")
+    h.append("#include <stdbool.h>\n")
+    h.append('#include "common/mg_str.h"')
+    h.append('#include "mgos_config_util.h"\n')
+    c.append("/* Generated by gen_sys_config.py, do not edit. */")
+    c.append("#include <stddef.h>")
+    c.append("#include <stdlib.h>")
+    c.append("#include <string.h>\n")
+    c.append('#include "frozen.h"')
+    c.append('#include "mgos_sys_config.h"\n')
+    c.append("struct mgos_config mgos_sys_config;\n")
+
+    done = set()
+
+    def emit(path):
+        name = struct_name(nodes, path)
+        kids = children(nodes, path)
+        for k in kids:
+            if nodes[k]["t"] == "o":
+                emit(k)
+        if name in done:
+            return
+        done.add(name)
+        h.append("struct %s {" % name)
+        for k in kids:
+            field = k.split(".")[-1]
+            if nodes[k]["t"] == "o":
+                h.append("  struct %s %s;" % (struct_name(nodes, k), field))
+            else:
+                h.append("  %s%s%s;" % (C_TYPES[nodes[k]["t"]],
+                                        "" if nodes[k]["t"] == "s" else " ",
+                                        field))
+        h.append("};")
+        h.append("void %s_set_defaults(struct %s *cfg);" % (name, name))
+        h.append("bool %s_copy(const struct %s *src, struct %s *dst);" %
+                 (name, name, name))
+        h.append("void %s_free(struct %s *cfg);" % (name, name))
+        leaf_only = all(nodes[k]["t"] != "o" for k in kids)
+        if leaf_only:
+            h.append("bool %s_parse(struct mg_str json, struct %s *cfg);" %
+                     (name, name))
+        h.append("")
+
+        # Defaults and free walk the fields, copy is a struct copy with the
+        # strings duplicated.
+        c.append("void %s_set_defaults(struct %s *cfg) {" % (name, name))
+        c.append("  memset(cfg, 0, sizeof(*cfg));")
+        for k in kids:
+            field, n = k.split(".")[-1], nodes[k]
+            if n["t"] == "o":
+                c.append("  %s_set_defaults(&cfg->%s);" %
+                         (struct_name(nodes, k), field))
+            elif n.get("d") is not None:
+                if n["t"] == "s":
+                    c.append("  mgos_conf_set_str(&cfg->%s, %s);" %
+                             (field, c_str(n["d"])))
+                else:
+                    c.append("  cfg->%s = %s;" % (field,
+                                                  c_value(n["t"], n["d"])))
+        c.append("}\n")
+        c.append("bool %s_copy(const struct %s *src, struct %s *dst) {" %
+                 (name, name, name))
+        c.append("  *dst = *src;")
+        for k in kids:
+            field, n = k.split(".")[-1], nodes[k]
+            if n["t"] == "o":
+                c.append("  %s_copy(&src->%s, &dst->%s);" %
+                         (struct_name(nodes, k), field, field))
+            elif n["t"] == "s":
+                c.append("  dst->%s = NULL;" % field)
+                c.append("  mgos_conf_set_str(&dst->%s, src->%s);" %
+                         (field, field))
+        c.append("  return true;")
+        c.append("}\n")
+        c.append("void %s_free(struct %s *cfg) {" % (name, name))
+        for k in kids:
+            field, n = k.split(".")[-1], nodes[k]
+            if n["t"] == "o":
+                c.append("  %s_free(&cfg->%s);" %
+                         (struct_name(nodes, k), field))
+            elif n["t"] == "s":
+                c.append("  mgos_conf_free_str(&cfg->%s);" % field)
+        c.append("  (void) cfg;")
+        c.append("}\n")
+        if leaf_only:
+            c.append("bool %s_parse(struct mg_str json, struct %s *cfg) {" %
+                     (name, name))
+            strs = [k.split(".")[-1] for k in kids if nodes[k]["t"] == "s"]
+            fmt = ", ".join("%s: %s" % (k.split(".")[-1],
+                                        SCANF_FMT[nodes[k]["t"]])
+                            for k in kids)
+            args = ", ".join(("&s_%s" if nodes[k]["t"] == "s" else
+                              "&cfg->%s") % k.split(".")[-1] for k in kids)
+            c.append("  %s_set_defaults(cfg);" % name)
+            # json_scanf() allocates the strings it finds.
+            for s in strs:
+                c.append("  char *s_%s = NULL;" % s)
+            c.append('  int n = json_scanf(json.p, json.len, "{%s}", %s);' %
+                     (fmt, args))
+            for s in strs:
+                c.append("  if (s_%s != NULL) {" % s)
+                c.append("    mgos_conf_free_str(&cfg->%s);" % s)
+                c.append("    cfg->%s = s_%s;" % (s, s))
+                c.append("  }")
+            c.append("  return (n >= 0);")
+            c.append("}\n")
+
+    emit("")
+    h.append("extern struct mgos_config mgos_sys_config;\n")
+    for p, n in nodes.items():
+        fn = p.replace(".", "_")
+        if n["t"] == "o":
+            h.append("static inline const struct %s *mgos_sys_config_get_%s("
+                     "void) {" % (struct_name(nodes, p), fn))
+            h.append("  return &mgos_sys_config.%s;" % p)
+            h.append("}")
+            continue
+        ct = C_TYPES[n["t"]]
+        sep = "" if n["t"] == "s" else " "
+        h.append("static inline %s%smgos_sys_config_get_%s(void) {" %
+                 (ct, sep, fn))
+        h.append("  return mgos_sys_config.%s;" % p)
+        h.append("}")
+        h.append("static inline void mgos_sys_config_set_%s(%s%sv) {" %
+                 (fn, ct, sep))
+        if n["t"] == "s":
+            h.append("  mgos_conf_set_str(&mgos_sys_config.%s, v);" % p)
+        else:
+            h.append("  mgos_sys_config.%s = v;" % p)
+        h.append("}")
+    h.append("")
+    h.append("/* Sets a value by its dotted name, e.g. \"wifi.sta.ssid\". */")
+    h.append("bool host_sys_config_set(const char *key, const char *value);")
+
+    c.append("static const struct {")
+    c.append("  const char *key;")
+    c.append("  char type;")
+    c.append("  size_t offset;")
+    c.append("} s_fields[] = {")
+    for p, n in nodes.items():
+        if n["t"] == "o":
+            continue
+        c.append('    {"%s", \'%s\', offsetof(struct mgos_config, %s)},' %
+                 (p, n["t"], p))
+    c.append("};\n")
+    c.append("""bool host_sys_config_set(const char *key, const char *value) {
+  for (size_t i = 0; i < sizeof(s_fields) / sizeof(s_fields[0]); i++) {
+    void *p = ((char *) &mgos_sys_config) + s_fields[i].offset;
+    if (strcmp(s_fields[i].key, key) != 0) continue;
+    switch (s_fields[i].type) {
+      case 'b':
+        *((bool *) p) = (strcmp(value, "true") == 0 || atoi(value) != 0);
+        break;
+      case 'i':
+        *((int *) p) = atoi(value);
+        break;
+      case 'd':
+        *((double *) p) = atof(value);
+        break;
+      case 'f':
+        *((float *) p) = atof(value);
+        break;
+      case 's':
+        mgos_conf_set_str((const char **) p, value);
+        break;
+    }
+    return true;
+  }
+  return false;
+}""")
+    with open(os.path.join(out_dir, "mgos_sys_config.h"), "w") as f:
+        f.write("\n".join(h) + "\n")
+    with open(os.path.join(out_dir, "mgos_sys_config.c"), "w") as f:
+        f.write("\n".join(c) + "\n")
+
+
+if __name__ == "__main__":
+    main()
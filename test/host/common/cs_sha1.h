@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host builds use OpenSSL. */
+
+#pragma once
+
+#define OPENSSL_API_COMPAT 10101
+#include <openssl/sha.h>
+
+typedef SHA_CTX cs_sha1_ctx;
+
+#define cs_sha1_init(c) SHA1_Init(c)
+#define cs_sha1_update(c, d, l) SHA1_Update((c), (d), (l))
+#define cs_sha1_final(md, c) SHA1_Final((md), (c))
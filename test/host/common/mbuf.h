@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+struct mbuf {
+  char *buf;
+  size_t len;
+  size_t size;
+};
+
+void mbuf_init(struct mbuf *mb, size_t initial_size);
+size_t mbuf_append(struct mbuf *mb, const void *data, size_t len);
+void mbuf_free(struct mbuf *mb);
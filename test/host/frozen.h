@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Subset of frozen JSON functions the library uses, see host_json.c. */
+
+#pragma once
+
+#include <stdarg.h>
+
+#include "common/mbuf.h"
+
+struct json_token {
+  const char *ptr;
+  int len;
+};
+
+struct json_out {
+  struct mbuf *mbuf;
+};
+
+#define JSON_OUT_MBUF(mb) \
+  { mb }
+
+typedef int (*json_printf_callback_t)(struct json_out *, va_list *ap);
+
+int json_scanf(const char *str, int str_len, const char *fmt, ...);
+int json_scanf_array_elem(const char *s, int len, const char *path, int index,
+                          struct json_token *token);
+int json_printf(struct json_out *out, const char *fmt, ...);
+int json_vprintf(struct json_out *out, const char *fmt, va_list ap);
+int json_fprintf(const char *file_name, const char *fmt, ...);
+char *json_fread(const char *file_name);
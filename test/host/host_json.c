@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The subset of frozen the library and the simulator use: json_scanf() of
+ * top level keys, array elements by a top level path and json_printf() with
+ * unquoted keys, %Q and %M.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_file.h"
+#include "common/mbuf.h"
+#include "frozen.h"
+
+static const char *skip_ws(const char *p, const char *end) {
+  while (p < end && isspace((unsigned char) *p)) p++;
+  return p;
+}
+
+/* Returns the end of the value that starts at p. */
+static const char *skip_value(const char *p, const char *end) {
+  int depth = 0;
+  p = skip_ws(p, end);
+  do {
+    if (p >= end) return end;
+    if (*p == '"') {
+      for (p++; p < end && *p != '"'; p++) {
+        if (*p == '\\') p++;
+      }
+      p++;
+    } else if (*p == '{' || *p == '[') {
+      depth++;
+      p++;
+    } else if (*p == '}' || *p == ']') {
+      depth--;
+      p++;
+    } else if (depth == 0) {
+      while (p < end && strchr(",}] \t\r\n", *p) == NULL) p++;
+    } else {
+      p++;
+    }
+  } while (depth > 0);
+  return (p > end ? end : p);
+}
+
+/* Finds key of the object at s, returns the value and its end. */
+static const char *find_key(const char *s, int len, const char *key,
+                            int key_len, const char **val_end) {
+  const char *end = s + len, *p = skip_ws(s, end);
+  if (p >= end || *p != '{') return NULL;
+  for (p++;;) {
+    p = skip_ws(p, end);
+    if (p >= end || *p != '"') return NULL;
+    const char *k = ++p;
+    while (p < end && *p != '"') p++;
+    int klen = p - k;
+    p = skip_ws(p + 1, end);
+    if (p >= end || *p != ':') return NULL;
+    const char *v = skip_ws(p + 1, end), *ve = skip_value(v, end);
+    if (klen == key_len && strncmp(k, key, klen) == 0) {
+      *val_end = ve;
+      return v;
+    }
+    p = skip_ws(ve, end);
+    if (p >= end || *p != ',') return NULL;
+    p++;
+  }
+}
+
+static char *unquote(const char *v, const char *ve) {
+  if (*v != '"') return NULL;
+  char *res = malloc(ve - v), *r = res;
+  if (res == NULL) return NULL;
+  for (v++; v < ve - 1; v++) {
+    if (*v == '\\' && v + 1 < ve - 1) {
+      v++;
+      switch (*v) {
+        case 'n':
+          *r++ = '\n';
+          continue;
+        case 't':
+          *r++ = '\t';
+          continue;
+      }
+    }
+    *r++ = *v;
+  }
+  *r = '\0';
+  return res;
+}
+
+int json_scanf(const char *str, int str_len, const char *fmt, ...) {
+  int num = 0;
+  va_list ap;
+  va_start(ap, fmt);
+  for (const char *f = fmt; *f != '\0';) {
+    if (!isalnum((unsigned char) *f) && *f != '_') {
+      f++;
+      continue;
+    }
+    const char *key = f;
+    while (isalnum((unsigned char) *f) || *f == '_') f++;
+    int key_len = f - key;
+    while (*f != '\0' && *f != '%') f++;
+    if (*f == '\0') break;
+    char conv[4] = {0};
+    for (int i = 0; i < 3 && isalpha((unsigned char) *++f); i++) {
+      conv[i] = *f;
+      if (*f != 'l') break;
+    }
+    f++;
+    void *ptr = va_arg(ap, void *);
+    const char *ve, *v = find_key(str, str_len, key, key_len, &ve);
+    if (v == NULL || strncmp(v, "null", 4) == 0) continue;
+    if (strcmp(conv, "d") == 0) {
+      *((int *) ptr) = strtol(v, NULL, 10);
+    } else if (strcmp(conv, "lld") == 0) {
+      *((long long *) ptr) = strtoll(v, NULL, 10);
+    } else if (strcmp(conv, "f") == 0) {
+      *((float *) ptr) = strtof(v, NULL);
+    } else if (strcmp(conv, "lf") == 0) {
+      *((double *) ptr) = strtod(v, NULL);
+    } else if (strcmp(conv, "B") == 0) {
+      *((bool *) ptr) = (strncmp(v, "true", 4) == 0);
+    } else if (strcmp(conv, "Q") == 0) {
+      if (*v != '"') continue;
+      *((char **) ptr) = unquote(v, ve);
+    } else if (strcmp(conv, "T") == 0) {
+      struct json_token *t = (struct json_token *) ptr;
+      t->ptr = v;
+      t->len = ve - v;
+    } else {
+      continue;
+    }
+    num++;
+  }
+  va_end(ap);
+  return num;
+}
+
+int json_scanf_array_elem(const char *s, int len, const char *path, int index,
+                          struct json_token *token) {
+  const char *ve, *v = find_key(s, len, path + 1, strlen(path + 1), &ve);
+  if (path[0] != '.' || v == NULL || *v != '[') return -1;
+  const char *p = v + 1;
+  for (int i = 0;; i++) {
+    p = skip_ws(p, ve);
+    if (p >= ve || *p == ']') return -1;
+    const char *e = skip_value(p, ve);
+    if (i == index) {
+      token->ptr = p;
+      token->len = e - p;
+      return token->len;
+    }
+    p = skip_ws(e, ve);
+    if (p < ve && *p == ',') p++;
+  }
+}
+
+static int json_out(struct json_out *out, const char *s, size_t len) {
+  mbuf_append(out->mbuf, s, len);
+  return len;
+}
+
+int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
+  int len = 0;
+  va_list ap;
+  va_copy(ap, xap);
+  for (const char *p = fmt; *p != '\0';) {
+    if (*p == '%') {
+      char spec[16], buf[64];
+      size_t n = 0;
+      spec[n++] = *p++;
+      while (*p != '\0' && strchr("0123456789.-lh", *p) && n < 14) {
+        spec[n++] = *p++;
+      }
+      char c = *p++;
+      spec[n++] = c;
+      spec[n] = '\0';
+      if (c == 'M') {
+        json_printf_callback_t cb = va_arg(ap, json_printf_callback_t);
+        len += cb(out, &ap);
+      } else if (c == 'Q' || c == 's') {
+        const char *s = va_arg(ap, const char *);
+        if (c == 'Q') len += json_out(out, "\"", 1);
+        len += json_out(out, s, strlen(s));
+        if (c == 'Q') len += json_out(out, "\"", 1);
+      } else {
+        if (strstr(spec, "ll") != NULL) {
+          snprintf(buf, sizeof(buf), spec, va_arg(ap, long long));
+        } else if (strchr(spec, 'l') != NULL) {
+          snprintf(buf, sizeof(buf), spec, va_arg(ap, long));
+        } else if (c == 'f' || c == 'g') {
+          snprintf(buf, sizeof(buf), spec, va_arg(ap, double));
+        } else {
+          snprintf(buf, sizeof(buf), spec, va_arg(ap, int));
+        }
+        len += json_out(out, buf, strlen(buf));
+      }
+    } else if (isalpha((unsigned char) *p) || *p == '_') {
+      /* Keys are quoted, other bare words (true, null) are not. */
+      const char *w = p, *q;
+      while (isalnum((unsigned char) *p) || *p == '_') p++;
+      for (q = p; *q == ' '; q++) {
+      }
+      if (*q == ':') len += json_out(out, "\"", 1);
+      len += json_out(out, w, p - w);
+      if (*q == ':') len += json_out(out, "\"", 1);
+    } else {
+      len += json_out(out, p++, 1);
+    }
+  }
+  va_end(ap);
+  return len;
+}
+
+int json_printf(struct json_out *out, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int len = json_vprintf(out, fmt, ap);
+  va_end(ap);
+  return len;
+}
+
+int json_fprintf(const char *file_name, const char *fmt, ...) {
+  struct mbuf mb;
+  struct json_out out = JSON_OUT_MBUF(&mb);
+  va_list ap;
+  mbuf_init(&mb, 0);
+  va_start(ap, fmt);
+  int len = json_vprintf(&out, fmt, ap);
+  va_end(ap);
+  FILE *fp = fopen(file_name, "wb");
+  if (fp == NULL || fwrite(mb.buf, 1, mb.len, fp) != mb.len) len = -1;
+  if (fp != NULL) fclose(fp);
+  mbuf_free(&mb);
+  return len;
+}
+
+char *json_fread(const char *file_name) {
+  return cs_read_file(file_name, NULL);
+}
+
+void mbuf_init(struct mbuf *mb, size_t initial_size) {
+  mb->buf = (initial_size > 0 ? malloc(initial_size) : NULL);
+  mb->len = 0;
+  mb->size = (mb->buf != NULL ? initial_size : 0);
+}
+
+size_t mbuf_append(struct mbuf *mb, const void *data, size_t len) {
+  if (mb->len + len > mb->size) {
+    size_t size = (mb->len + len) * 2;
+    char *buf = realloc(mb->buf, size);
+    if (buf == NULL) return 0;
+    mb->buf = buf;
+    mb->size = size;
+  }
+  memcpy(mb->buf + mb->len, data, len);
+  mb->len += len;
+  return len;
+}
+
+void mbuf_free(struct mbuf *mb) {
+  free(mb->buf);
+  mbuf_init(mb, 0);
+}
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host implementation of the Mongoose OS services the library uses.
+ * Time is the simulator's virtual clock: timers and callbacks are events on
+ * it, so a scenario runs as fast as it can be computed. Single threaded,
+ * locks only count.
+ */
+
+#define _GNU_SOURCE /* vasprintf() */
+
+#include <arpa/inet.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_dbg.h"
+#include "common/cs_file.h"
+#include "mgos.h"
+#include "mgos_gpio.h"
+#include "mgos_hal.h"
+#include "mgos_mongoose.h"
+#include "mgos_net_hal.h"
+#include "mongoose.h"
+
+#include "ubuntu_wifi.h"
+
+#define HOST_MAX_EVENT_HANDLERS 32
+
+enum cs_log_level cs_log_level = LL_ERROR;
+
+void cs_log_set_level(enum cs_log_level level) {
+  cs_log_level = level;
+}
+
+bool cs_log_print_prefix(enum cs_log_level level, const char *file, int ln) {
+  if (level > cs_log_level) return false;
+  printf("%10.3f ", mgos_uptime());
+  (void) file;
+  (void) ln;
+  return true;
+}
+
+void cs_log_printf(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  putchar('\n');
+}
+
+int64_t mgos_uptime_micros(void) {
+  return ubuntu_wifi_sim_uptime_micros();
+}
+
+double mgos_uptime(void) {
+  return mgos_uptime_micros() / 1000000.0;
+}
+
+double mg_time(void) {
+  /* Wall clock is set, some time in late 2023. */
+  return 1.7e9 + mgos_uptime();
+}
+
+mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb,
+                             void *cb_arg) {
+  return ubuntu_wifi_sim_set_timer(msecs, flags, cb, cb_arg);
+}
+
+void mgos_clear_timer(mgos_timer_id id) {
+  ubuntu_wifi_sim_clear_timer(id);
+}
+
+bool mgos_invoke_cb(mgos_cb_t cb, void *arg, bool from_isr) {
+  /* Runs after the current event, like a callback queued to the main task. */
+  (void) from_isr;
+  return (ubuntu_wifi_sim_set_timer(0, 0, cb, arg) != MGOS_INVALID_TIMER_ID);
+}
+
+struct mgos_rlock_type {
+  int depth;
+};
+
+struct mgos_rlock_type *mgos_rlock_create(void) {
+  return calloc(1, sizeof(struct mgos_rlock_type));
+}
+
+void mgos_rlock(struct mgos_rlock_type *l) {
+  l->depth++;
+}
+
+void mgos_runlock(struct mgos_rlock_type *l) {
+  l->depth--;
+}
+
+void mgos_lock(void) {
+}
+
+void mgos_unlock(void) {
+}
+
+void mgos_ints_disable(void) {
+}
+
+void mgos_ints_enable(void) {
+}
+
+size_t mgos_get_free_heap_size(void) {
+  return 1024 * 1024;
+}
+
+static struct {
+  int ev; /* Or group base */
+  bool group;
+  mgos_event_handler_t cb;
+  void *userdata;
+} s_handlers[HOST_MAX_EVENT_HANDLERS];
+static int s_num_handlers;
+
+bool mgos_event_register_base(int base_event_number, const char *name) {
+  (void) base_event_number;
+  (void) name;
+  return true;
+}
+
+static bool add_handler(int ev, bool group, mgos_event_handler_t cb,
+                        void *userdata) {
+  if (s_num_handlers == HOST_MAX_EVENT_HANDLERS) return false;
+  s_handlers[s_num_handlers].ev = ev;
+  s_handlers[s_num_handlers].group = group;
+  s_handlers[s_num_handlers].cb = cb;
+  s_handlers[s_num_handlers].userdata = userdata;
+  s_num_handlers++;
+  return true;
+}
+
+bool mgos_event_add_handler(int ev, mgos_event_handler_t cb, void *userdata) {
+  return add_handler(ev, false, cb, userdata);
+}
+
+bool mgos_event_add_group_handler(int evgrp, mgos_event_handler_t cb,
+                                  void *userdata) {
+  return add_handler(evgrp, true, cb, userdata);
+}
+
+int mgos_event_trigger(int ev, void *ev_data) {
+  int num = 0;
+  for (int i = 0; i < s_num_handlers; i++) {
+    int match = (s_handlers[i].group ? (ev & ~0xff) : ev);
+    if (match != s_handlers[i].ev) continue;
+    s_handlers[i].cb(ev, ev_data, s_handlers[i].userdata);
+    num++;
+  }
+  return num;
+}
+
+void mgos_net_dev_event_cb(enum mgos_net_if_type if_type, int if_instance,
+                           enum mgos_net_event ev) {
+  (void) if_type;
+  (void) if_instance;
+  (void) ev;
+}
+
+bool mgos_net_str_to_ip(const char *ips, struct sockaddr_in *sin) {
+  memset(sin, 0, sizeof(*sin));
+  sin->sin_family = AF_INET;
+  return (inet_pton(AF_INET, ips, &sin->sin_addr) == 1);
+}
+
+char *mgos_net_ip_to_str(const struct sockaddr_in *sin, char *out) {
+  return (char *) inet_ntop(AF_INET, &sin->sin_addr, out, INET_ADDRSTRLEN);
+}
+
+bool mgos_gpio_set_mode(int pin, enum mgos_gpio_mode mode) {
+  (void) pin;
+  (void) mode;
+  return true;
+}
+
+bool mgos_gpio_set_pull(int pin, enum mgos_gpio_pull_type pull) {
+  (void) pin;
+  (void) pull;
+  return true;
+}
+
+bool mgos_gpio_read(int pin) {
+  (void) pin;
+  return true;
+}
+
+void mgos_expand_mac_address_placeholders(char *str) {
+  (void) str;
+}
+
+struct mg_mgr *mgos_get_mgr(void) {
+  return NULL;
+}
+
+bool mgos_conf_str_empty(const char *s) {
+  return (s == NULL || s[0] == '\0');
+}
+
+void mgos_conf_set_str(const char **vp, const char *v) {
+  mgos_conf_free_str(vp);
+  if (!mgos_conf_str_empty(v)) *vp = strdup(v);
+}
+
+void mgos_conf_free_str(const char **vp) {
+  free((void *) *vp);
+  *vp = NULL;
+}
+
+void mgos_sys_config_register_validator(mgos_config_validator_fn fn) {
+  (void) fn;
+}
+
+bool save_cfg(const struct mgos_config *cfg, char **msg) {
+  (void) cfg;
+  (void) msg;
+  return true;
+}
+
+char *cs_read_file(const char *path, size_t *size) {
+  char *data = NULL;
+  long len;
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) return NULL;
+  if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 ||
+      fseek(fp, 0, SEEK_SET) != 0 || (data = malloc(len + 1)) == NULL ||
+      fread(data, 1, len, fp) != (size_t) len) {
+    free(data);
+    data = NULL;
+  } else {
+    data[len] = '\0';
+    if (size != NULL) *size = len;
+  }
+  fclose(fp);
+  return data;
+}
+
+struct mg_str mg_mk_str(const char *s) {
+  struct mg_str res = {s, (s != NULL ? strlen(s) : 0)};
+  return res;
+}
+
+struct mg_str mg_mk_str_n(const char *s, size_t len) {
+  struct mg_str res = {s, len};
+  return res;
+}
+
+/* There is no network stack, the AP mode DNS responder is never bound. */
+
+int mg_asprintf(char **buf, size_t size, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vasprintf(buf, fmt, ap);
+  va_end(ap);
+  (void) size;
+  return len;
+}
+
+struct mg_connection *mg_bind(struct mg_mgr *mgr, const char *addr,
+                              mg_event_handler_t handler, void *user_data) {
+  (void) mgr;
+  (void) addr;
+  (void) handler;
+  (void) user_data;
+  return NULL;
+}
+
+void mg_set_protocol_dns(struct mg_connection *nc) {
+  (void) nc;
+}
+
+struct mg_dns_reply mg_dns_create_reply(struct mbuf *io,
+                                        struct mg_dns_message *msg) {
+  struct mg_dns_reply r = {msg};
+  (void) io;
+  return r;
+}
+
+int mg_dns_uncompress_name(struct mg_dns_message *msg, struct mg_str *name,
+                           char *dst, int dst_len) {
+  (void) msg;
+  (void) name;
+  if (dst_len > 0) dst[0] = '\0';
+  return 0;
+}
+
+int mg_dns_reply_record(struct mg_dns_reply *reply,
+                        struct mg_dns_resource_record *question,
+                        const char *name, int rtype, int ttl,
+                        const void *rdata, size_t rdata_len) {
+  (void) reply;
+  (void) question;
+  (void) name;
+  (void) rtype;
+  (void) ttl;
+  (void) rdata;
+  (void) rdata_len;
+  return -1;
+}
+
+void mg_dns_send_reply(struct mg_connection *nc, struct mg_dns_reply *r) {
+  (void) nc;
+  (void) r;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-ins for the parts of the Mongoose OS API the library uses, just
+ * enough to run it against the simulated HAL. See host_mgos.c.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "common/cs_dbg.h"
+#include "common/mg_str.h"
+#include "common/platform.h"
+#include "common/queue.h"
+#include "frozen.h"
+
+#include "mgos_event.h"
+#include "mgos_net.h"
+#include "mgos_sys_config.h"
+#include "mgos_system.h"
+#include "mgos_time.h"
+#include "mgos_timers.h"
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+struct mgos_config;
+
+bool mgos_conf_str_empty(const char *s);
+void mgos_conf_set_str(const char **vp, const char *v);
+void mgos_conf_free_str(const char **vp);
+
+typedef bool (*mgos_config_validator_fn)(const struct mgos_config *cfg,
+                                         char **msg);
+void mgos_sys_config_register_validator(mgos_config_validator_fn fn);
+bool save_cfg(const struct mgos_config *cfg, char **msg);
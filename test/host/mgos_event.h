@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MGOS_EVENT_BASE(a, b, c) ((a) << 24 | (b) << 16 | (c) << 8)
+#define MGOS_EVENT_SYS MGOS_EVENT_BASE('M', 'O', 'S')
+
+enum mgos_event_sys {
+  MGOS_EVENT_INIT_DONE = MGOS_EVENT_SYS,
+  MGOS_EVENT_REBOOT_AFTER,
+  MGOS_EVENT_REBOOT,
+};
+
+struct mgos_event_reboot_after_arg {
+  int64_t reboot_at_uptime_micros;
+};
+
+typedef void (*mgos_event_handler_t)(int ev, void *ev_data, void *userdata);
+
+bool mgos_event_register_base(int base_event_number, const char *name);
+int mgos_event_trigger(int ev, void *ev_data);
+bool mgos_event_add_handler(int ev, mgos_event_handler_t cb, void *userdata);
+bool mgos_event_add_group_handler(int evgrp, mgos_event_handler_t cb,
+                                  void *userdata);
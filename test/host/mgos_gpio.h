@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+enum mgos_gpio_mode {
+  MGOS_GPIO_MODE_INPUT,
+  MGOS_GPIO_MODE_OUTPUT,
+};
+
+enum mgos_gpio_pull_type {
+  MGOS_GPIO_PULL_NONE,
+  MGOS_GPIO_PULL_UP,
+};
+
+bool mgos_gpio_set_mode(int pin, enum mgos_gpio_mode mode);
+bool mgos_gpio_set_pull(int pin, enum mgos_gpio_pull_type pull);
+bool mgos_gpio_read(int pin);
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+enum mgos_net_if_type {
+  MGOS_NET_IF_TYPE_WIFI,
+  MGOS_NET_IF_TYPE_ETHERNET,
+};
+
+enum mgos_net_event {
+  MGOS_NET_EV_DISCONNECTED,
+  MGOS_NET_EV_CONNECTING,
+  MGOS_NET_EV_CONNECTED,
+  MGOS_NET_EV_IP_ACQUIRED,
+};
+
+struct mgos_net_ip_info {
+  struct sockaddr_in ip;
+  struct sockaddr_in netmask;
+  struct sockaddr_in gw;
+};
+
+bool mgos_net_str_to_ip(const char *ips, struct sockaddr_in *sin);
+char *mgos_net_ip_to_str(const struct sockaddr_in *sin, char *out);
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*mgos_cb_t)(void *arg);
+
+bool mgos_invoke_cb(mgos_cb_t cb, void *arg, bool from_isr);
+
+struct mgos_rlock_type;
+struct mgos_rlock_type *mgos_rlock_create(void);
+void mgos_rlock(struct mgos_rlock_type *l);
+void mgos_runlock(struct mgos_rlock_type *l);
+
+void mgos_lock(void);
+void mgos_unlock(void);
+void mgos_ints_disable(void);
+void mgos_ints_enable(void);
+
+size_t mgos_get_free_heap_size(void);
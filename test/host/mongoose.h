@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Only the DNS bits that the AP mode captive portal uses. */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/mbuf.h"
+#include "common/mg_str.h"
+
+#define MG_DNS_MESSAGE 100
+#define MG_DNS_A_RECORD 1
+
+struct mg_mgr;
+struct mg_connection;
+
+struct mg_dns_resource_record {
+  struct mg_str name;
+  int rtype;
+};
+
+struct mg_dns_message {
+  int num_questions;
+  struct mg_dns_resource_record questions[4];
+};
+
+struct mg_dns_reply {
+  struct mg_dns_message *msg;
+};
+
+typedef void (*mg_event_handler_t)(struct mg_connection *nc, int ev,
+                                   void *ev_data, void *user_data);
+
+int mg_asprintf(char **buf, size_t size, const char *fmt, ...);
+struct mg_connection *mg_bind(struct mg_mgr *mgr, const char *addr,
+                              mg_event_handler_t handler, void *user_data);
+void mg_set_protocol_dns(struct mg_connection *nc);
+struct mg_dns_reply mg_dns_create_reply(struct mbuf *io,
+                                        struct mg_dns_message *msg);
+int mg_dns_uncompress_name(struct mg_dns_message *msg, struct mg_str *name,
+                           char *dst, int dst_len);
+int mg_dns_reply_record(struct mg_dns_reply *reply,
+                        struct mg_dns_resource_record *question,
+                        const char *name, int rtype, int ttl,
+                        const void *rdata, size_t rdata_len);
+void mg_dns_send_reply(struct mg_connection *nc, struct mg_dns_reply *r);
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Scan result matching microbenchmark: check_ap() with the precompiled
+ * config descriptors against the string matching it replaced, kept below as
+ * ref_check_ap(). Both run over the same synthetic scan results and must
+ * agree on every one of them.
+ *
+ *   match_bench [num_results [num_passes]]
+ *
+ * check_ap() is static, so the STA manager is included rather than linked.
+ */
+
+#include "../src/mgos_wifi_sta.c"
+
+#include <time.h>
+
+#define NUM_CFGS 8
+
+/* cfg_matches() before descriptors were introduced. */
+static bool ref_cfg_matches(const struct mgos_config_wifi_sta *cfg,
+                            const struct mgos_wifi_scan_result *e) {
+  if (!cfg->enable) return false;
+  if (strcmp(cfg->ssid, e->ssid) != 0) return false;
+  bool have_pass = !mgos_conf_str_empty(cfg->pass);
+  bool is_eap =
+      (!mgos_conf_str_empty(cfg->cert) || !mgos_conf_str_empty(cfg->user));
+  switch (e->auth_mode) {
+    case MGOS_WIFI_AUTH_MODE_OPEN:
+      if (have_pass || is_eap) return false;
+      break;
+    case MGOS_WIFI_AUTH_MODE_WPA2_ENTERPRISE:
+      if (!is_eap) return false;
+      break;
+    case MGOS_WIFI_AUTH_MODE_WEP:
+    case MGOS_WIFI_AUTH_MODE_WPA_PSK:
+    case MGOS_WIFI_AUTH_MODE_WPA2_PSK:
+    case MGOS_WIFI_AUTH_MODE_WPA_WPA2_PSK:
+      if (!have_pass) return false;
+      break;
+  }
+  if (!mgos_conf_str_empty(cfg->bssid)) {
+    char bssid_s[20];
+    mgos_wifi_sta_bssid_to_str(e->bssid, bssid_s);
+    if (strcasecmp(cfg->bssid, bssid_s) != 0) return false;
+  }
+  return true;
+}
+
+/* check_ap() before descriptors, less the database which is off here. */
+static bool ref_check_ap(const struct mgos_wifi_scan_result *e, int *cfg_idx,
+                         const char **reason) {
+  *cfg_idx = -1;
+  for (int i = 0; i < s_num_cfgs; i++) {
+    if (ref_cfg_matches(s_cfgs[i], e)) {
+      *cfg_idx = i;
+      break;
+    }
+  }
+  if (*cfg_idx < 0) {
+    *reason = "no matching config";
+    return false;
+  }
+  if (e->rssi < mgos_sys_config_get_wifi_sta_rssi_thr()) {
+    *reason = "too weak";
+    return false;
+  }
+  *reason = "ok";
+  return true;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Networks "Store000" to "Store299", of which NUM_CFGS are configured, the
+ * last one pinned to a BSSID. Auth modes and signal levels vary, so all the
+ * reasons to reject a result come up.
+ */
+static void make_results(struct mgos_wifi_scan_result *res, int n) {
+  uint32_t r = 7;
+  memset(res, 0, n * sizeof(*res));
+  for (int i = 0; i < n; i++) {
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    snprintf(res[i].ssid, sizeof(res[i].ssid), "Store%03u", r % 300);
+    /* Some past the known ones, which are not filtered on. */
+    int mode = (r >> 10) % 8;
+    res[i].auth_mode = (enum mgos_wifi_auth_mode)(mode < 6 ? mode : mode * 6);
+    res[i].bssid[0] = 2;
+    res[i].bssid[5] = r >> 16;
+    res[i].rssi = -40 - (r >> 20) % 60;
+  }
+}
+
+int main(int argc, char **argv) {
+  int num_res = (argc > 1 ? atoi(argv[1]) : 2000);
+  int num_passes = (argc > 2 ? atoi(argv[2]) : 2000);
+  struct mgos_config_wifi_sta cfgs[NUM_CFGS];
+  char ssids[NUM_CFGS][33];
+  mgos_config_set_defaults(&mgos_sys_config);
+  host_sys_config_set("wifi.sta_db_enable", "false");
+  memset(cfgs, 0, sizeof(cfgs));
+  for (int i = 0; i < NUM_CFGS; i++) {
+    snprintf(ssids[i], sizeof(ssids[i]), "Store%03d", i * 37);
+    cfgs[i].enable = true;
+    cfgs[i].ssid = ssids[i];
+    cfgs[i].pass = "password1";
+    if (i == NUM_CFGS - 1) cfgs[i].bssid = "02:00:00:00:00:07";
+    if (!mgos_wifi_sta_add_cfg(&cfgs[i])) return 1;
+  }
+  struct mgos_wifi_scan_result *res = calloc(num_res, sizeof(*res));
+  if (res == NULL || num_res <= 0 || num_passes <= 0) return 1;
+  make_results(res, num_res);
+
+  int num_matched = 0;
+  for (int i = 0; i < num_res; i++) {
+    int idx, ref_idx;
+    const char *reason, *ref_reason;
+    bool ok = check_ap(&res[i], mgos_sys_config_get_wifi_sta_rssi_thr(),
+                       &idx, NULL, &reason);
+    bool ref_ok = ref_check_ap(&res[i], &ref_idx, &ref_reason);
+    if (ok != ref_ok || idx != ref_idx || strcmp(reason, ref_reason) != 0) {
+      fprintf(stderr, "%s %d: %s / %s, expected %s / %s\n", res[i].ssid,
+              res[i].auth_mode, (ok ? "ok" : "no"), reason,
+              (ref_ok ? "ok" : "no"), ref_reason);
+      return 1;
+    }
+    if (ok) num_matched++;
+  }
+
+  volatile int sink = 0;
+  double t0 = now_ns();
+  for (int p = 0; p < num_passes; p++) {
+    for (int i = 0; i < num_res; i++) {
+      int idx;
+      const char *reason;
+      sink += ref_check_ap(&res[i], &idx, &reason);
+    }
+  }
+  double t1 = now_ns();
+  for (int p = 0; p < num_passes; p++) {
+    /* The threshold is read once per scan, as in build_queue(). */
+    int rssi_thr = mgos_sys_config_get_wifi_sta_rssi_thr();
+    for (int i = 0; i < num_res; i++) {
+      int idx;
+      const char *reason;
+      sink += check_ap(&res[i], rssi_thr, &idx, NULL, &reason);
+    }
+  }
+  double t2 = now_ns();
+  double n = (double) num_res * num_passes;
+  printf("%d configs, %d scan results, %d passes, %d matched per pass\n",
+         NUM_CFGS, num_res, num_passes, num_matched);
+  printf("%-12s %8.1f ns per scan result\n", "strings", (t1 - t0) / n);
+  printf("%-12s %8.1f ns per scan result\n", "descriptors", (t2 - t1) / n);
+  (void) sink;
+  mgos_wifi_sta_clear_cfgs();
+  free(res);
+  return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Known answer tests for mgos_wifi_pbkdf2_sha1() (RFC 6070) and
+ * mgos_wifi_sta_derive_pmk() (IEEE 802.11i-2004, H.4), followed by the time
+ * it takes to derive a PMK on this host.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "mgos_wifi_sta.h"
+
+struct pbkdf2_vector {
+  const char *pass;
+  size_t pass_len;
+  const char *salt;
+  size_t salt_len;
+  int iterations;
+  const char *dk; /* Hex */
+};
+
+/* All but the one with 16777216 iterations. */
+static const struct pbkdf2_vector s_rfc6070[] = {
+    {"password", 8, "salt", 4, 1, "0c60c80f961f0e71f3a9b524af6012062fe037a6"},
+    {"password", 8, "salt", 4, 2, "ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957"},
+    {"password", 8, "salt", 4, 4096,
+     "4b007901b765489abead49d926f721d065a429c1"},
+    {"passwordPASSWORDpassword", 24, "saltSALTsaltSALTsaltSALTsaltSALTsalt",
+     36, 4096, "3d2eec4fe41c849b80c8d83662c0e44a8b291a964cf2f07038"},
+    {"pass\0word", 9, "sa\0lt", 5, 4096, "56fa6aa75548099dcc37d7f03425e0c3"},
+};
+
+static const struct {
+  const char *ssid;
+  const char *pass;
+  const char *pmk; /* Hex */
+} s_ieee80211i[] = {
+    {"IEEE", "password",
+     "f42c6fc52df0ebef9ebb4b90b38a5f902e83fe1b135a70e23aed762e9710a12e"},
+    {"ThisIsASSID", "ThisIsAPassword",
+     "0dc0d6eb90555ed6419756b9a15ec3e3209b63df707dd508d14581f8982721af"},
+};
+
+static void to_hex(const uint8_t *data, size_t len, char *out) {
+  for (size_t i = 0; i < len; i++) sprintf(out + i * 2, "%02x", data[i]);
+}
+
+static bool check(const char *what, const char *expected, const uint8_t *out,
+                  size_t len) {
+  char hex[65];
+  to_hex(out, len, hex);
+  if (strcmp(hex, expected) == 0) return true;
+  printf("FAIL %s: %s, expected %s\n", what, hex, expected);
+  return false;
+}
+
+int main(void) {
+  int num_failed = 0;
+  uint8_t out[32];
+  for (size_t i = 0; i < sizeof(s_rfc6070) / sizeof(s_rfc6070[0]); i++) {
+    const struct pbkdf2_vector *v = &s_rfc6070[i];
+    char what[32];
+    size_t len = strlen(v->dk) / 2;
+    snprintf(what, sizeof(what), "RFC 6070 #%d", (int) i + 1);
+    mgos_wifi_pbkdf2_sha1((const uint8_t *) v->pass, v->pass_len,
+                          (const uint8_t *) v->salt, v->salt_len,
+                          v->iterations, out, len);
+    if (!check(what, v->dk, out, len)) num_failed++;
+  }
+  for (size_t i = 0; i < sizeof(s_ieee80211i) / sizeof(s_ieee80211i[0]);
+       i++) {
+    mgos_wifi_sta_derive_pmk(s_ieee80211i[i].ssid, s_ieee80211i[i].pass, out);
+    if (!check(s_ieee80211i[i].ssid, s_ieee80211i[i].pmk, out, sizeof(out))) {
+      num_failed++;
+    }
+  }
+  printf("%s\n", (num_failed == 0 ? "PASS" : "FAIL"));
+
+  /* 4096 iterations, two blocks: what the cache saves on every attempt. */
+  struct timespec t0, t1;
+  int n = 20;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < n; i++) {
+    mgos_wifi_sta_derive_pmk("SimNet", "SimPass123", out);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double ms =
+      (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+  printf("%.2f ms per PMK\n", ms / n);
+  return (num_failed == 0 ? 0 : 1);
+}
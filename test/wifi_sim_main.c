@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) Mongoose OS Contributors
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Connection benchmark runner: runs the STA manager against the simulated
+ * HAL on its virtual clock, one scenario at a time, and prints a row of
+ * figures for each.
+ *
+ *   wifi_sim [-t seconds] [-v log_level] [key=value ...] scenario ...
+ *
+ * A scenario is a name of a built-in one or a JSON file, see the "Simulated
+ * WiFi" section of README.md. Files can also have:
+ *
+ *   "duration_s": 300,                         // Instead of -t
+ *   "config": ["wifi.sta_roam_interval=30"]    // Settings for the scenario
+ *
+ * key=value arguments are settings for all scenarios, e.g.
+ * wifi.sta_pmk_cache=false. The station is set up for SimNet / SimPass123.
+ *
+ * Each scenario runs in a child process with a fresh library state and an
+ * empty working directory, so that files kept across reboots (last AP,
+ * history) do not carry over.
+ */
+
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mgos.h"
+#include "mgos_wifi.h"
+#include "ubuntu_wifi.h"
+
+#define DEFAULT_DURATION_S 120
+
+bool mgos_wifi_init(void);
+
+/*
+ * Calls of the library to mgos_wifi_sta_derive_pmk() are routed here by the
+ * linker (--wrap), so that the time it takes is charged to the virtual clock.
+ */
+void __real_mgos_wifi_sta_derive_pmk(const char *ssid, const char *pass,
+                                     uint8_t pmk[32]);
+
+void __wrap_mgos_wifi_sta_derive_pmk(const char *ssid, const char *pass,
+                                     uint8_t pmk[32]) {
+  __real_mgos_wifi_sta_derive_pmk(ssid, pass, pmk);
+  ubuntu_wifi_sim_pmk_derived();
+}
+
+static const char *s_base_cfg[] = {
+    "device.id=ubuntu_0a0b0c",
+    "wifi.ap.enable=false",
+    "wifi.sta.enable=true",
+    "wifi.sta.ssid=SimNet",
+    "wifi.sta.pass=SimPass123",
+    "wifi.sim.realtime=false",
+    "wifi.sim.report=false",
+};
+
+static bool set_cfg(const char *kv) {
+  char key[100];
+  const char *eq = strchr(kv, '=');
+  if (eq == NULL || eq - kv >= (int) sizeof(key)) return false;
+  memcpy(key, kv, eq - kv);
+  key[eq - kv] = '\0';
+  return host_sys_config_set(key, eq + 1);
+}
+
+static bool set_scenario_cfg(const char *json, int *duration_s) {
+  struct json_token t;
+  int len = strlen(json);
+  json_scanf(json, len, "{duration_s: %d}", duration_s);
+  for (int i = 0; json_scanf_array_elem(json, len, ".config", i, &t) > 0;
+       i++) {
+    char kv[200];
+    if (t.len < 2 || t.ptr[0] != '"' || t.len - 2 >= (int) sizeof(kv)) {
+      return false;
+    }
+    memcpy(kv, t.ptr + 1, t.len - 2);
+    kv[t.len - 2] = '\0';
+    if (!set_cfg(kv)) {
+      fprintf(stderr, "Invalid setting %s\n", kv);
+      return false;
+    }
+  }
+  return true;
+}
+
+static const char *scenario_name(const char *scenario) {
+  const char *name = strrchr(scenario, '/');
+  return (name != NULL ? name + 1 : scenario);
+}
+
+static void print_header(void) {
+  printf("%-20s %8s %6s %8s %5s %9s %5s %9s %6s %8s\n", "scenario",
+         "tti_ms", "scans", "attempts", "lost", "failover", "roams",
+         "dead_air", "rssi_r", "assoc50");
+}
+
+static int run_scenario(const char *scenario, int duration_s, int argc,
+                        char **argv) {
+  struct ubuntu_wifi_sim_stats st;
+  struct mgos_wifi_stats ws;
+  mgos_config_set_defaults(&mgos_sys_config);
+  for (int i = 0; i < (int) ARRAY_SIZE(s_base_cfg); i++) {
+    set_cfg(s_base_cfg[i]);
+  }
+  mgos_sys_config_set_wifi_sim_scenario(scenario);
+  char *json = json_fread(scenario);
+  if (json != NULL && !set_scenario_cfg(json, &duration_s)) return 1;
+  free(json);
+  for (int i = 0; i < argc; i++) {
+    if (!set_cfg(argv[i])) {
+      fprintf(stderr, "Invalid setting %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (!mgos_wifi_init()) return 1;
+  ubuntu_wifi_sim_run((int64_t) duration_s * 1000000);
+  ubuntu_wifi_sim_get_stats(&st);
+  mgos_wifi_get_stats(&ws);
+  printf("%-20s %8lld %6d %8d %5d %9lld %5d %9lld %6d %8d\n",
+         scenario_name(scenario), (long long) st.first_ip_ms, st.num_scans,
+         st.num_attempts, st.num_links_lost, (long long) st.max_failover_ms,
+         st.num_roams, (long long) st.dead_air_ms, st.num_rssi_reads,
+         mgos_wifi_stats_hist_percentile(&ws.assoc_ms, 50));
+  fflush(stdout);
+  mgos_wifi_deinit();
+  mgos_config_free(&mgos_sys_config);
+  return 0;
+}
+
+static void remove_dir(const char *path) {
+  char fn[PATH_MAX];
+  struct dirent *de;
+  DIR *dir = opendir(path);
+  while (dir != NULL && (de = readdir(dir)) != NULL) {
+    if (de->d_name[0] == '.') continue;
+    snprintf(fn, sizeof(fn), "%s/%s", path, de->d_name);
+    remove(fn);
+  }
+  if (dir != NULL) closedir(dir);
+  rmdir(path);
+}
+
+int main(int argc, char **argv) {
+  int opt, duration_s = DEFAULT_DURATION_S, num_failed = 0, num_cfg = 0;
+  char *cfg[argc];
+  while ((opt = getopt(argc, argv, "t:v:")) != -1) {
+    switch (opt) {
+      case 't':
+        duration_s = atoi(optarg);
+        break;
+      case 'v':
+        cs_log_set_level((enum cs_log_level) atoi(optarg));
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-t seconds] [-v log_level] [key=value ...] "
+                "scenario ...\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  for (int i = optind; i < argc; i++) {
+    if (strchr(argv[i], '=') != NULL) cfg[num_cfg++] = argv[i];
+  }
+  print_header();
+  for (int i = optind; i < argc; i++) {
+    char dir[] = "/tmp/wifi_sim.XXXXXX", path[PATH_MAX];
+    const char *scenario = argv[i];
+    if (strchr(scenario, '=') != NULL) continue;
+    /* The child changes directory. */
+    if (realpath(scenario, path) != NULL) scenario = path;
+    if (mkdtemp(dir) == NULL) return 1;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      if (chdir(dir) != 0) _exit(1);
+      _exit(run_scenario(scenario, duration_s, num_cfg, cfg));
+    }
+    int status = -1;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "%s: failed\n", argv[i]);
+      num_failed++;
+    }
+    remove_dir(dir);
+  }
+  return (num_failed == 0 ? 0 : 1);
+}